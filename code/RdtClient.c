@@ -1,77 +1,725 @@
 // Copyright 2022 190010906
 //
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "rdt.h"
+#include "multipath/multipath.h"
+#include "rto/rto.h"
+#include "pcap/pcap.h"
+#include "trace/trace.h"
 
-FILE    *file;
 char    *buf;
 uint32_t n;
 struct timespec start;
 struct timespec end;
 
+bool     timing = false;
+bool     resume = false;
+bool     stats = false;
+bool     ephemeral = false;   // Send from any free port, rather than getuid(), so many clients can share a host.
+bool     async = false;       // Run every stripe from the main thread, with rdtSendAsync() and epoll.
+int      stripes = 1;
+uint64_t transfer_id = 0;
+char**   next_files = NULL;
+int      next_count = 0;
+uint32_t lifetime = 0;        // Messages: ms each has to be delivered in before it's abandoned, or 0.
+char**   stream_files = NULL; // Sent on streams 1, 2, ... ahead of the file, which goes on stream 0.
+int      stream_count = 0;
+char**   path_specs = NULL;   // Multipath: [local/]remote of each path after the first, which is to hostname.
+int      path_count = 0;
+PathSet_t  paths;
+PathSet_t* path_set = NULL;   // Multipath: the paths every socket sends on, or NULL.
+char     rto_cache_path[FILENAME_MAX] = "";
+char*    capture = NULL;
+char*    reply_path = NULL;   // duplex: where to write what the server sends back.
+
+/* A stripe sent on a thread of its own */
+typedef struct Stripe_s {
+  const char* hostname;
+  int         i;        // Stripe number, or -1 if its thread didn't start.
+  uint32_t    first;    // Position of the stripe in the file.
+  uint32_t    length;
+  int         r;        // What sendRange() returned.
+  pthread_t   thread;
+  RdtState_t* c;        // async: its connection, until it's done.
+  RdtSocket_t* socket;  // async: its socket.
+  RdtCallbacks_t callbacks;  // async: callbacks, with the stripe as arg.
+  int         percent;  // async: progress last printed.
+} Stripe_t;
+
+/**
+ * Derives a transfer ID from the file's path, size and modification time (FNV-1a), so a rerun of an
+ * interrupted transfer of the same file resumes it.
+ * @param path Path of the file being sent.
+ * @return uint64_t non-zero transfer ID.
+ */
+uint64_t transferId(const char* path) {
+  struct stat st;
+  uint64_t h = 14695981039346656037ULL;
+
+  if (stat(path, &st) != 0) {
+    return 0;
+  }
+
+  for (const char* c = path; *c; c++) {
+    h = (h ^ (uint8_t) *c) * 1099511628211ULL;
+  }
+  uint64_t fields[2] = { (uint64_t) st.st_size, (uint64_t) st.st_mtime };
+  for (size_t i = 0; i < sizeof(fields); i++) {
+    h = (h ^ ((uint8_t*) fields)[i]) * 1099511628211ULL;
+  }
+
+  return h != 0 ? h : 1;
+}
+
+/**
+ * Prints the statistics of a connection's last transfer, if asked to.
+ * @param c The connection.
+ */
+void printStats(RdtState_t* c) {
+  RdtStats_t s;
+
+  if (stats) {
+    rdtGetStats_r(c, &s);
+    rdtPrintStats(stdout, &s);
+  }
+}
+
+/**
+ * Sends a byte range of the file. In resume mode a failed attempt is retried up to RDT_MAX_RESUMES
+ * times, and the receiver tells us where to pick up from.
+ * @param c The connection to send on.
+ * @param socket The socket to send over.
+ * @param first Position of the range in the file.
+ * @param length Size of the range.
+ * @param id Transfer ID, or 0.
+ * @return 0 if the range was sent, -1 otherwise.
+ */
+int sendRange(RdtState_t* c, RdtSocket_t* socket, uint32_t first, uint32_t length, uint64_t id) {
+  int r = rdtSend_r(c, socket, buf + first, length);
+
+  for (int attempt = 0; r != 0 && resume && attempt < RDT_MAX_RESUMES; attempt++) {
+    printf("Transfer interrupted. Resuming (attempt %d of %d)...\n", attempt + 1, RDT_MAX_RESUMES);
+    sleep(1);
+    c->offset = first;
+    c->transfer_id = id;
+    r = rdtSend_r(c, socket, buf + first, length);
+  }
+
+  /* Keep the RTT estimate for the next run */
+  if (rto_cache_path[0] != '\0') {
+    rtoCacheSave(rto_cache_path);
+  }
+  printStats(c);
+  return r;
+}
+
+/**
+ * Thread of one stripe. Its connection and socket are its own, and the connection is driven from the
+ * thread, not by signals.
+ * @param arg The Stripe_t.
+ * @return NULL.
+ */
+void* stripeThread(void* arg) {
+  Stripe_t* stripe = (Stripe_t*) arg;
+  uint16_t port = getuid() + stripe->i;
+
+  stripe->r = -1;
+  RdtSocket_t* socket = setupRdtSocketFrom_t(stripe->hostname, port, ephemeral ? 0 : port);
+  if (socket == (RdtSocket_t*) -1) {
+    printf("Couldn't open socket for stripe %d.\n", stripe->i);
+    return NULL;
+  }
+  socket->paths = path_set;
+
+  RdtState_t* c = rdtCreateState();
+  if (c != NULL) {
+    c->polled = true;
+    c->compress = G_conn->compress;
+    c->offset = stripe->first;
+    c->transfer_id = transfer_id != 0 ? transfer_id + stripe->i : 0;
+    stripe->r = sendRange(c, socket, stripe->first, stripe->length, c->transfer_id);
+    rdtFreeState(c);
+  }
+
+  closeRdtSocket_t(socket);
+  return NULL;
+}
+
+/**
+ * Sends the file as 'stripes' byte ranges, each over its own RDT connection on a thread of its own.
+ * Stripe i uses remote port getuid() + i, and the same local port unless ephemeral. The receiver
+ * places it using its offset.
+ * @param hostname The host to send to.
+ * @return 0 if every stripe was sent, -1 otherwise.
+ */
+int sendStriped(const char* hostname) {
+  uint32_t chunk = (n + stripes - 1) / stripes;
+  int failed = 0;
+
+  Stripe_t* threads = (Stripe_t*) calloc(stripes, sizeof(Stripe_t));
+  if (threads == NULL) {
+    perror("Couldn't allocate stripes");
+    return -1;
+  }
+
+  for (int i = 0; i < stripes; i++) {
+    threads[i].hostname = hostname;
+    threads[i].i = i;
+    threads[i].first = (uint32_t) i * chunk < n ? (uint32_t) i * chunk : n;
+    threads[i].length = n - threads[i].first < chunk ? n - threads[i].first : chunk;
+
+    if (pthread_create(&threads[i].thread, NULL, stripeThread, &threads[i]) != 0) {
+      perror("Couldn't start stripe");
+      threads[i].i = -1;
+      failed++;
+    }
+  }
+
+  /* Wait for every stripe */
+  for (int i = 0; i < stripes; i++) {
+    if (threads[i].i >= 0) {
+      pthread_join(threads[i].thread, NULL);
+      failed += threads[i].r != 0;
+    }
+  }
+  free(threads);
+
+  if (failed) {
+    printf("%d of %d stripes failed.\n", failed, stripes);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * async: prints a stripe's progress every 10%.
+ * @param c The stripe's connection.
+ * @param bytes Bytes acknowledged.
+ * @param total Bytes to send.
+ * @param arg The Stripe_t.
+ */
+void stripeProgress(RdtState_t* c, uint64_t bytes, uint64_t total, void* arg) {
+  Stripe_t* stripe = (Stripe_t*) arg;
+  int percent = total > 0 ? (int) (bytes * 10 / total) * 10 : 100;
+
+  if (percent > stripe->percent) {
+    stripe->percent = percent;
+    printf("Stripe %d: %d%%\n", stripe->i, percent);
+  }
+}
+
+/**
+ * async: reports why a stripe failed.
+ * @param c The stripe's connection.
+ * @param error errno value.
+ * @param arg The Stripe_t.
+ */
+void stripeError(RdtState_t* c, int error, void* arg) {
+  Stripe_t* stripe = (Stripe_t*) arg;
+  printf("Stripe %d failed: %s\n", stripe->i, strerror(error));
+}
+
+/**
+ * async: a stripe's connection has closed.
+ * @param c The stripe's connection.
+ * @param result 0 if the stripe was sent, -1 otherwise.
+ * @param n Bytes sent.
+ * @param arg The Stripe_t.
+ */
+void stripeDone(RdtState_t* c, int result, uint32_t n, void* arg) {
+  Stripe_t* stripe = (Stripe_t*) arg;
+
+  stripe->r = result;
+  printStats(c);
+}
+
+/**
+ * Sends the file as 'stripes' byte ranges, like sendStriped(), but runs every connection from this
+ * thread: each is started with rdtSendAsync(), and one epoll loop calls rdtProcess() on those whose
+ * socket is readable or whose timer is due.
+ * @param hostname The host to send to.
+ * @return 0 if every stripe was sent, -1 otherwise.
+ */
+int sendAsync(const char* hostname) {
+  uint32_t chunk = (n + stripes - 1) / stripes;
+  struct epoll_event events[16];
+  int running = 0;
+  int failed = 0;
+
+  Stripe_t* all = (Stripe_t*) calloc(stripes, sizeof(Stripe_t));
+  int ep = epoll_create1(0);
+  if (all == NULL || ep < 0) {
+    perror("Couldn't set up stripes");
+    free(all);
+    return -1;
+  }
+
+  for (int i = 0; i < stripes; i++) {
+    Stripe_t* stripe = &all[i];
+    uint16_t port = getuid() + i;
+
+    stripe->i = i;
+    stripe->r = -1;
+    stripe->first = (uint32_t) i * chunk < n ? (uint32_t) i * chunk : n;
+    stripe->length = n - stripe->first < chunk ? n - stripe->first : chunk;
+    stripe->callbacks = (RdtCallbacks_t) { stripeProgress, stripeError, stripeDone, stripe };
+
+    stripe->socket = setupRdtSocketFrom_t(hostname, port, ephemeral ? 0 : port);
+    if (stripe->socket == (RdtSocket_t*) -1) {
+      printf("Couldn't open socket for stripe %d.\n", i);
+      stripe->socket = NULL;
+      continue;
+    }
+    stripe->socket->paths = path_set;
+
+    stripe->c = rdtCreateState();
+    if (stripe->c == NULL) {
+      continue;
+    }
+    stripe->c->compress = G_conn->compress;
+    stripe->c->delta = G_conn->delta;
+    stripe->c->offset = stripe->first;
+    stripe->c->transfer_id = transfer_id != 0 ? transfer_id + i : 0;
+
+    struct epoll_event event = { EPOLLIN, { .ptr = stripe } };
+    if (rdtSendAsync(stripe->c, stripe->socket, buf + stripe->first, stripe->length, &stripe->callbacks) != 0 ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, rdtFd(stripe->c), &event) != 0) {
+      perror("Couldn't start stripe");
+      rdtFreeState(stripe->c);
+      stripe->c = NULL;
+      continue;
+    }
+    running++;
+  }
+
+  while (running > 0) {
+    /* Wake for the first timer due */
+    int timeout = -1;
+    for (int i = 0; i < stripes; i++) {
+      int t = all[i].c != NULL ? rdtTimeout(all[i].c) : -1;
+      if (t >= 0 && (timeout < 0 || t < timeout)) {
+        timeout = t;
+      }
+    }
+
+    int ready = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), timeout);
+    for (int i = 0; i < ready; i++) {
+      Stripe_t* stripe = (Stripe_t*) events[i].data.ptr;
+      if (stripe->c != NULL && rdtProcess(stripe->c) == 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, rdtFd(stripe->c), NULL);
+        rdtFreeState(stripe->c);
+        stripe->c = NULL;
+        running--;
+      }
+    }
+
+    /* Timers */
+    for (int i = 0; i < stripes; i++) {
+      if (all[i].c != NULL && rdtTimeout(all[i].c) == 0 && rdtProcess(all[i].c) == 0) {
+        epoll_ctl(ep, EPOLL_CTL_DEL, rdtFd(all[i].c), NULL);
+        rdtFreeState(all[i].c);
+        all[i].c = NULL;
+        running--;
+      }
+    }
+  }
+  close(ep);
+
+  /* Keep the RTT estimates for the next run */
+  if (rto_cache_path[0] != '\0') {
+    rtoCacheSave(rto_cache_path);
+  }
+
+  for (int i = 0; i < stripes; i++) {
+    failed += all[i].r != 0;
+    if (all[i].socket != NULL) {
+      closeRdtSocket_t(all[i].socket);
+    }
+  }
+  free(all);
+
+  if (failed) {
+    printf("%d of %d stripes failed.\n", failed, stripes);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Maps a whole file into memory, read only. Its pages are read from the page cache as they're sent,
+ * rather than copied into a buffer first. A transfer's length is 32 bits, so the file must be smaller
+ * than 4 GiB. Release it with freeFile().
+ * @param path Path of the file to read.
+ * @param size Set to the size of the file.
+ * @return Pointer to the file's data, or NULL on failure.
+ */
+char* readFile(const char* path, uint32_t* size) {
+  struct stat st;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("Couldn't open file: %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  if ((uint64_t) st.st_size > UINT32_MAX) {
+    printf("Files of 4 GiB or more can't be sent: %s\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  *size = (uint32_t) st.st_size;
+  char* data = *size > 0 ? (char*) mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : (char*) calloc(1, 1);
+  close(fd);
+  if (data == MAP_FAILED || data == NULL) {
+    printf("Couldn't read file: %s\n", path);
+    return NULL;
+  }
+  return data;
+}
+
+/**
+ * Releases a file from readFile().
+ * @param data The file's data.
+ * @param size The size of the file.
+ */
+void freeFile(char* data, uint32_t size) {
+  if (size > 0) {
+    munmap(data, size);
+  } else {
+    free(data);
+  }
+}
+
+/**
+ * duplex: writes what the server sent back on the connection to reply_path.
+ * @return 0 if successful, -1 if there was no reply or it couldn't be written.
+ */
+int writeReply() {
+  uint32_t size;
+  uint8_t* data = rdtReply(&size);
+
+  if (data == NULL) {
+    printf("No reply from the server.\n");
+    return -1;
+  }
+
+  FILE* f = fopen(reply_path, "wb");
+  if (f == NULL || fwrite(data, 1, size, f) != size) {
+    printf("Couldn't write file: %s\n", reply_path);
+    if (f != NULL) fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  printf("Reply of %d bytes written to %s.\n", size, reply_path);
+  return 0;
+}
+
+/**
+ * Sends one message, within the lifetime if there is one.
+ * @param i Number of the message.
+ * @param data The message.
+ * @param size The size of 'data'.
+ * @return 0 if acknowledged or abandoned, -1 if the connection failed.
+ */
+int sendMessage(int i, const char* data, uint32_t size) {
+  int r = rdtSendMessageWithin(data, size, lifetime);
+  if (r == 1) {
+    printf("Message %d abandoned after %ums.\n", i, lifetime);
+    return 0;
+  }
+  return r;
+}
+
+/**
+ * Sends the file and each 'next' file as messages over one persistent connection.
+ * @param socket The socket to send over.
+ * @return 0 if every file was acknowledged or abandoned, -1 otherwise.
+ */
+int sendPersistent(RdtSocket_t* socket) {
+  if (rdtConnect(socket) != 0) {
+    return -1;
+  }
+
+  if (lifetime > 0 && !G_conn->partial) {
+    printf("Server can't abandon messages. Sending them reliably.\n");
+  }
+
+  int r = sendMessage(0, buf, n);
+  for (int i = 0; i < next_count && r == 0; i++) {
+    uint32_t size;
+    char* data = readFile(next_files[i], &size);
+    if (data == NULL) {
+      r = -1;
+      break;
+    }
+    r = sendMessage(i + 1, data, size);
+    freeFile(data, size);
+  }
+
+  rdtDisconnect();
+  if (rto_cache_path[0] != '\0') {
+    rtoCacheSave(rto_cache_path);
+  }
+  printStats(G_conn);
+  return r;
+}
+
+/**
+ * Sends the file on stream 0 and each 'stream' file on a stream of its own, all over one connection.
+ * The files on their own streams are urgent, so they go first, taking turns a chunk at a time.
+ * @param socket The socket to send over.
+ * @return 0 if everything was acknowledged, -1 otherwise.
+ */
+int sendStreams(RdtSocket_t* socket) {
+  G_conn->streams = true;
+  if (rdtConnect(socket) != 0) {
+    return -1;
+  }
+
+  int r = rdtStreamSend(0, buf, n, 1);
+  for (int i = 0; i < stream_count && r == 0; i++) {
+    uint32_t size;
+    char* data = readFile(stream_files[i], &size);
+    if (data == NULL) {
+      r = -1;
+      break;
+    }
+    r = rdtStreamSend((uint16_t) (i + 1), data, size, 0);
+    freeFile(data, size);
+  }
+
+  if (r == 0) {
+    r = rdtStreamFlush();
+  }
+  rdtDisconnect();
+  if (rto_cache_path[0] != '\0') {
+    rtoCacheSave(rto_cache_path);
+  }
+  printStats(G_conn);
+  return r;
+}
+
+/**
+ * Sets up the paths to the server: hostname, then each 'path'. Sockets share them, so the stripes
+ * of a striped transfer spread over them together.
+ * @param hostname The server.
+ * @return 0 if successful, -1 otherwise.
+ */
+int setupPaths(const char* hostname) {
+  if (pathSetInit(&paths) != 0 || pathSetAdd(&paths, NULL, hostname) < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < path_count; i++) {
+    char* remote = strchr(path_specs[i], '/');
+    if (remote != NULL) {
+      *remote++ = '\0';
+    }
+    if (pathSetAdd(&paths, remote != NULL ? path_specs[i] : NULL, remote != NULL ? remote : path_specs[i]) < 0) {
+      return -1;
+    }
+  }
+
+  path_set = &paths;
+  return 0;
+}
+
 int main(int argc, char* argv[]) {
-  if (argc != 3 && argc != 4) {
-    printf("Usage: ./RdtClient hostname file [debug | time]\n");
+  if (argc < 3) {
+    printf("Usage: ./RdtClient hostname file [debug] [time] [compress] [resume] [delta] [stats] [ephemeral] [stripes N] [async] [duplex file] [next file]... [lifetime ms] [stream file]... [path [local/]remote]... [trace file] [capture file]\n");
+    return -1;
+  }
+
+  next_files = (char**) calloc(argc, sizeof(char*));
+  stream_files = (char**) calloc(argc, sizeof(char*));
+  path_specs = (char**) calloc(argc, sizeof(char*));
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "debug") == 0) {
+      G_debug = true;
+    } else if (strcmp(argv[i], "time") == 0) {
+      timing = true;
+    } else if (strcmp(argv[i], "compress") == 0) {
+      G_conn->compress = true;
+    } else if (strcmp(argv[i], "resume") == 0) {
+      resume = true;
+    } else if (strcmp(argv[i], "stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "ephemeral") == 0) {
+      ephemeral = true;
+    } else if (strcmp(argv[i], "async") == 0) {
+      async = true;
+    } else if (strcmp(argv[i], "delta") == 0) {
+      G_conn->delta = true;
+    } else if (strcmp(argv[i], "stripes") == 0 && i + 1 < argc) {
+      stripes = atoi(argv[++i]);
+      if (stripes < 1) {
+        printf("Number of stripes must be at least 1.\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "duplex") == 0 && i + 1 < argc) {
+      G_conn->duplex = true;
+      reply_path = argv[++i];
+    } else if (strcmp(argv[i], "next") == 0 && i + 1 < argc) {
+      next_files[next_count++] = argv[++i];
+    } else if (strcmp(argv[i], "stream") == 0 && i + 1 < argc) {
+      if (stream_count + 1 >= RDT_STREAMS) {
+        printf("At most %d stream files.\n", RDT_STREAMS - 1);
+        return -1;
+      }
+      stream_files[stream_count++] = argv[++i];
+    } else if (strcmp(argv[i], "path") == 0 && i + 1 < argc) {
+      path_specs[path_count++] = argv[++i];
+    } else if (strcmp(argv[i], "lifetime") == 0 && i + 1 < argc) {
+      lifetime = (uint32_t) atoi(argv[++i]);
+    } else if (strcmp(argv[i], "capture") == 0 && i + 1 < argc) {
+      capture = argv[++i];
+    } else if (strcmp(argv[i], "trace") == 0 && i + 1 < argc) {
+      if (rdtTraceOpen(argv[++i], RDT_TRACE_FILE_RECORDS) != 0) {
+        return -1;
+      }
+    } else {
+      printf("Unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+
+  if (G_conn->delta && (resume || stripes > 1)) {
+    printf("delta can't be combined with resume or stripes.\n");
+    return -1;
+  }
+
+  if ((next_count > 0 || lifetime > 0) && (G_conn->delta || resume || stripes > 1 || G_conn->compress)) {
+    printf("next and lifetime can't be combined with compress, resume, delta or stripes.\n");
+    return -1;
+  }
+
+  if (G_conn->duplex && (resume || G_conn->delta || stripes > 1 || async || next_count > 0 || lifetime > 0)) {
+    printf("duplex can't be combined with resume, delta, stripes, async, next or lifetime.\n");
+    return -1;
+  }
+
+  if (async && (resume || next_count > 0 || lifetime > 0)) {
+    printf("async can't be combined with resume, next or lifetime.\n");
     return -1;
   }
 
-  if (argc == 4 && strcmp(argv[3], "debug") == 0) {
-    G_debug = true;
+  if (stream_count > 0 && (G_conn->delta || resume || stripes > 1 || async || G_conn->compress || G_conn->duplex || next_count > 0 || lifetime > 0)) {
+    printf("stream can't be combined with compress, resume, delta, stripes, async, duplex, next or lifetime.\n");
+    return -1;
   }
 
-  RdtSocket_t* socket = setupRdtSocket_t(argv[1], getuid());
-  if (socket < 0 ) {
-    printf("Couldn't open socket.\n");
+  if (path_count > 0 && G_conn->duplex) {
+    printf("path can't be combined with duplex.\n");
     return -1;
   }
 
-  file = fopen(argv[2], "rb");
-  if (file == NULL) {
-    printf("Couldn't open file: %s\n", argv[2]);
+  buf = readFile(argv[2], &n);
+  if (buf == NULL) {
     return -1;
   }
 
-  /* Get file length */
-  fseek(file, 0L, SEEK_END);
-  n = ftell(file);
-  fseek(file, 0L, SEEK_SET);
+  if (path_count > 0 && setupPaths(argv[1]) != 0) {
+    return -1;
+  }
 
-  /* Allocate buffer for data and copy file bytes */
-  buf = (char*) calloc(n, sizeof(char));
-  if(buf == NULL) {
+  if (capture != NULL && pcapOpen(capture) != 0) {
     return -1;
   }
-  fread(buf, sizeof(char), n, file);
-  fclose(file);
 
-  if (argc == 4 && strcmp(argv[3], "time") == 0) {
-    if (clock_gettime(CLOCK_REALTIME, &start) < 0) {
+  /* Start from the RTT estimates of previous runs */
+  if (getenv("HOME") != NULL) {
+    snprintf(rto_cache_path, sizeof(rto_cache_path), "%s/%s", getenv("HOME"), RDT_RTO_CACHE);
+    rtoCacheLoad(rto_cache_path);
+  }
+
+  if (resume) {
+    transfer_id = transferId(argv[2]);
+  }
+
+  if (timing) {
+    if (clock_gettime(CLOCK_MONOTONIC, &start) < 0) {
       printf("Error starting timer.\n");
       return -1;
     }
   }
 
   /* Send data over RDT */
-  rdtSend(socket, buf, n);
+  int r;
+  if (async) {
+    r = sendAsync(argv[1]);
+  } else if (stripes > 1) {
+    r = sendStriped(argv[1]);
+  } else {
+    RdtSocket_t* socket = setupRdtSocketFrom_t(argv[1], getuid(), ephemeral ? 0 : getuid());
+    if (socket == (RdtSocket_t*) -1) {
+      printf("Couldn't open socket.\n");
+      return -1;
+    }
+    socket->paths = path_set;
+
+    if (stream_count > 0) {
+      r = sendStreams(socket);
+    } else if (next_count > 0 || lifetime > 0) {
+      r = sendPersistent(socket);
+    } else {
+      G_conn->transfer_id = transfer_id;
+      r = sendRange(G_conn, socket, 0, n, transfer_id);
+      if (r == 0 && reply_path != NULL) {
+        r = writeReply();
+      }
+    }
+    closeRdtSocket_t(socket);
+  }
 
-  if (argc == 4 && strcmp(argv[3], "time") == 0) {
-    if (clock_gettime(CLOCK_REALTIME, &end) < 0) {
+  if (timing) {
+    if (clock_gettime(CLOCK_MONOTONIC, &end) < 0) {
       printf("Error starting timer.\n");
       return -1;
     }
 
     double time = (double) end.tv_sec - (double) start.tv_sec;
-    time += ((double) end.tv_nsec - (double) start.tv_nsec) / 10e9;
+    time += ((double) end.tv_nsec - (double) start.tv_nsec) / 1e9;
 
     printf("Transmission Time: %.6fs\n", time);
   }
 
+  if (stats && path_set != NULL) {
+    pathSetPrint(stdout, path_set);
+  }
+
+  if (G_debug) {
+    rdtTracePrint(stdout, rdtTraceGet(), fsm_strings, RDT_FSM_STRINGS, 0);
+  }
+
   /* Clean up and return */
-  closeRdtSocket_t(socket);
-  return 0;
-}
\ No newline at end of file
+  uint64_t drops = pcapClose();
+  if (drops > 0) {
+    printf("Capture dropped %" PRIu64 " datagrams.\n", drops);
+  }
+  rdtTraceClose();
+  freeFile(buf, n);
+  free(next_files);
+  free(stream_files);
+  free(path_specs);
+  if (path_set != NULL) {
+    pathSetFree(path_set);
+  }
+  return r;
+}
@@ -21,12 +21,14 @@ struct timespec start;
 struct timespec end;
 int counter = 0;
 int max = 10;
+bool persistent = false;
 
 int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    printf("Usage: ./RdtClient hostname file\n");
+  if (argc < 3 || argc > 4 || (argc == 4 && strcmp(argv[3], "persistent") != 0)) {
+    printf("Usage: ./RdtClientRTT hostname file [persistent]\n");
     return -1;
   }
+  persistent = argc == 4;
 
   out = fopen("rtt-results.csv", "w");
   d_advise(out, "Attempt,Avg. RTT\n");
@@ -56,13 +58,26 @@ int main(int argc, char* argv[]) {
   fread(buf, sizeof(char), n, file);
   fclose(file);
 
+  /* Persistent: one connection, each round sent as a message */
+  if (persistent && rdtConnect(socket) != 0) {
+    return -1;
+  }
+
   while(counter < max) {
     /* Send data over RDT */
-    rdtSend(socket, buf, n);
-    d_advise(out, "%d,%lf\n", counter + 1, G_avg_rtt);
+    if (persistent) {
+      rdtSendMessage(buf, n);
+    } else {
+      rdtSend(socket, buf, n);
+    }
+    d_advise(out, "%d,%lf\n", counter + 1, G_conn->avg_rtt);
     counter++;
   }
 
+  if (persistent) {
+    rdtDisconnect();
+  }
+
   fclose(out);
 
   /* Clean up and return */
@@ -1,43 +1,773 @@
 // Copyright 2022 190010906
 //
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <string.h>
 
 #include "sigio/sigio.h"
 #include "rdt.h"
+#include "pcap/pcap.h"
+#include "trace/trace.h"
 
+int   stripes = 1;
+int   multi = -1;
+int   workers = 1;
+bool  pin = false;
+bool  async = false;    // Receive every stripe from the main thread, with rdtListenAsync() and poll().
 
-int main(int argc, char* argv[]) {
-  if (argc != 2 && argc != 3) {
-    printf("Usage: ./RdtServer out_file [debug]\n");
+/* Uploads so far in multi mode. Shared by the workers. */
+typedef struct Uploads_s {
+  uint32_t started;
+  uint32_t finished;
+} Uploads_t;
+
+/* A stripe received on a thread of its own */
+typedef struct Stripe_s {
+  int       i;        // Stripe number.
+  int       r;        // What receiveStripe() returned.
+  pthread_t thread;
+  RdtState_t* c;      // async: its connection, until it's done.
+  RdtSocket_t* socket;  // async: its socket.
+  RdtCallbacks_t callbacks;  // async: callbacks, with the stripe as arg.
+} Stripe_t;
+
+Uploads_t  uploads_local = { 0, 0 };
+Uploads_t* uploads = &uploads_local;
+volatile sig_atomic_t stopping = 0;
+bool  resume = false;
+bool  stats = false;
+char* out_file;
+char* capture = NULL;
+char* reply = NULL;     // File sent back to clients that ask for full duplex.
+
+/**
+ * Stream hook: reports each message as soon as it's complete, whatever the other streams are doing.
+ * @param c The connection.
+ * @param stream The stream it came on.
+ * @param data The message.
+ * @param n The size of 'data'.
+ * @param arg Unused.
+ */
+void streamMessage(RdtState_t* c, uint16_t stream, const uint8_t* data, uint32_t n, void* arg) {
+  printf("Stream %u: message of %u bytes after %u bytes in all.\n", stream, n, c->seq_no - c->seq_init);
+}
+
+const RdtStreamHooks_t stream_hooks = { streamMessage, NULL };
+
+/**
+ * Writes a message to c->out_fd, in place of what the file held.
+ * @param c The connection.
+ * @param message The message.
+ * @param size The size of 'message'.
+ * @return 0 if successful, -1 otherwise.
+ */
+int writeOutput(RdtState_t* c, const uint8_t* message, uint32_t size) {
+  if (ftruncate(c->out_fd, 0) != 0 || pwrite(c->out_fd, message, size, 0) != (ssize_t) size) {
     return -1;
   }
+  return 0;
+}
+
+/**
+ * Writes the messages on each stream of a connection to path.s<stream>.0, path.s<stream>.1, ...
+ * The first message on stream 0, the client's main file, goes to c->out_fd at 'path' instead.
+ * @param c The connection.
+ * @param path Path of c->out_fd, which the other files are named after.
+ */
+void writeStreams(RdtState_t* c, const char* path) {
+  char name[FILENAME_MAX];
+  uint32_t size;
+  uint8_t* message;
 
-  if (argc == 3 && strcmp(argv[2], "debug")) {
-    G_debug = true;
+  for (uint16_t s = 0; s < RDT_STREAMS; s++) {
+    uint32_t offset = 0;
+    for (int i = 0; (message = rdtNextStreamMessage_r(c, s, &offset, &size)) != NULL; i++) {
+      if (s == 0 && i == 0) {
+        if (writeOutput(c, message, size) != 0) {
+          printf("Couldn't write file: %s\n", path);
+        } else {
+          printf("Stream %u message %d: %d bytes to %s.\n", s, i, size, path);
+        }
+        continue;
+      }
+
+      snprintf(name, sizeof(name), "%s.s%u.%d", path, s, i);
+      int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || write(fd, message, size) != (ssize_t) size) {
+        printf("Couldn't write file: %s\n", name);
+      } else {
+        printf("Stream %u message %d: %d bytes to %s.\n", s, i, size, name);
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
   }
+}
+
+/**
+ * Writes the messages of a persistent connection to c->out_fd, then path.1, path.2, ...
+ * Messages on streams are written by writeStreams().
+ * @param c The connection.
+ * @param path Path of c->out_fd.
+ */
+void writeMessages(RdtState_t* c, const char* path) {
+  char next[FILENAME_MAX];
+  uint32_t offset = 0;
+  uint32_t size;
+  uint8_t* message;
 
-  FILE* pFile = fopen(argv[1],"wb");
-  if (!pFile) {
-    printf("Couldn't open file: %s\n", argv[1]);
+  if (c->streams) {
+    writeStreams(c, path);
+    return;
+  }
+
+  for (int i = 0; (message = rdtNextMessage_r(c, &offset, &size)) != NULL; i++) {
+    if (i == 0) {
+      if (writeOutput(c, message, size) != 0) {
+        printf("Couldn't write file: %s\n", path);
+      } else {
+        printf("Message %d: %d bytes to %s.\n", i, size, path);
+      }
+      continue;
+    }
+
+    snprintf(next, sizeof(next), "%s.%d", path, i);
+    int fd = open(next, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, message, size) != (ssize_t) size) {
+      printf("Couldn't write file: %s\n", next);
+    } else {
+      printf("Message %d: %d bytes to %s.\n", i, size, next);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+/**
+ * Receives one stripe on port getuid() + i, writing it straight into the output file.
+ * In resume mode, keeps accepting connections until the transfer completes, checkpointing to
+ * out_file.ckpt (or out_file.i.ckpt when striped).
+ * @param c The connection to receive on, set up with the output file.
+ * @param i The stripe number.
+ * @return 0 if successful, -1 otherwise.
+ */
+int receiveStripe(RdtState_t* c, int i) {
+  char checkpoint[FILENAME_MAX];
+
+  RdtSocket_t* socket = setupRdtSocket_t(NULL, getuid() + i);
+  if (socket == (RdtSocket_t*) -1) {
     return -1;
   }
 
-  RdtSocket_t* socket = setupRdtSocket_t(NULL, getuid());
-  if (socket < 0 ) {
+  if (resume) {
+    if (stripes > 1) {
+      snprintf(checkpoint, sizeof(checkpoint), "%s.%d.ckpt", out_file, i);
+    } else {
+      snprintf(checkpoint, sizeof(checkpoint), "%s.ckpt", out_file);
+    }
+    c->checkpoint_path = checkpoint;
+  }
+  c->stream_hooks = &stream_hooks;
+
+  do {
+    uint32_t n = rdtListen_r(c, socket);
+    printf("Received %d bytes at offset %" PRIu64 ".\n", n, c->offset);
+
+    if (stats) {
+      RdtStats_t s;
+      rdtGetStats_r(c, &s);
+      rdtPrintStats(stdout, &s);
+    }
+
+    /* Persistent connection: one message per file */
+    if (c->framed) {
+      writeMessages(c, out_file);
+      continue;
+    }
+
+    /* A delta may have rebuilt a shorter file than the basis it replaced */
+    if (c->basis != NULL && c->complete && ftruncate(c->out_fd, (off_t) (c->offset + n)) != 0) {
+      perror("Couldn't truncate output file");
+    }
+  } while (resume && !c->complete);
+
+  closeRdtSocket_t(socket);
+  return 0;
+}
+
+/**
+ * Thread of one stripe. Its connection is its own, and is driven from the thread, not by signals.
+ * @param arg The Stripe_t.
+ * @return NULL.
+ */
+void* stripeThread(void* arg) {
+  Stripe_t* stripe = (Stripe_t*) arg;
+  RdtState_t* c = rdtCreateState();
+
+  if (c == NULL) {
+    stripe->r = -1;
+    return NULL;
+  }
+
+  c->polled = true;
+  c->out_fd = G_conn->out_fd;
+  stripe->r = receiveStripe(c, stripe->i);
+  rdtFreeState(c);
+  return NULL;
+}
+
+/**
+ * async: a stripe's connection has closed. Finishes it off as receiveStripe() would.
+ * @param c The stripe's connection.
+ * @param result 0 if the sender finished, -1 otherwise.
+ * @param n Bytes received.
+ * @param arg The Stripe_t.
+ */
+void stripeDone(RdtState_t* c, int result, uint32_t n, void* arg) {
+  Stripe_t* stripe = (Stripe_t*) arg;
+
+  stripe->r = result;
+  printf("Received %d bytes at offset %" PRIu64 ".\n", n, c->offset);
+
+  if (stats) {
+    RdtStats_t s;
+    rdtGetStats_r(c, &s);
+    rdtPrintStats(stdout, &s);
+  }
+
+  if (c->framed) {
+    writeMessages(c, out_file);
+  } else if (c->basis != NULL && c->complete && ftruncate(c->out_fd, (off_t) (c->offset + n)) != 0) {
+    perror("Couldn't truncate output file");
+  }
+}
+
+/**
+ * Receives every stripe from this thread: each connection is started with rdtListenAsync(), and one
+ * poll() loop calls rdtProcess() on those whose socket is readable or whose timer is due.
+ * @return int Number of stripes that failed.
+ */
+int receiveAsync() {
+  int running = 0;
+  int failed = 0;
+
+  Stripe_t* all = (Stripe_t*) calloc(stripes, sizeof(Stripe_t));
+  struct pollfd* fds = (struct pollfd*) calloc(stripes, sizeof(struct pollfd));
+  if (all == NULL || fds == NULL) {
+    perror("Couldn't allocate stripes");
+    free(all);
+    free(fds);
+    return stripes;
+  }
+
+  for (int i = 0; i < stripes; i++) {
+    Stripe_t* stripe = &all[i];
+
+    stripe->i = i;
+    stripe->r = -1;
+    stripe->callbacks = (RdtCallbacks_t) { NULL, NULL, stripeDone, stripe };
+    fds[i].fd = -1;
+
+    stripe->socket = setupRdtSocket_t(NULL, getuid() + i);
+    if (stripe->socket == (RdtSocket_t*) -1) {
+      stripe->socket = NULL;
+      continue;
+    }
+
+    stripe->c = rdtCreateState();
+    if (stripe->c == NULL) {
+      continue;
+    }
+    stripe->c->out_fd = G_conn->out_fd;
+    stripe->c->delta = G_conn->delta;
+    stripe->c->basis = G_conn->basis;
+    stripe->c->basis_size = G_conn->basis_size;
+
+    if (rdtListenAsync(stripe->c, stripe->socket, &stripe->callbacks) != 0) {
+      rdtFreeState(stripe->c);
+      stripe->c = NULL;
+      continue;
+    }
+    printf("Listening on port %d...\n", getuid() + i);
+    fds[i].fd = rdtFd(stripe->c);
+    fds[i].events = POLLIN;
+    running++;
+  }
+
+  while (running > 0) {
+    /* Wake for the first timer due */
+    int timeout = -1;
+    for (int i = 0; i < stripes; i++) {
+      int t = all[i].c != NULL ? rdtTimeout(all[i].c) : -1;
+      if (t >= 0 && (timeout < 0 || t < timeout)) {
+        timeout = t;
+      }
+    }
+
+    poll(fds, stripes, timeout);
+    for (int i = 0; i < stripes; i++) {
+      if (all[i].c == NULL || (!(fds[i].revents & POLLIN) && rdtTimeout(all[i].c) != 0)) {
+        continue;
+      }
+
+      if (rdtProcess(all[i].c) == 0) {
+        rdtFreeState(all[i].c);
+        all[i].c = NULL;
+        fds[i].fd = -1;
+        running--;
+      }
+    }
+  }
+
+  for (int i = 0; i < stripes; i++) {
+    failed += all[i].r != 0;
+    if (all[i].socket != NULL) {
+      closeRdtSocket_t(all[i].socket);
+    }
+  }
+  free(all);
+  free(fds);
+  return failed;
+}
+
+/**
+ * rdtServe() accept hook: each upload is written straight to its own file, out_file.address.port.N
+ * for the peer and the Nth upload. Its path is kept in c->user.
+ * @param c The new connection.
+ * @param arg Unused.
+ * @return 0 if successful, -1 otherwise.
+ */
+int acceptUpload(RdtState_t* c, void* arg) {
+  const struct sockaddr_in* peer = &c->socket->receive.addr;
+  char* path = (char*) malloc(FILENAME_MAX);
+  if (path == NULL) {
     return -1;
   }
 
-  rdtListen(socket);
-  fwrite(G_buf, (G_seq_no - G_seq_init), 1, pFile);
+  snprintf(path, FILENAME_MAX, "%s.%s.%d.%u", out_file, inet_ntoa(peer->sin_addr), ntohs(peer->sin_port),
+           __atomic_fetch_add(&uploads->started, 1, __ATOMIC_RELAXED));
+  c->out_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (c->out_fd < 0) {
+    printf("Couldn't open file: %s\n", path);
+    free(path);
+    return -1;
+  }
+
+  c->user = path;
+  return 0;
+}
+
+/**
+ * rdtServe() done hook: reports an upload, and closes its file. Workers tell the parent once they've
+ * finished 'multi' uploads between them.
+ * @param c The connection.
+ * @param n Bytes received.
+ * @param arg Unused.
+ */
+void finishUpload(RdtState_t* c, uint32_t n, void* arg) {
+  char* path = (char*) c->user;
+
+  uint32_t finished = __atomic_add_fetch(&uploads->finished, 1, __ATOMIC_RELAXED);
+  if (workers > 1 && multi > 0 && finished == (uint32_t) multi) {
+    kill(getppid(), SIGTERM);
+  }
+
+  printf("Received %d bytes to %s%s.\n", n, path, c->complete ? "" : " (incomplete)");
+
+  if (stats) {
+    RdtStats_t s;
+    rdtGetStats_r(c, &s);
+    rdtPrintStats(stdout, &s);
+  }
+
+  /* Persistent connection: one message per file */
+  if (c->framed) {
+    writeMessages(c, path);
+  }
+  close(c->out_fd);
+  free(path);
+}
+
+/**
+ * SIGTERM: stop serving once the open connections have finished.
+ * @param sig
+ */
+void handleStop(int sig) {
+  stopping = 1;
+  rdtServeStop();
+}
+
+/**
+ * SIGCHLD: only wakes the parent of the workers.
+ * @param sig
+ */
+void handleChild(int sig) {
+}
+
+/**
+ * Serves uploads from any number of clients at once on port getuid(), each to its own file. A worker
+ * shares the port with the others, and stops on SIGTERM.
+ * @param worker The worker number.
+ * @return 0 if successful, -1 otherwise.
+ */
+int serveUploads(int worker) {
+  RdtServerHooks_t hooks = { acceptUpload, finishUpload, NULL };
+  struct rlimit limit;
+
+  /* Every connection has its output file open */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  RdtSocket_t* socket = workers > 1 ? setupRdtSocketReusePort_t(getuid()) : setupRdtSocket_t(NULL, getuid());
+  if (socket == (RdtSocket_t*) -1) {
+    return -1;
+  }
 
-  printf("Received %d bytes.\n", (G_seq_no - G_seq_init));
-  printf("Writing to file...\n");
+  if (workers > 1) {
+    uint32_t n = rdtServe(socket, &hooks, 0);
+    printf("Worker %d served %d connections.\n", worker, n);
+  } else {
+    uint32_t n = rdtServe(socket, &hooks, (uint32_t) multi);
+    printf("Served %d connections.\n", n);
+  }
 
-  fclose(pFile);
   closeRdtSocket_t(socket);
+  return 0;
+}
+
+/**
+ * Pins the calling worker to one CPU: the ith of those it may run on, wrapping round if there are
+ * more workers than CPUs.
+ * @param i The worker number.
+ */
+void pinWorker(int i) {
+  cpu_set_t allowed, cpus;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+    perror("Couldn't get CPUs");
+    return;
+  }
+
+  int n = i % CPU_COUNT(&allowed);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        perror("Couldn't pin worker");
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * Serves uploads with 'workers' processes, each with its own socket on the same port (SO_REUSEPORT),
+ * its own signal handlers and its own share of the connections. The kernel sends each client to one
+ * worker. With 'pin', worker i runs only on CPU i, so what it allocates for its connections comes
+ * from memory local to that CPU. SIGTERM, or 'multi' uploads in all, stops the workers once their
+ * open connections have finished.
+ * @return 0 if successful, -1 otherwise.
+ */
+int serveWorkers() {
+  struct sigaction action;
+  sigset_t block, mask;
+  int status, failed = 0, live = 0;
+  bool forwarded = false;
+
+  pid_t* pids = (pid_t*) calloc(workers, sizeof(pid_t));
+  uploads = (Uploads_t*) mmap(NULL, sizeof(Uploads_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (pids == NULL || uploads == MAP_FAILED) {
+    perror("Couldn't set up workers");
+    return -1;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handleStop;
+  sigaction(SIGTERM, &action, (struct sigaction *) 0);
+  action.sa_handler = handleChild;
+  sigaction(SIGCHLD, &action, (struct sigaction *) 0);
+
+  /* A SIGTERM before a worker is ready stays pending until it is */
+  sigemptyset(&block);
+  sigaddset(&block, SIGTERM);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &mask);
+
+  for (int i = 0; i < workers; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      perror("Couldn't fork worker");
+      failed++;
+    } else if (pids[i] == 0) {
+      if (pin) {
+        pinWorker(i);
+      }
+
+      sigaddset(&G_sigmask, SIGTERM); // Taken only while rdtServe() waits
+      sigprocmask(SIG_SETMASK, &mask, (sigset_t *) 0);
+      exit(serveUploads(i) == 0 ? 0 : 1);
+    } else {
+      live++;
+    }
+  }
+
+  /* Pass a SIGTERM on to the workers, and wait for them */
+  while (live > 0) {
+    if (stopping && !forwarded) {
+      for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) kill(pids[i], SIGTERM);
+      }
+      forwarded = true;
+    }
+
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid > 0) {
+      live--;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        failed++;
+      }
+      continue;
+    }
+
+    sigsuspend(&mask); // Wait for signal
+  }
+  sigprocmask(SIG_SETMASK, &mask, (sigset_t *) 0);
+
+  printf("Served %d connections with %d workers.\n", uploads->finished, workers);
+  free(pids);
+  return failed ? -1 : 0;
+}
+
+/**
+ * Reads a whole file into a newly allocated buffer.
+ * @param path Path of the file to read.
+ * @param size Set to the size of the file.
+ * @return Pointer to the buffer, or NULL on failure.
+ */
+uint8_t* readFile(const char* path, uint32_t* size) {
+  struct stat st;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("Couldn't open file: %s\n", path);
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  *size = (uint32_t) st.st_size;
+  uint8_t* data = (uint8_t*) malloc(*size > 0 ? *size : 1);
+  if (data != NULL && read(fd, data, *size) != (ssize_t) *size) {
+    printf("Couldn't read file: %s\n", path);
+    free(data);
+    data = NULL;
+  }
+  close(fd);
+  return data;
+}
+
+/**
+ * Receives one file into out_file, in stripes if asked to.
+ * @return 0 if successful, 1 otherwise.
+ */
+int receiveFile() {
+  /* Keep what's already there when resuming or sending deltas */
+  G_conn->out_fd = open(out_file, O_RDWR | O_CREAT | (resume || G_conn->delta ? 0 : O_TRUNC), 0644);
+  if (G_conn->out_fd < 0) {
+    printf("Couldn't open file: %s\n", out_file);
+    return 1;
+  }
+
+  /* The current contents are the basis that deltas are encoded against */
+  if (G_conn->delta) {
+    struct stat st;
+    if (fstat(G_conn->out_fd, &st) != 0) {
+      perror("Couldn't stat output file");
+      return 1;
+    }
+
+    G_conn->basis_size = (uint32_t) st.st_size;
+    G_conn->basis = (uint8_t*) malloc(G_conn->basis_size > 0 ? G_conn->basis_size : 1);
+    if (G_conn->basis == NULL || pread(G_conn->out_fd, G_conn->basis, G_conn->basis_size, 0) != (ssize_t) G_conn->basis_size) {
+      printf("Couldn't read file: %s\n", out_file);
+      return 1;
+    }
+  }
+
+  /* Each stripe is received on its own thread, or all from this one, all writing to the same file */
+  int failed = 0;
+  if (async) {
+    failed = receiveAsync();
+  } else if (stripes > 1) {
+    Stripe_t* threads = (Stripe_t*) calloc(stripes, sizeof(Stripe_t));
+    if (threads == NULL) {
+      perror("Couldn't allocate stripes");
+      return 1;
+    }
+
+    for (int i = 0; i < stripes; i++) {
+      threads[i].i = i;
+      if (pthread_create(&threads[i].thread, NULL, stripeThread, &threads[i]) != 0) {
+        perror("Couldn't start stripe");
+        threads[i].i = -1;
+        failed++;
+      }
+    }
+
+    for (int i = 0; i < stripes; i++) {
+      if (threads[i].i >= 0) {
+        pthread_join(threads[i].thread, NULL);
+        failed += threads[i].r != 0;
+      }
+    }
+    free(threads);
+  } else {
+    failed = receiveStripe(G_conn, 0) == 0 ? 0 : 1;
+  }
+
+  close(G_conn->out_fd);
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Usage: ./RdtServer out_file [debug] [resume] [delta] [stats] [stripes N] [async] [reply file] [multi N] [workers N] [pin] [trace file] [capture file]\n");
+    return -1;
+  }
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "debug") == 0) {
+      G_debug = true;
+    } else if (strcmp(argv[i], "resume") == 0) {
+      resume = true;
+    } else if (strcmp(argv[i], "stats") == 0) {
+      stats = true;
+    } else if (strcmp(argv[i], "delta") == 0) {
+      G_conn->delta = true;
+    } else if (strcmp(argv[i], "stripes") == 0 && i + 1 < argc) {
+      stripes = atoi(argv[++i]);
+      if (stripes < 1) {
+        printf("Number of stripes must be at least 1.\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "multi") == 0 && i + 1 < argc) {
+      multi = atoi(argv[++i]);
+      if (multi < 0) {
+        printf("Number of connections must be at least 0.\n");
+        return -1;
+      }
+    } else if (strcmp(argv[i], "workers") == 0 && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+      if (workers < 0) {
+        printf("Number of workers must be at least 0.\n");
+        return -1;
+      }
+      if (workers == 0) {
+        workers = (int) sysconf(_SC_NPROCESSORS_ONLN); // One per core
+        workers = workers > 0 ? workers : 1;
+      }
+    } else if (strcmp(argv[i], "async") == 0) {
+      async = true;
+    } else if (strcmp(argv[i], "reply") == 0 && i + 1 < argc) {
+      reply = argv[++i];
+    } else if (strcmp(argv[i], "pin") == 0) {
+      pin = true;
+    } else if (strcmp(argv[i], "capture") == 0 && i + 1 < argc) {
+      capture = argv[++i];
+    } else if (strcmp(argv[i], "trace") == 0 && i + 1 < argc) {
+      if (rdtTraceOpen(argv[++i], RDT_TRACE_FILE_RECORDS) != 0) {
+        return -1;
+      }
+    } else {
+      printf("Unknown option: %s\n", argv[i]);
+      return -1;
+    }
+  }
+
+  if (G_conn->delta && (resume || stripes > 1)) {
+    printf("delta can't be combined with resume or stripes.\n");
+    return -1;
+  }
+
+  if (multi >= 0 && (resume || G_conn->delta || stripes > 1)) {
+    printf("multi can't be combined with resume, delta or stripes.\n");
+    return -1;
+  }
+
+  if (async && (resume || multi >= 0)) {
+    printf("async can't be combined with resume or multi.\n");
+    return -1;
+  }
+
+  if (reply != NULL && (resume || G_conn->delta || stripes > 1 || async || multi >= 0)) {
+    printf("reply can't be combined with resume, delta, stripes, async or multi.\n");
+    return -1;
+  }
+
+  /* Sent back to a client that asks for full duplex, on the same connection */
+  if (reply != NULL) {
+    G_conn->reply = readFile(reply, &G_conn->reply_size);
+    if (G_conn->reply == NULL) {
+      return -1;
+    }
+  }
+
+  if (workers > 1 && multi < 0) {
+    printf("workers needs multi.\n");
+    return -1;
+  }
+
+  if (pin && workers < 2) {
+    printf("pin needs workers.\n");
+    return -1;
+  }
+
+  if (capture != NULL && workers > 1) {
+    printf("capture can't be combined with workers.\n");
+    return -1;
+  }
+
+  if (capture != NULL && pcapOpen(capture) != 0) {
+    return -1;
+  }
+
+  /* In multi mode, each client's upload goes to out_file.address.port.N */
+  out_file = argv[1];
+  int failed = 0;
+  if (multi >= 0 && workers > 1) {
+    failed = serveWorkers() == 0 ? 0 : 1;
+  } else if (multi >= 0) {
+    failed = serveUploads(0) == 0 ? 0 : 1;
+  } else {
+    failed = receiveFile();
+  }
+
+  uint64_t drops = pcapClose();
+  if (drops > 0) {
+    printf("Capture dropped %" PRIu64 " datagrams.\n", drops);
+  }
+
+  if (G_debug) {
+    rdtTracePrint(stdout, rdtTraceGet(), fsm_strings, RDT_FSM_STRINGS, 0);
+  }
+  rdtTraceClose();
 
   printf("Bye!\n");
-  return 0;
-}
\ No newline at end of file
+  return failed ? -1 : 0;
+}
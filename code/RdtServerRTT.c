@@ -9,13 +9,15 @@
 
 int counter = 0;
 int max = 10;
+bool persistent = false;
 
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    printf("Usage: ./RdtServerRTT\n");
+  if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "persistent") != 0)) {
+    printf("Usage: ./RdtServerRTT out_file [persistent]\n");
     return -1;
   }
+  persistent = argc == 3;
 
   FILE *pFile = fopen(argv[1], "wb");
   if (!pFile) {
@@ -28,10 +30,20 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
+  /* Persistent: all rounds arrive as messages on a single connection */
+  if (persistent) {
+    uint32_t offset = 0;
+    uint32_t n;
+    printf("Received %d bytes.\n", rdtListen(socket));
+    while (rdtNextMessage(&offset, &n) != NULL) {
+      printf("Round %d: %d bytes.\n", ++counter, n);
+    }
+    counter = max;
+  }
+
   while (counter < max) {
     printf("Round %d:\n", counter + 1);
-    rdtListen(socket);
-    printf("Received %d bytes.\n", (G_seq_no - G_seq_init));
+    printf("Received %d bytes.\n", rdtListen(socket));
     counter++;
   }
 
@@ -0,0 +1,33 @@
+//
+// 190010906, October 2026.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rdt.h"
+#include "trace/trace.h"
+
+/*
+  Decodes a trace file written by RdtClient or RdtServer with 'trace file'. The file can be read while
+  the program is still running, or after it crashed.
+*/
+
+int main(int argc, char* argv[]) {
+  int csv = 0;
+
+  if (argc < 2 || (argc > 2 && strcmp(argv[2], "csv") != 0) || argc > 3) {
+    printf("Usage: ./RdtTrace trace_file [csv]\n");
+    return -1;
+  }
+  csv = argc > 2;
+
+  RdtTrace_t* trace = rdtTraceRead(argv[1]);
+  if (trace == NULL) {
+    return -1;
+  }
+
+  rdtTracePrint(stdout, trace, fsm_strings, RDT_FSM_STRINGS, csv);
+  free(trace);
+  return 0;
+}
@@ -30,6 +30,8 @@ void perror(const char *s);
 #define INADDR_NONE 0xffffffff /* should be in <netinet/in.h> */
 #endif
 
+const UdpTransport_t *G_udp_transport = (UdpTransport_t *) 0;
+
 UdpSocket_t *
 setupUdpSocket_t(const char *hostname, const uint16_t port)
 { // NOLINT
@@ -110,6 +112,8 @@ int
 sendUdp(const UdpSocket_t *local, const UdpSocket_t *remote,
         const UdpBuffer_t *buffer)
 {
+  if (G_udp_transport) { return G_udp_transport->send(local, remote, buffer); }
+
   int r = sendto(local->sd, (void *) buffer->bytes, buffer->n, 0,
                  (struct sockaddr *) &remote->addr, sizeof(remote->addr));
   if (r < 0) { perror("sendUdp(): sendto()"); }
@@ -122,6 +126,8 @@ int
 recvUdp(const UdpSocket_t *local, const UdpSocket_t *remote,
         UdpBuffer_t *buffer)
 {
+  if (G_udp_transport) { return G_udp_transport->recv(local, remote, buffer); }
+
   int r;
   socklen_t l = sizeof(struct sockaddr);
   r = recvfrom(local->sd, (void *) buffer->bytes, buffer->n, 0,
@@ -28,6 +28,17 @@ typedef struct UdpBuffer_s {
   uint8_t *bytes;
 } UdpBuffer_t;
 
+typedef struct UdpTransport_s {
+  int (*send)(const UdpSocket_t *local, const UdpSocket_t *remote,
+    const UdpBuffer_t *buffer);
+  int (*recv)(const UdpSocket_t *local, const UdpSocket_t *remote,
+    UdpBuffer_t *buffer);
+} UdpTransport_t;
+
+extern const UdpTransport_t *G_udp_transport;
+/* if set, sendUdp() and recvUdp() go through it instead of the socket, */
+/* e.g. to run over an emulated network (netsim/netsim.c) */
+
 UdpSocket_t *setupUdpSocket_t(const char *hostname, const uint16_t port);
 /* unicast */
 /* hostname == null, port == 0    local end-point, ephemeral port */
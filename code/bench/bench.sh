@@ -0,0 +1,162 @@
+#!/bin/bash
+
+# Throughput benchmark: RdtClient -> slurpe-3 -> RdtServer over a matrix of
+# file sizes and slurpe-3 impairments, checking every output file.
+# 190010906, October 2026.
+
+# slurpe-3, RdtClient and RdtServer all use port getuid(), so they can't
+# share one host. Each runs in its own network namespace instead, with
+# slurpe-3 in the middle on two point-to-point veth links:
+#
+#   client 10.31.1.1 <-> 10.31.1.2 slurpe 10.31.2.2 <-> 10.31.2.1 server
+#
+# Needs root (for the namespaces). The programs themselves run as
+# BENCH_UID, which is also the port they use.
+#
+# Usage (from the code directory): make bench
+#                              or: ./bench/bench.sh [out_dir]
+#
+# Environment:
+#   SIZES    file sizes in bytes       (default "16384 262144 1048576")
+#   MODES    slurpe-3 impairments      (default "none delay loss rate fullpe")
+#            "none" runs slurpe-3 as a plain reflector.
+#   REPEAT   runs per combination      (default 1)
+#   TIMEOUT  seconds before a run fails (default 300)
+#   BENCH_UID  uid/port to run as      (default 40000)
+#   CLIENT_ARGS, SERVER_ARGS  extra arguments, e.g. CLIENT_ARGS=compress
+
+cd "$(dirname "$0")/.." || exit 1
+
+out_dir=${1:-bench/results}
+sizes=${SIZES:-"16384 262144 1048576"}
+modes=${MODES:-"none delay loss rate fullpe"}
+repeat=${REPEAT:-1}
+timeout_s=${TIMEOUT:-300}
+uid=${BENCH_UID:-40000}
+slurpe=../slurpe-3
+
+ns_c=rdtbench-c
+ns_p=rdtbench-p
+ns_s=rdtbench-s
+ip_c=10.31.1.1
+ip_s=10.31.2.1
+
+as_uid="setpriv --reuid=$uid --regid=$uid --clear-groups"
+
+
+# ---- setup
+
+if [ "$(id -u)" != "0" ]; then
+  echo "bench.sh: needs root to create network namespaces." >&2
+  exit 1
+fi
+
+for p in ./RdtClient ./RdtServer $slurpe; do
+  if [ ! -x $p ]; then
+    echo "bench.sh: $p not found. Run 'make RdtClient RdtServer' first." >&2
+    exit 1
+  fi
+done
+
+cleanup_ns() {
+  ip netns del $ns_c 2>/dev/null
+  ip netns del $ns_p 2>/dev/null
+  ip netns del $ns_s 2>/dev/null
+}
+
+cleanup() {
+  cleanup_ns
+  rm -rf "$work"
+}
+trap cleanup EXIT
+
+work=$(mktemp -d /tmp/rdtbench.XXXXXX)
+chmod 777 "$work"
+mkdir -p "$out_dir" || exit 1
+cleanup_ns
+
+ip netns add $ns_c && ip netns add $ns_p && ip netns add $ns_s || exit 1
+ip link add rb-c type veth peer name rb-pc
+ip link add rb-s type veth peer name rb-ps
+ip link set rb-c netns $ns_c
+ip link set rb-pc netns $ns_p
+ip link set rb-ps netns $ns_p
+ip link set rb-s netns $ns_s
+ip -n $ns_c addr add $ip_c/24 dev rb-c
+ip -n $ns_p addr add 10.31.1.2/24 dev rb-pc
+ip -n $ns_p addr add 10.31.2.2/24 dev rb-ps
+ip -n $ns_s addr add $ip_s/24 dev rb-s
+for ns in $ns_c $ns_p $ns_s; do
+  ip -n $ns link set lo up
+  for dev in $(ip -n $ns -o link show type veth | awk -F'[ :@]+' '{print $2}'); do
+    ip -n $ns link set $dev up
+  done
+done
+
+
+# ---- runs
+
+csv=$out_dir/results.csv
+json=$out_dir/results.json
+echo "mode,size,run,ok,time_s,goodput_Bps,retransmits,rto_retransmits,ack_retransmits" > "$csv"
+echo "[" > "$json"
+first=1
+
+for mode in $modes; do
+  flags=$mode
+  [ "$mode" == "none" ] && flags=""
+
+  for size in $sizes; do
+    head -c "$size" /dev/urandom > "$work/in.bin"
+    chmod 644 "$work/in.bin"
+
+    for run in $(seq 1 "$repeat"); do
+      rm -f "$work/out.bin"
+
+      ip netns exec $ns_p timeout "$timeout_s" $as_uid $slurpe $flags $ip_c $ip_s \
+        > "$work/slurpe.log" 2>&1 &
+      slurpe_pid=$!
+      ip netns exec $ns_s timeout "$timeout_s" $as_uid stdbuf -oL ./RdtServer "$work/out.bin" $SERVER_ARGS \
+        > "$work/server.log" 2>&1 &
+      server_pid=$!
+      sleep 0.5
+
+      ip netns exec $ns_c timeout "$timeout_s" $as_uid stdbuf -oL ./RdtClient 10.31.1.2 "$work/in.bin" time stats $CLIENT_ARGS \
+        > "$work/client.log" 2>&1
+      client_status=$?
+
+      wait $server_pid
+      kill $slurpe_pid 2>/dev/null
+      wait $slurpe_pid 2>/dev/null
+
+      ok=0
+      if [ $client_status -eq 0 ] && cmp -s "$work/in.bin" "$work/out.bin"; then
+        ok=1
+      fi
+
+      time_s=$(grep -a "Transmission Time:" "$work/client.log" | tail -1 | sed 's/.*: *\([0-9.]*\)s/\1/')
+      time_s=${time_s:-0}
+      read -r rto ack syn fin <<< "$(grep -a "^Retransmits:" "$work/client.log" | tail -1 | \
+        sed 's/Retransmits: *\([0-9]*\) on RTO, \([0-9]*\) on ACK, \([0-9]*\) SYN, \([0-9]*\) FIN/\1 \2 \3 \4/')"
+      rto=${rto:-0}; ack=${ack:-0}; syn=${syn:-0}; fin=${fin:-0}
+      retransmits=$((rto + ack + syn + fin))
+      goodput=$(awk -v n="$size" -v t="$time_s" 'BEGIN { if (t > 0) printf "%.0f", n / t; else print 0 }')
+
+      echo "$mode,$size,$run,$ok,$time_s,$goodput,$retransmits,$rto,$ack" >> "$csv"
+      [ $first -eq 0 ] && echo "," >> "$json"
+      first=0
+      printf '  {"mode": "%s", "size": %s, "run": %s, "ok": %s, "time_s": %s, "goodput_Bps": %s, "retransmits": %s, "rto_retransmits": %s, "ack_retransmits": %s}' \
+        "$mode" "$size" "$run" "$([ $ok -eq 1 ] && echo true || echo false)" "$time_s" "$goodput" "$retransmits" "$rto" "$ack" >> "$json"
+
+      printf "%-6s %9s bytes  run %s  %s  %10ss  %12s B/s  %s retransmits\n" \
+        "$mode" "$size" "$run" "$([ $ok -eq 1 ] && echo OK || echo FAIL)" "$time_s" "$goodput" "$retransmits"
+      if [ $ok -ne 1 ]; then
+        cp "$work/client.log" "$out_dir/client-$mode-$size-$run.log"
+        cp "$work/server.log" "$out_dir/server-$mode-$size-$run.log"
+      fi
+    done
+  done
+done
+
+printf "\n]\n" >> "$json"
+echo "Results in $csv and $json"
@@ -0,0 +1,376 @@
+//
+// 190010906, October 2026.
+//
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../rdt.h"
+#include "../checksum/checksum.h"
+#include "../sigalrm/sigalrm.h"
+#include "../trace/trace.h"
+
+/*
+  Microbenchmarks of the per-segment hot path: building, sending, receiving and checksumming packets,
+  turning them into events, and the fsm() transitions a sender and a receiver go through per segment.
+
+  Each operation is timed warm (back to back, caches hot) and cold (one at a time, after evicting the
+  caches), for several payload sizes. Datagrams go through a G_udp_transport that drops or replays
+  them, and timers through a G_timer_hook that does nothing, so the numbers are the library's own CPU
+  cost without the syscalls. Allocations are counted by wrapping malloc(), calloc() and realloc() at
+  link time (-Wl,--wrap), which sees every call made from the rdt objects.
+
+  Usage: ./RdtMicrobench [csv] [quick]
+*/
+
+#define MB_WARM_NS      ((uint64_t) 20000000)   // Keep doubling a warm batch until it takes this long.
+#define MB_COLD_SAMPLES 101                     // Cold runs per case. Odd, for the median.
+#define MB_EVICT_SIZE   ((size_t) 64 << 20)     // Bigger than any last level cache we run on.
+
+/* Internal to rdt.c */
+RdtPacket_t* createPacket(RdtState_t* c, RDTPacketType_t type, uint32_t seq_no, uint8_t* data);
+int sendRdtPacket(RdtState_t* c, RdtPacket_t* packet, const uint16_t n);
+RdtPacket_t* recvRdtPacket(RdtState_t* c, bool* intact);
+int rdtTypeToRdtEvent(RDTPacketType_t type);
+
+
+/* ALLOCATION COUNTING START */
+uint64_t G_allocations = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  G_allocations++;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+  G_allocations++;
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  G_allocations++;
+  return __real_realloc(ptr, size);
+}
+/* ALLOCATION COUNTING END */
+
+
+/* TRANSPORT START */
+uint8_t  G_datagram[sizeof(RdtPacket_t)];  // What the fake transport hands to recvUdp().
+uint16_t G_datagram_size;
+
+int discardSend(const UdpSocket_t* local, const UdpSocket_t* remote, const UdpBuffer_t* buffer) {
+  return buffer->n;
+}
+
+int replayRecv(const UdpSocket_t* local, const UdpSocket_t* remote, UdpBuffer_t* buffer) {
+  uint16_t n = G_datagram_size < buffer->n ? G_datagram_size : buffer->n;
+  memcpy(buffer->bytes, G_datagram, n);
+  return n;
+}
+
+int ignoreTimer(unsigned int sec, unsigned int usec) {
+  return 0;
+}
+
+const UdpTransport_t G_bench_transport = { discardSend, replayRecv };
+
+/**
+ * Builds a datagram as the peer would send it, for replayRecv() to return.
+ * @param type Packet type.
+ * @param seq_no Sequence number.
+ * @param n Payload size.
+ */
+void prepareDatagram(RDTPacketType_t type, uint32_t seq_no, uint16_t n) {
+  RdtPacket_t* packet = (RdtPacket_t*) G_datagram;
+
+  memset(G_datagram, 0, sizeof(G_datagram));
+  for (uint16_t i = 0; i < n; i++) {
+    packet->data[i] = (uint8_t) (i * 31 + 7);
+  }
+  packet->header.type = htons(type);
+  packet->header.sequence = htonl(seq_no);
+  packet->header.size = htons(n);
+  packet->header.timestamp = htonl(1);
+  packet->header.echo = htonl(0);
+  packet->header.checksum = ipv4_header_checksum(packet, sizeof(RdtHeader_t) + n);
+  G_datagram_size = sizeof(RdtHeader_t) + n;
+}
+/* TRANSPORT END */
+
+
+/* OPERATIONS START */
+uint16_t      G_payload;
+uint8_t*      G_data;
+RdtPacket_t*  G_out;
+RdtSocket_t   G_bench_socket;
+UdpSocket_t   G_bench_local, G_bench_remote;
+RdtEvent_t    G_event;
+volatile int  G_sink;
+
+void opCreatePacket() {
+  G_conn->seq_no = G_conn->seq_init;
+  RdtPacket_t* packet = createPacket(G_conn, DATA, G_conn->seq_no, G_conn->buf);
+  G_sink += packet->header.checksum;
+  free(packet);
+}
+
+void setupSendRdtPacket() {
+  G_conn->seq_no = G_conn->seq_init;
+  G_out = createPacket(G_conn, DATA, G_conn->seq_no, G_conn->buf);
+}
+
+void opSendRdtPacket() {
+  G_sink += sendRdtPacket(G_conn, G_out, sizeof(RdtHeader_t) + G_payload);
+}
+
+void teardownSendRdtPacket() {
+  free(G_out);
+}
+
+void setupRecvRdtPacket() {
+  prepareDatagram(DATA, G_conn->seq_init, G_payload);
+}
+
+void opRecvRdtPacket() {
+  bool intact;
+  RdtPacket_t* packet = recvRdtPacket(G_conn, &intact);
+  G_sink += packet->header.size;
+  free(packet);
+}
+
+void opChecksum() {
+  G_sink += ipv4_header_checksum(G_data, sizeof(RdtHeader_t) + G_payload);
+}
+
+void opTypeToEvent() {
+  for (int type = SYN; type <= RST; type++) {
+    G_sink += rdtTypeToRdtEvent((RDTPacketType_t) type);
+  }
+}
+
+void opTrace() {
+  rdtTrace(RDT_STATE_DATA_SENT, RDT_STATE_DATA_SENT, RDT_EVENT_RCV_ACK, RDT_ACTION_SND_DATA, G_payload, G_conn->buf_size, 1);
+}
+
+/* Sender, one segment: DATA_SENT --rcv ACK--> send the next DATA. */
+void setupSenderAck() {
+  prepareDatagram(ACK, G_conn->seq_init + G_payload, 0);
+  G_event.packet = recvRdtPacket(G_conn, &G_event.intact);
+  G_event.input = RDT_EVENT_RCV_ACK;
+  G_conn->sender = true;
+}
+
+void opSenderAck() {
+  G_conn->state = RDT_STATE_DATA_SENT;
+  G_conn->seq_no = G_conn->seq_init + G_payload;
+  G_conn->buf_size = 2 * G_payload;
+  rdtFsm(G_conn, &G_event);
+}
+
+/* Receiver, one segment: ESTABLISHED --rcv DATA--> store it and send the ACK. */
+void setupReceiverData() {
+  prepareDatagram(DATA, G_conn->seq_init, G_payload);
+  G_event.packet = recvRdtPacket(G_conn, &G_event.intact);
+  G_event.input = RDT_EVENT_RCV_DATA;
+  G_conn->sender = false;
+}
+
+void opReceiverData() {
+  G_conn->state = RDT_STATE_ESTABLISHED;
+  G_conn->seq_no = G_conn->seq_init;
+  rdtFsm(G_conn, &G_event);
+}
+
+void teardownReceived() {
+  free((RdtPacket_t*) G_event.packet);
+  G_event.packet = NULL;
+}
+
+typedef struct Benchmark_s {
+  const char* name;
+  bool        sized;     // Depends on the payload size.
+  void        (*setup)();
+  void        (*op)();
+  void        (*teardown)();
+} Benchmark_t;
+
+const Benchmark_t G_benchmarks[] = {
+  { "createPacket",          true,  NULL,                opCreatePacket,  NULL },
+  { "sendRdtPacket",         true,  setupSendRdtPacket,  opSendRdtPacket, teardownSendRdtPacket },
+  { "recvRdtPacket",         true,  setupRecvRdtPacket,  opRecvRdtPacket, NULL },
+  { "ipv4_header_checksum",  true,  NULL,                opChecksum,      NULL },
+  { "rdtTypeToRdtEvent x7",  false, NULL,                opTypeToEvent,   NULL },
+  { "rdtTrace",              false, NULL,                opTrace,         NULL },
+  { "fsm DATA_SENT+ACK",     true,  setupSenderAck,      opSenderAck,     teardownReceived },
+  { "fsm ESTABLISHED+DATA",  true,  setupReceiverData,   opReceiverData,  teardownReceived },
+};
+
+const uint16_t G_payloads[] = { 0, 64, 512, RDT_MAX_SIZE };
+/* OPERATIONS END */
+
+
+/* TIMING START */
+uint8_t* G_evict;
+
+uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/**
+ * Pushes code and data out of the caches by writing a buffer bigger than them.
+ */
+void evictCaches() {
+  for (size_t i = 0; i < MB_EVICT_SIZE; i += 64) {
+    G_evict[i]++;
+  }
+}
+
+int compareU64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Times an operation back to back, doubling the batch until it runs for MB_WARM_NS.
+ * @param op The operation.
+ * @param allocations Set to allocations per operation.
+ * @return double ns per operation.
+ */
+double timeWarm(void (*op)(), double* allocations) {
+  uint64_t iterations = 64, elapsed = 0, allocated = 0;
+
+  for (uint64_t i = 0; i < iterations; i++) op(); // Warm up.
+
+  for (;;) {
+    uint64_t before = G_allocations;
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < iterations; i++) op();
+    elapsed = nowNs() - start;
+    allocated = G_allocations - before;
+    if (elapsed >= MB_WARM_NS) break;
+    iterations *= 2;
+  }
+
+  *allocations = (double) allocated / (double) iterations;
+  return (double) elapsed / (double) iterations;
+}
+
+/**
+ * Times single runs of an operation with the caches evicted before each, less the cost of reading the
+ * clock.
+ * @param op The operation.
+ * @param samples Runs to take the median of.
+ * @param allocations Set to allocations per operation.
+ * @return double Median ns per operation.
+ */
+double timeCold(void (*op)(), int samples, double* allocations) {
+  uint64_t ns[MB_COLD_SAMPLES], overhead[MB_COLD_SAMPLES];
+  uint64_t allocated = 0;
+
+  for (int i = 0; i < samples; i++) {
+    uint64_t start = nowNs();
+    overhead[i] = nowNs() - start;
+  }
+
+  for (int i = 0; i < samples; i++) {
+    evictCaches();
+    uint64_t before = G_allocations;
+    uint64_t start = nowNs();
+    op();
+    ns[i] = nowNs() - start;
+    allocated += G_allocations - before;
+  }
+
+  qsort(ns, samples, sizeof(uint64_t), compareU64);
+  qsort(overhead, samples, sizeof(uint64_t), compareU64);
+  *allocations = (double) allocated / (double) samples;
+  return ns[samples / 2] > overhead[samples / 2] ? (double) (ns[samples / 2] - overhead[samples / 2]) : 0;
+}
+/* TIMING END */
+
+
+int main(int argc, char* argv[]) {
+  bool csv = false;
+  int samples = MB_COLD_SAMPLES;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "csv") == 0) {
+      csv = true;
+    } else if (strcmp(argv[i], "quick") == 0) {
+      samples = 11;
+    } else {
+      printf("Usage: ./RdtMicrobench [csv] [quick]\n");
+      return -1;
+    }
+  }
+
+  G_evict = (uint8_t*) calloc(1, MB_EVICT_SIZE);
+  G_data = (uint8_t*) calloc(1, sizeof(RdtPacket_t));
+  G_conn->buf = (uint8_t*) calloc(1, 2 * RDT_MAX_SIZE);
+  if (G_evict == NULL || G_data == NULL || G_conn->buf == NULL) {
+    perror("Couldn't allocate buffers");
+    return -1;
+  }
+  for (size_t i = 0; i < 2 * RDT_MAX_SIZE; i++) {
+    G_conn->buf[i] = (uint8_t) i;
+  }
+
+  /* Nothing leaves the process: no sockets, no timers */
+  G_bench_socket.local = &G_bench_local;
+  G_bench_socket.remote = &G_bench_remote;
+  G_conn->socket = &G_bench_socket;
+  G_udp_transport = &G_bench_transport;
+  G_timer_hook = ignoreTimer;
+  G_conn->seq_init = 1000;
+
+  /* Results go to the real stdout. The library's progress output goes nowhere. */
+  FILE* results = fdopen(dup(STDOUT_FILENO), "w");
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    perror("Couldn't redirect stdout");
+  }
+
+  if (csv) {
+    fprintf(results, "operation,payload,warm_ns,warm_allocs,cold_ns,cold_allocs\n");
+  } else {
+    fprintf(results, "%-22s %7s %10s %8s %10s %8s\n", "operation", "payload", "warm ns", "allocs", "cold ns", "allocs");
+  }
+
+  for (size_t b = 0; b < sizeof(G_benchmarks) / sizeof(G_benchmarks[0]); b++) {
+    const Benchmark_t* bench = &G_benchmarks[b];
+    size_t payloads = bench->sized ? sizeof(G_payloads) / sizeof(G_payloads[0]) : 1;
+
+    for (size_t p = 0; p < payloads; p++) {
+      double warm_allocs, cold_allocs;
+
+      G_payload = bench->sized ? G_payloads[p] : 0;
+      G_conn->buf_size = G_payload;
+      if (bench->setup) bench->setup();
+      double warm = timeWarm(bench->op, &warm_allocs);
+      double cold = timeCold(bench->op, samples, &cold_allocs);
+      if (bench->teardown) bench->teardown();
+
+      if (csv) {
+        fprintf(results, "%s,%d,%.1f,%.2f,%.0f,%.2f\n", bench->name, bench->sized ? G_payload : -1,
+                warm, warm_allocs, cold, cold_allocs);
+      } else if (bench->sized) {
+        fprintf(results, "%-22s %7u %10.1f %8.2f %10.0f %8.2f\n", bench->name, G_payload, warm, warm_allocs, cold, cold_allocs);
+      } else {
+        fprintf(results, "%-22s %7s %10.1f %8.2f %10.0f %8.2f\n", bench->name, "-", warm, warm_allocs, cold, cold_allocs);
+      }
+      fflush(results);
+    }
+  }
+
+  fclose(results);
+  return 0;
+}
@@ -0,0 +1,353 @@
+//
+// 190010906, October 2026.
+//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../rdt.h"
+#include "../sigalrm/sigalrm.h"
+#include "../trace/trace.h"
+
+/*
+  Replays a trace recorded with 'trace file' through rdtFsm() at full speed, to measure what the FSM
+  costs per event and optimise it in isolation.
+
+  Each record becomes one step: the event it recorded, with a packet made up to match (a DATA segment
+  of the size the sequence number moved by, an ACK for everything sent so far, and so on). Before each
+  step, the connection is put back in the recorded state, at the recorded sequence number, so every
+  step takes the same path through the FSM as it did live, whatever the step before it did. The first
+  pass checks this by comparing the state each step ends in with the recorded one. Datagrams go
+  through a G_udp_transport that drops them, and timers through a G_timer_hook that does nothing, so
+  only the library's own CPU is measured.
+
+  Usage: ./RdtReplay trace_file [loops N] [breakdown]
+*/
+
+#define RP_EVENTS   ((uint64_t) 2000000)   // Events to replay by default. Sets the number of loops.
+#define RP_SEQ_INIT ((uint32_t) 1000)      // Initial sequence number of the replayed connection.
+
+/* Internal to rdt.c */
+int rdtTypeToRdtEvent(RDTPacketType_t type);
+
+
+/* TRANSPORT START */
+int discardSend(const UdpSocket_t* local, const UdpSocket_t* remote, const UdpBuffer_t* buffer) {
+  return buffer->n;
+}
+
+int emptyRecv(const UdpSocket_t* local, const UdpSocket_t* remote, UdpBuffer_t* buffer) {
+  return 0;
+}
+
+int ignoreTimer(unsigned int sec, unsigned int usec) {
+  return 0;
+}
+
+const UdpTransport_t G_replay_transport = { discardSend, emptyRecv };
+/* TRANSPORT END */
+
+
+/* STEPS START */
+typedef struct ReplayStep_s {
+  int         input;      // RDT_INPUT_* or RDT_EVENT_*.
+  bool        packet;     // Whether the event carries 'header'.
+  RdtHeader_t header;     // Packet received, host byte order.
+  int         state;      // State before the event.
+  bool        sender;
+  uint32_t    seq;        // Bytes sent or received before the event.
+  uint32_t    size;       // Sender's buffer size.
+  int         expected;   // State the event led to when recorded.
+} ReplayStep_t;
+
+RdtSocket_t   G_replay_socket;
+UdpSocket_t   G_replay_local, G_replay_remote;
+RdtPacket_t   G_packet;   // The packet of the current step. The payload is never looked at.
+uint8_t*      G_scratch;  // Stands in for the transfer's buffer.
+uint32_t      G_scratch_size;
+
+/**
+ * Makes up the packet a recorded event received.
+ * @param step The step. Its input, seq, size and expected state must be set.
+ * @param after Bytes sent or received after the event, as recorded.
+ */
+void synthesizePacket(ReplayStep_t* step, uint32_t after) {
+  RdtHeader_t* header = &step->header;
+  uint32_t n = after - step->seq;
+
+  memset(header, 0, sizeof(RdtHeader_t));
+  step->packet = true;
+  switch (step->input) {
+    case RDT_EVENT_RCV_SYN:
+      header->type = SYN;
+      header->sequence = RP_SEQ_INIT;
+      break;
+    case RDT_EVENT_RCV_SYN_ACK:
+      header->type = SYN_ACK;
+      header->sequence = RP_SEQ_INIT;
+      break;
+    case RDT_EVENT_RCV_DATA:
+      /* The next segment if the sequence number moved, else one ahead of it, which is only ACKed */
+      header->type = DATA;
+      if (after > step->seq && n <= RDT_MAX_SIZE) {
+        header->sequence = RP_SEQ_INIT + step->seq;
+        header->size = (uint16_t) n;
+      } else {
+        header->sequence = RP_SEQ_INIT + step->seq + RDT_MAX_SIZE;
+      }
+      break;
+    case RDT_EVENT_RCV_ACK:
+      header->type = ACK;
+      header->sequence = RP_SEQ_INIT + step->seq;
+      header->echo = 1;  // Set when the step runs, so each ACK gives an RTT sample.
+      header->window = step->expected == RDT_STATE_PERSIST ? 0 : RDT_WINDOW_MAX;
+      break;
+    case RDT_EVENT_RCV_FIN:
+      header->type = FIN;
+      header->sequence = RP_SEQ_INIT + step->seq;
+      break;
+    case RDT_EVENT_RCV_FIN_ACK:
+      header->type = FIN_ACK;
+      break;
+    case RDT_EVENT_RCV_RST:
+      header->type = RST;
+      break;
+    case RDT_EVENT_RCV_FORWARD:
+      header->type = FORWARD;
+      header->sequence = RP_SEQ_INIT + after;
+      break;
+    default:
+      step->packet = false;
+  }
+}
+
+/**
+ * Turns the valid records of a trace, oldest first, into steps.
+ * @param trace The trace.
+ * @param count Set to the number of steps.
+ * @return ReplayStep_t* The steps, or NULL if out of memory.
+ */
+ReplayStep_t* loadSteps(const RdtTrace_t* trace, uint64_t* count) {
+  uint64_t first = trace->head > trace->records ? trace->head - trace->records : 0;
+  uint32_t seq[2] = { 0, 0 };   // Bytes so far on each side, by sender flag.
+  bool started[2] = { false, false };
+  uint32_t largest = 0;
+
+  ReplayStep_t* steps = (ReplayStep_t*) calloc(trace->head - first + 1, sizeof(ReplayStep_t));
+  if (steps == NULL) {
+    return NULL;
+  }
+
+  *count = 0;
+  for (uint64_t i = first; i < trace->head; i++) {
+    const RdtTraceRecord_t* r = &trace->ring[i & (trace->records - 1)];
+    if (r->id != (uint32_t) (i + 1)) {
+      continue;
+    }
+
+    /* The oldest record on each side has nothing before it. Take it as not having moved. */
+    int side = r->sender != 0;
+    if (!started[side]) {
+      seq[side] = r->seq;
+      started[side] = true;
+    }
+
+    ReplayStep_t* step = &steps[(*count)++];
+    step->input = r->input;
+    step->state = r->old_state;
+    step->sender = r->sender != 0;
+    step->seq = seq[side];
+    step->size = r->size;
+    step->expected = r->new_state;
+    synthesizePacket(step, r->seq);
+
+    seq[side] = r->seq;
+    largest = r->seq > largest ? r->seq : largest;
+    largest = r->size > largest ? r->size : largest;
+  }
+
+  /* Big enough that a receiver never grows its buffer, and a sender never reads past it */
+  G_scratch_size = largest + RDT_MAX_SIZE;
+  G_scratch = (uint8_t*) calloc(1, G_scratch_size);
+  if (G_scratch == NULL) {
+    free(steps);
+    return NULL;
+  }
+  return steps;
+}
+
+/**
+ * Puts the connection in the state a step was recorded in, and runs its event through the FSM.
+ * @param c The connection.
+ * @param step The step.
+ * @return int The state the connection ended in.
+ */
+int runStep(RdtState_t* c, const ReplayStep_t* step) {
+  RdtEvent_t event = { step->input, NULL, true };
+
+  c->state = step->state;
+  c->sender = step->sender;
+  c->seq_init = RP_SEQ_INIT;
+  c->seq_no = RP_SEQ_INIT + step->seq;
+  c->buf = G_scratch;
+  c->buf_size = step->sender ? step->size : G_scratch_size;
+  c->retries = 0;
+  c->windowed = true;
+  c->snd_shift = RDT_WINDOW_SHIFT;
+  c->snd_wnd = step->state == RDT_STATE_PERSIST ? 0 : UINT32_MAX;
+
+  if (step->packet) {
+    G_packet.header = step->header;
+    if (G_packet.header.echo != 0) {
+      G_packet.header.echo = rtoTimestamp();
+    }
+    event.packet = &G_packet;
+  }
+
+  rdtFsm(c, &event);
+
+  /* A SYN or FIN points the connection at a new remote socket */
+  if (c->socket->remote != &G_replay_remote) {
+    free(c->socket->remote);
+    c->socket->remote = &G_replay_remote;
+  }
+  return c->state;
+}
+/* STEPS END */
+
+
+/* TIMING START */
+uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/**
+ * Times each step on its own, and prints the mean by state and input, less the cost of reading the
+ * clock.
+ * @param out Where to print.
+ * @param c The connection.
+ * @param steps The steps.
+ * @param count Number of steps.
+ * @param loops Times to run them all.
+ */
+void printBreakdown(FILE* out, RdtState_t* c, const ReplayStep_t* steps, uint64_t count, uint64_t loops) {
+  static uint64_t ns[RDT_FSM_STRINGS][RDT_FSM_STRINGS], events[RDT_FSM_STRINGS][RDT_FSM_STRINGS];
+  uint64_t overhead = nowNs();
+
+  for (int i = 0; i < 1000; i++) nowNs();
+  overhead = (nowNs() - overhead) / 1001;
+
+  for (uint64_t l = 0; l < loops; l++) {
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t start = nowNs();
+      runStep(c, &steps[i]);
+      uint64_t elapsed = nowNs() - start;
+      if (steps[i].state < RDT_FSM_STRINGS && steps[i].input < RDT_FSM_STRINGS) {
+        ns[steps[i].state][steps[i].input] += elapsed > overhead ? elapsed - overhead : 0;
+        events[steps[i].state][steps[i].input]++;
+      }
+    }
+  }
+
+  fprintf(out, "\n%-12s %-13s %10s %10s\n", "state", "input", "events", "ns/event");
+  for (int s = RDT_STATE_CLOSED; s <= RDT_STATE_PERSIST; s++) {
+    for (int i = 0; i < RDT_FSM_STRINGS; i++) {
+      if (events[s][i] > 0) {
+        fprintf(out, "%-12s %-13s %10" PRIu64 " %10.1f\n", fsm_strings[s], fsm_strings[i], events[s][i],
+                (double) ns[s][i] / (double) events[s][i]);
+      }
+    }
+  }
+}
+/* TIMING END */
+
+
+int main(int argc, char* argv[]) {
+  uint64_t loops = 0, count = 0, mismatches = 0;
+  bool breakdown = false;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "loops") == 0 && i + 1 < argc) {
+      loops = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "breakdown") == 0) {
+      breakdown = true;
+    } else {
+      argc = 0;
+    }
+  }
+  if (argc < 2) {
+    printf("Usage: ./RdtReplay trace_file [loops N] [breakdown]\n");
+    return -1;
+  }
+
+  RdtTrace_t* trace = rdtTraceRead(argv[1]);
+  if (trace == NULL) {
+    return -1;
+  }
+  ReplayStep_t* steps = loadSteps(trace, &count);
+  free(trace);
+  if (steps == NULL) {
+    perror("Couldn't allocate steps");
+    return -1;
+  }
+  if (count == 0) {
+    printf("No records in %s\n", argv[1]);
+    return -1;
+  }
+  if (loops == 0) {
+    loops = RP_EVENTS / count > 0 ? RP_EVENTS / count : 1;
+  }
+
+  /* Nothing leaves the process: no sockets, no timers */
+  RdtState_t* c = rdtCreateState();
+  if (c == NULL) {
+    perror("Couldn't allocate connection");
+    return -1;
+  }
+  G_replay_socket.local = &G_replay_local;
+  G_replay_socket.remote = &G_replay_remote;
+  G_replay_socket.receive.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // A SYN is taken from here.
+  G_replay_socket.receive.addr.sin_port = htons(1);
+  c->socket = &G_replay_socket;
+  G_udp_transport = &G_replay_transport;
+  G_timer_hook = ignoreTimer;
+  G_debug = true;  // No progress output: it would be timed too.
+
+  /* Results go to the real stdout. The library's output goes nowhere. */
+  FILE* results = fdopen(dup(STDOUT_FILENO), "w");
+  if (freopen("/dev/null", "w", stdout) == NULL) {
+    perror("Couldn't redirect stdout");
+  }
+
+  /* Untimed pass: each step must end where it did when recorded */
+  for (uint64_t i = 0; i < count; i++) {
+    mismatches += runStep(c, &steps[i]) != steps[i].expected;
+  }
+
+  uint64_t start = nowNs();
+  for (uint64_t l = 0; l < loops; l++) {
+    for (uint64_t i = 0; i < count; i++) {
+      runStep(c, &steps[i]);
+    }
+  }
+  uint64_t elapsed = nowNs() - start;
+  uint64_t events = count * loops;
+
+  fprintf(results, "%" PRIu64 " events (%" PRIu64 " steps x %" PRIu64 " loops) in %.3fs: %.2fM events/s, %.1f ns/event\n",
+          events, count, loops, (double) elapsed / 1e9, (double) events / ((double) elapsed / 1e3),
+          (double) elapsed / (double) events);
+  fprintf(results, "%" PRIu64 " of %" PRIu64 " steps ended in a different state than recorded\n", mismatches, count);
+
+  if (breakdown) {
+    printBreakdown(results, c, steps, count, loops);
+  }
+
+  fclose(results);
+  free(steps);
+  free(G_scratch);
+  return 0;
+}
@@ -0,0 +1,87 @@
+//
+// 190010906, October 2026.
+//
+#include <endian.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+#define CHECKPOINT_SIZE      (8 + 2 * sizeof(uint64_t))
+
+
+/**
+ * Loads a checkpoint written by saveCheckpoint().
+ * @param path Path of the checkpoint file.
+ * @param checkpoint Set to the stored checkpoint.
+ * @return 0 if a valid checkpoint was loaded, -1 otherwise.
+ */
+int loadCheckpoint(const char* path, Checkpoint_t* checkpoint) {
+  uint8_t bytes[CHECKPOINT_SIZE];
+  uint64_t value;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  ssize_t r = read(fd, bytes, CHECKPOINT_SIZE);
+  close(fd);
+
+  if (r != CHECKPOINT_SIZE || memcmp(bytes, CHECKPOINT_MAGIC, 8) != 0) {
+    return -1;
+  }
+
+  memcpy(&value, bytes + 8, sizeof(value));
+  checkpoint->transfer_id = be64toh(value);
+  memcpy(&value, bytes + 16, sizeof(value));
+  checkpoint->committed = be64toh(value);
+
+  return 0;
+}
+
+/**
+ * Durably saves a checkpoint. Written to a temporary file, synced and then renamed over the old
+ * checkpoint, so a crash leaves either the old or the new checkpoint and never a torn one.
+ * @param path Path of the checkpoint file.
+ * @param checkpoint The checkpoint to save.
+ * @return 0 if successful, -1 otherwise.
+ */
+int saveCheckpoint(const char* path, const Checkpoint_t* checkpoint) {
+  uint8_t bytes[CHECKPOINT_SIZE];
+  char tmp[FILENAME_MAX];
+  uint64_t value;
+
+  memcpy(bytes, CHECKPOINT_MAGIC, 8);
+  value = htobe64(checkpoint->transfer_id);
+  memcpy(bytes + 8, &value, sizeof(value));
+  value = htobe64(checkpoint->committed);
+  memcpy(bytes + 16, &value, sizeof(value));
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+    return -1;
+  }
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("saveCheckpoint(): open()");
+    return -1;
+  }
+
+  if (write(fd, bytes, CHECKPOINT_SIZE) != CHECKPOINT_SIZE || fdatasync(fd) != 0) {
+    perror("saveCheckpoint(): write()");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if (rename(tmp, path) != 0) {
+    perror("saveCheckpoint(): rename()");
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,20 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_CHECKPOINT_H
+#define CS3102_P2_CHECKPOINT_H
+
+#include <inttypes.h>
+
+#define CHECKPOINT_MAGIC     "RDTCKPT1"
+
+typedef struct Checkpoint_s {
+  uint64_t transfer_id;   // Transfer the checkpoint belongs to.
+  uint64_t committed;     // Bytes of the output file durably written, contiguous from the start of the transfer.
+} Checkpoint_t;
+
+int loadCheckpoint(const char* path, Checkpoint_t* checkpoint);
+int saveCheckpoint(const char* path, const Checkpoint_t* checkpoint);
+
+#endif //CS3102_P2_CHECKPOINT_H
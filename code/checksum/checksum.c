@@ -22,16 +22,17 @@ uint16_t ipv4_header_checksum(void *data, uint32_t size) {
   uint8_t *p_8 = (uint8_t *) data;
   uint32_t c = 0;
 
-  // Create sum of 16-bit words: sum is
-  // "backwards" for convenenince only.
+  // Create sum of 16-bit words. Indexing stays within
+  // [0, size), so no byte past the packet is read.
   for( ; size > 1; size -= 2) {
-    c += (uint32_t) p_8[size];
+    c += (uint32_t) ((p_8[0] << 8) | p_8[1]);
+    p_8 += 2;
   }
 
   // Deal with odd number of bytes.
   // IPv4 header should be 32-bit aligned.
   if (size) // size == 1 here
-    c += (uint16_t) ((uint8_t) p_8[0]);
+    c += (uint32_t) (p_8[0] << 8);
 
   // Recover any carry bits from 16-bit sum
   // to get the true one's complement sum.
@@ -0,0 +1,368 @@
+//
+// 190010906, October 2026.
+//
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "compress.h"
+
+#define LZF_HLOG             14
+#define LZF_MAX_OFF          ((uint32_t) 8192)
+#define LZF_MAX_REF          ((uint32_t) 264)
+#define LZF_MAX_LIT          ((uint32_t) 32)
+#define LZF_HASH(p_) ((((uint32_t) (p_)[0] << 16 | (uint32_t) (p_)[1] << 8 | (p_)[2]) * 2654435761u) >> (32 - LZF_HLOG))
+
+
+/* BUILT-IN CODEC START */
+/**
+ * Built-in LZF style compressor. Greedy single-probe hash table, so it is fast rather than tight.
+ *
+ * Control byte < 32: (ctrl + 1) literal bytes follow.
+ * Otherwise: length - 2 in the top 3 bits (7 means an extra length byte follows), offset - 1 in the
+ * low 5 bits plus the next byte.
+ *
+ * @param in Input bytes.
+ * @param n Size of 'in'.
+ * @param out Output buffer.
+ * @param out_max Size of 'out'.
+ * @return Compressed size, or 0 if it doesn't fit in 'out'.
+ */
+uint32_t lzfCompress(const uint8_t* in, uint32_t n, uint8_t* out, uint32_t out_max) {
+  uint32_t htab[1 << LZF_HLOG];
+  const uint8_t* ip = in;
+  const uint8_t* in_end = in + n;
+  uint8_t* op = out;
+  uint8_t* out_end = out + out_max;
+  uint8_t* lit_ctrl;
+  uint32_t lit = 0;
+
+  memset(htab, 0, sizeof(htab));
+
+  if (op >= out_end) return 0;
+  lit_ctrl = op++;
+
+  while (ip < in_end) {
+    /* Look for a back reference */
+    if (ip + 2 < in_end) {
+      uint32_t h = LZF_HASH(ip);
+      uint32_t ref_pos = htab[h];
+      htab[h] = (uint32_t) (ip - in) + 1;
+
+      if (ref_pos != 0) {
+        const uint8_t* ref = in + ref_pos - 1;
+        uint32_t off = (uint32_t) (ip - ref) - 1;
+
+        if (off < LZF_MAX_OFF && ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+          uint32_t len = 3;
+          uint32_t max_len = (uint32_t) (in_end - ip) < LZF_MAX_REF ? (uint32_t) (in_end - ip) : LZF_MAX_REF;
+          while (len < max_len && ref[len] == ip[len]) len++;
+
+          /* Close the current literal run, or reclaim its unused control byte */
+          if (lit) *lit_ctrl = (uint8_t) (lit - 1);
+          else op--;
+
+          if (op + 4 > out_end) return 0;
+          if (len - 2 < 7) {
+            *op++ = (uint8_t) (((len - 2) << 5) | (off >> 8));
+          } else {
+            *op++ = (uint8_t) ((7 << 5) | (off >> 8));
+            *op++ = (uint8_t) (len - 2 - 7);
+          }
+          *op++ = (uint8_t) (off & 0xff);
+
+          ip += len;
+          lit = 0;
+          lit_ctrl = op++;
+          continue;
+        }
+      }
+    }
+
+    /* Literal byte */
+    if (op >= out_end) return 0;
+    *op++ = *ip++;
+    if (++lit == LZF_MAX_LIT) {
+      *lit_ctrl = (uint8_t) (lit - 1);
+      lit = 0;
+      if (op >= out_end) return 0;
+      lit_ctrl = op++;
+    }
+  }
+
+  if (lit) *lit_ctrl = (uint8_t) (lit - 1);
+  else op--;
+
+  return (uint32_t) (op - out);
+}
+
+/**
+ * Built-in LZF style decompressor.
+ * @param in Compressed bytes.
+ * @param n Size of 'in'.
+ * @param out Output buffer.
+ * @param out_max Size of 'out'.
+ * @return Decompressed size, or 0 if the input is malformed.
+ */
+uint32_t lzfDecompress(const uint8_t* in, uint32_t n, uint8_t* out, uint32_t out_max) {
+  const uint8_t* ip = in;
+  const uint8_t* in_end = in + n;
+  uint8_t* op = out;
+  uint8_t* out_end = out + out_max;
+
+  while (ip < in_end) {
+    uint32_t ctrl = *ip++;
+
+    if (ctrl < LZF_MAX_LIT) {
+      ctrl++;
+      if (op + ctrl > out_end || ip + ctrl > in_end) return 0;
+      memcpy(op, ip, ctrl);
+      op += ctrl;
+      ip += ctrl;
+    } else {
+      uint32_t len = ctrl >> 5;
+      if (len == 7) {
+        if (ip >= in_end) return 0;
+        len += *ip++;
+      }
+      len += 2;
+
+      if (ip >= in_end) return 0;
+      uint32_t off = ((ctrl & 0x1f) << 8) + *ip++ + 1;
+      if (off > (uint32_t) (op - out) || op + len > out_end) return 0;
+
+      /* Byte-wise copy, as the reference may overlap the output */
+      const uint8_t* ref = op - off;
+      while (len--) *op++ = *ref++;
+    }
+  }
+
+  return (uint32_t) (op - out);
+}
+/* BUILT-IN CODEC END */
+
+
+/* CODECS START */
+/**
+ * Compresses with a given codec.
+ * @return Compressed size, or 0 if the codec failed or the output didn't fit in 'out_max'.
+ */
+uint32_t codecCompress(uint8_t codec, const uint8_t* in, uint32_t n, uint8_t* out, uint32_t out_max) {
+  switch (codec) {
+#ifdef HAVE_LZ4
+    case RDT_CODEC_LZ4: {
+      int r = LZ4_compress_default((const char*) in, (char*) out, (int) n, (int) out_max);
+      return r > 0 ? (uint32_t) r : 0;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case RDT_CODEC_ZLIB: {
+      uLongf r = out_max;
+      return compress2(out, &r, in, n, Z_BEST_SPEED) == Z_OK ? (uint32_t) r : 0;
+    }
+#endif
+    case RDT_CODEC_LZF:
+      return lzfCompress(in, n, out, out_max);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Decompresses with a given codec.
+ * @return Decompressed size, or 0 if the input is malformed.
+ */
+uint32_t codecDecompress(uint8_t codec, const uint8_t* in, uint32_t n, uint8_t* out, uint32_t out_max) {
+  switch (codec) {
+#ifdef HAVE_LZ4
+    case RDT_CODEC_LZ4: {
+      int r = LZ4_decompress_safe((const char*) in, (char*) out, (int) n, (int) out_max);
+      return r > 0 ? (uint32_t) r : 0;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case RDT_CODEC_ZLIB: {
+      uLongf r = out_max;
+      return uncompress(out, &r, in, n) == Z_OK ? (uint32_t) r : 0;
+    }
+#endif
+    case RDT_CODEC_LZF:
+      return lzfDecompress(in, n, out, out_max);
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Most a codec can expand its input: output bytes per input byte, at best. A back reference of the
+ * built-in codec is 3 bytes for up to 264, an LZ4 length byte adds 255, and deflate peaks at 1032:1.
+ * Bounds the length a header may claim for the bytes that arrived.
+ * @param codec The codec.
+ * @return uint32_t the ratio, or 0 if the codec isn't known.
+ */
+uint32_t codecMaxExpansion(uint8_t codec) {
+  switch (codec) {
+    case RDT_CODEC_NONE:
+      return 1;
+    case RDT_CODEC_LZF:
+      return LZF_MAX_REF / 3;
+    case RDT_CODEC_LZ4:
+      return 255;
+    case RDT_CODEC_ZLIB:
+      return 1032;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Bitmask of the codecs this build supports.
+ * @return uint8_t codec bitmask.
+ */
+uint8_t supportedCodecs() {
+  uint8_t codecs = RDT_CODEC_LZF;
+#ifdef HAVE_ZLIB
+  codecs |= RDT_CODEC_ZLIB;
+#endif
+#ifdef HAVE_LZ4
+  codecs |= RDT_CODEC_LZ4;
+#endif
+  return codecs;
+}
+
+/**
+ * Picks the preferred codec supported by both ends. LZ4 is cheapest on CPU, zlib compresses
+ * hardest, and the built-in codec is the fallback.
+ * @param offered Bitmask of codecs offered by the peer.
+ * @return uint8_t chosen codec, or RDT_CODEC_NONE.
+ */
+uint8_t chooseCodec(uint8_t offered) {
+  uint8_t common = offered & supportedCodecs();
+
+  if (common & RDT_CODEC_LZ4)  return RDT_CODEC_LZ4;
+  if (common & RDT_CODEC_ZLIB) return RDT_CODEC_ZLIB;
+  if (common & RDT_CODEC_LZF)  return RDT_CODEC_LZF;
+  return RDT_CODEC_NONE;
+}
+
+/**
+ * Name of a codec, for output.
+ */
+const char* codecName(uint8_t codec) {
+  switch (codec) {
+    case RDT_CODEC_LZ4:  return "lz4";
+    case RDT_CODEC_ZLIB: return "zlib";
+    case RDT_CODEC_LZF:  return "lzf";
+    default:             return "none";
+  }
+}
+/* CODECS END */
+
+
+/* FRAMING START */
+/**
+ * Encodes a buffer for sending: an 8 byte header (codec, original length) followed by the payload.
+ * A sample is compressed first and if it doesn't shrink by CODEC_MIN_SAVING percent, or the whole
+ * buffer doesn't shrink, the payload is sent raw with codec RDT_CODEC_NONE.
+ *
+ * @param codec Negotiated codec.
+ * @param in Data to encode.
+ * @param n Size of 'in'.
+ * @param out_n Set to the size of the returned buffer.
+ * @return Pointer to newly allocated encoded buffer, or NULL if out of memory.
+ */
+uint8_t* encodeBuffer(uint8_t codec, const uint8_t* in, uint32_t n, uint32_t* out_n) {
+  uint8_t* out = (uint8_t*) malloc(CODEC_HEADER_SIZE + n);
+  uint32_t r = 0;
+
+  if (out == NULL) {
+    return NULL;
+  }
+
+  /* Trial compress a sample so incompressible data costs little */
+  if (codec != RDT_CODEC_NONE) {
+    uint32_t sample = n < CODEC_SAMPLE_SIZE ? n : CODEC_SAMPLE_SIZE;
+    uint32_t limit = sample - (sample * CODEC_MIN_SAVING) / 100;
+    if (sample == 0 || codecCompress(codec, in, sample, out + CODEC_HEADER_SIZE, limit) == 0) {
+      codec = RDT_CODEC_NONE;
+    }
+  }
+
+  /* Compress the whole buffer. Output must be smaller than the input to be worth it. */
+  if (codec != RDT_CODEC_NONE) {
+    r = codecCompress(codec, in, n, out + CODEC_HEADER_SIZE, n - 1);
+    if (r == 0) {
+      codec = RDT_CODEC_NONE;
+    }
+  }
+
+  if (codec == RDT_CODEC_NONE) {
+    memcpy(out + CODEC_HEADER_SIZE, in, n);
+    r = n;
+  }
+
+  /* Header */
+  uint32_t length = htonl(n);
+  memset(out, 0, CODEC_HEADER_SIZE);
+  out[0] = codec;
+  memcpy(out + 4, &length, sizeof(length));
+
+  *out_n = CODEC_HEADER_SIZE + r;
+  return out;
+}
+
+/**
+ * Decodes a buffer produced by encodeBuffer().
+ * @param in Encoded data.
+ * @param n Size of 'in'.
+ * @param out_n Set to the size of the returned buffer.
+ * @return Pointer to newly allocated decoded buffer, or NULL if malformed, claiming more than 'in' can
+ * decode to, or out of memory.
+ */
+uint8_t* decodeBuffer(const uint8_t* in, uint32_t n, uint32_t* out_n) {
+  uint32_t length;
+
+  if (n < CODEC_HEADER_SIZE) {
+    return NULL;
+  }
+
+  memcpy(&length, in + 4, sizeof(length));
+  length = ntohl(length);
+
+  /* Don't allocate more than the data could decode to */
+  if ((uint64_t) length > (uint64_t) (n - CODEC_HEADER_SIZE) * codecMaxExpansion(in[0])) {
+    return NULL;
+  }
+
+  uint8_t* out = (uint8_t*) malloc(length > 0 ? length : 1);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  uint8_t codec = in[0];
+  in += CODEC_HEADER_SIZE;
+  n -= CODEC_HEADER_SIZE;
+
+  if (codec == RDT_CODEC_NONE) {
+    if (n != length) {
+      free(out);
+      return NULL;
+    }
+    memcpy(out, in, n);
+  } else if (length > 0 && codecDecompress(codec, in, n, out, length) != length) {
+    free(out);
+    return NULL;
+  }
+
+  *out_n = length;
+  return out;
+}
+/* FRAMING END */
@@ -0,0 +1,26 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_COMPRESS_H
+#define CS3102_P2_COMPRESS_H
+
+#include <inttypes.h>
+
+/* Codec identifiers. Used as a bitmask when advertised in the handshake. */
+#define RDT_CODEC_NONE       ((uint8_t) 0x00)
+#define RDT_CODEC_LZF        ((uint8_t) 0x01) // Built-in, always available.
+#define RDT_CODEC_ZLIB       ((uint8_t) 0x02)
+#define RDT_CODEC_LZ4        ((uint8_t) 0x04)
+
+#define CODEC_HEADER_SIZE    ((uint32_t) 8)     // codec (1), reserved (3), original length (4).
+#define CODEC_SAMPLE_SIZE    ((uint32_t) 65536) // Bytes trial-compressed before committing.
+#define CODEC_MIN_SAVING     ((uint32_t) 10)    // Minimum % saving on the sample to bother.
+
+uint8_t supportedCodecs();
+uint8_t chooseCodec(uint8_t offered);
+const char* codecName(uint8_t codec);
+uint8_t* encodeBuffer(uint8_t codec, const uint8_t* in, uint32_t n, uint32_t* out_n);
+uint8_t* decodeBuffer(const uint8_t* in, uint32_t n, uint32_t* out_n);
+
+#endif //CS3102_P2_COMPRESS_H
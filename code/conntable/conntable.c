@@ -0,0 +1,156 @@
+//
+// 190010906, October 2026.
+//
+#include <stdlib.h>
+
+#include "conntable.h"
+
+/*
+  Connections of a server, by peer address and port. Open addressing with linear probing: one flat
+  array of slots, so a lookup is a multiply and usually one cache line, and nothing is allocated per
+  connection. Deletion shifts the entries after a removed one back into place rather than leaving
+  tombstones, so lookups don't slow down as connections come and go.
+*/
+
+#define FIBONACCI_64    ((uint64_t) 0x9E3779B97F4A7C15)
+
+
+/**
+ * Home slot of a key: Fibonacci hashing, which takes the well-mixed top bits of the product.
+ * @param table The table.
+ * @param key The key.
+ * @return Index of the slot the key's probe starts at.
+ */
+static uint32_t homeSlot(const ConnTable_t* table, uint64_t key) {
+  return (uint32_t) ((key * FIBONACCI_64) >> 32) & (table->capacity - 1);
+}
+
+/**
+ * Key of a peer, from the address packets arrive from.
+ * @param addr The peer's address and port.
+ * @return The key. Never CONN_KEY_NONE for a real peer.
+ */
+uint64_t connKey(const struct sockaddr_in* addr) {
+  return ((uint64_t) addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+/**
+ * Sets up an empty table.
+ * @param table The table.
+ * @param max Most entries it will hold.
+ * @return 0 if successful, -1 if out of memory.
+ */
+int connTableInit(ConnTable_t* table, uint32_t max) {
+  uint32_t capacity = 16;
+  while (capacity < 2 * max) {
+    capacity *= 2;
+  }
+
+  table->slots = (ConnSlot_t*) calloc(capacity, sizeof(ConnSlot_t));
+  if (table->slots == NULL) {
+    return -1;
+  }
+
+  table->capacity = capacity;
+  table->count = 0;
+  table->max = max;
+  return 0;
+}
+
+/**
+ * Looks up a key.
+ * @param table The table.
+ * @param key The key.
+ * @return The key's value, or NULL if it isn't in the table.
+ */
+void* connTableFind(const ConnTable_t* table, uint64_t key) {
+  uint32_t mask = table->capacity - 1;
+
+  for (uint32_t i = homeSlot(table, key); table->slots[i].key != CONN_KEY_NONE; i = (i + 1) & mask) {
+    if (table->slots[i].key == key) {
+      return table->slots[i].value;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Adds a key that isn't in the table.
+ * @param table The table.
+ * @param key The key.
+ * @param value Its value.
+ * @return 0 if added, -1 if the table is full.
+ */
+int connTableInsert(ConnTable_t* table, uint64_t key, void* value) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t i = homeSlot(table, key);
+
+  if (table->count >= table->max) {
+    return -1;
+  }
+
+  while (table->slots[i].key != CONN_KEY_NONE) {
+    i = (i + 1) & mask;
+  }
+
+  table->slots[i].key = key;
+  table->slots[i].value = value;
+  table->count++;
+  return 0;
+}
+
+/**
+ * Removes a key. Entries further along its probe sequence move back into the gap, unless that would
+ * put them before their home slot.
+ * @param table The table.
+ * @param key The key.
+ * @return The key's value, or NULL if it wasn't in the table.
+ */
+void* connTableRemove(ConnTable_t* table, uint64_t key) {
+  uint32_t mask = table->capacity - 1;
+  uint32_t i = homeSlot(table, key);
+
+  while (table->slots[i].key != key) {
+    if (table->slots[i].key == CONN_KEY_NONE) {
+      return NULL;
+    }
+    i = (i + 1) & mask;
+  }
+
+  void* value = table->slots[i].value;
+  uint32_t gap = i;
+  for (uint32_t j = (i + 1) & mask; table->slots[j].key != CONN_KEY_NONE; j = (j + 1) & mask) {
+    /* An entry can fill the gap if the gap lies between its home slot and where it is now */
+    uint32_t home = homeSlot(table, table->slots[j].key);
+    if (((j - home) & mask) >= ((j - gap) & mask)) {
+      table->slots[gap] = table->slots[j];
+      gap = j;
+    }
+  }
+
+  table->slots[gap].key = CONN_KEY_NONE;
+  table->slots[gap].value = NULL;
+  table->count--;
+  return value;
+}
+
+/**
+ * Value in slot i, for visiting every entry: for (i = 0; i < table->capacity; i++).
+ * @param table The table.
+ * @param i The slot.
+ * @return The value in the slot, or NULL if it's empty.
+ */
+void* connTableAt(const ConnTable_t* table, uint32_t i) {
+  return table->slots[i].key != CONN_KEY_NONE ? table->slots[i].value : NULL;
+}
+
+/**
+ * Frees the slots. The values are the caller's.
+ * @param table The table.
+ */
+void connTableFree(ConnTable_t* table) {
+  free(table->slots);
+  table->slots = NULL;
+  table->capacity = 0;
+  table->count = 0;
+}
@@ -0,0 +1,33 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_CONNTABLE_H
+#define CS3102_P2_CONNTABLE_H
+
+#include <inttypes.h>
+#include <netinet/in.h>
+
+#define CONN_KEY_NONE     ((uint64_t) 0)   // Marks an empty slot. No peer has address 0.0.0.0 and port 0.
+
+typedef struct ConnSlot_s {
+  uint64_t  key;    // connKey() of the peer, or CONN_KEY_NONE.
+  void*     value;
+} ConnSlot_t;
+
+typedef struct ConnTable_s {
+  uint32_t    capacity;   // Slots. A power of two, at least twice the most entries, so probes stay short.
+  uint32_t    count;      // Entries in use.
+  uint32_t    max;        // Most entries allowed.
+  ConnSlot_t* slots;
+} ConnTable_t;
+
+uint64_t connKey(const struct sockaddr_in* addr);
+int connTableInit(ConnTable_t* table, uint32_t max);
+void* connTableFind(const ConnTable_t* table, uint64_t key);
+int connTableInsert(ConnTable_t* table, uint64_t key, void* value);
+void* connTableRemove(ConnTable_t* table, uint64_t key);
+void* connTableAt(const ConnTable_t* table, uint32_t i);
+void connTableFree(ConnTable_t* table);
+
+#endif //CS3102_P2_CONNTABLE_H
@@ -0,0 +1,361 @@
+//
+// 190010906, October 2026.
+//
+// rsync style delta encoding. The receiver sends a rolling weak checksum and a strong hash for each
+// block of its current copy (the basis). The sender slides a window over its data looking for
+// blocks the receiver already has, and sends only literal data and references to those blocks.
+//
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+
+#define DELTA_HEADER         ((uint32_t) 24)  // block size (4), result length (4), result hash (16).
+#define WEAK(a_, b_)         (((uint32_t) (b_) << 16) | ((a_) & 0xffff))
+
+typedef struct DeltaBuf_s {
+  uint8_t* bytes;
+  uint32_t n;
+  uint32_t size;
+} DeltaBuf_t;
+
+
+/* HELPERS START */
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  put32(p, (uint32_t) (v >> 32));
+  put32(p + 4, (uint32_t) v);
+}
+
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * 128 bit strong hash of a block: two independently seeded multiply-rotate lanes.
+ * Not cryptographic, but collisions between unrelated blocks are vanishingly unlikely.
+ */
+static void strongHash(const uint8_t* p, uint32_t n, uint8_t out[16]) {
+  uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ n;
+  uint64_t h2 = 0x632be59bd9b4e019ULL ^ ((uint64_t) n << 32);
+  uint32_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    uint64_t k;
+    memcpy(&k, p + i, sizeof(k));
+    h1 = ((h1 ^ mix64(k)) << 27 | (h1 ^ mix64(k)) >> 37) * 0x87c37b91114253d5ULL;
+    h2 = ((h2 + k) << 31 | (h2 + k) >> 33) * 0x4cf5ad432745937fULL + h1;
+  }
+  for (; i < n; i++) {
+    h1 = (h1 ^ p[i]) * 0x100000001b3ULL;
+    h2 = (h2 + p[i]) * 0xc6a4a7935bd1e995ULL;
+  }
+
+  put64(out, mix64(h1 ^ h2));
+  put64(out + 8, mix64(h2 + h1));
+}
+
+/**
+ * Appends bytes to a growable buffer.
+ * @return 0 if successful, -1 if out of memory.
+ */
+static int append(DeltaBuf_t* buf, const void* bytes, uint32_t n) {
+  if (buf->n + n > buf->size) {
+    uint32_t size = buf->size > 0 ? buf->size : 4096;
+    while (size < buf->n + n) size *= 2;
+
+    uint8_t* bytes_new = (uint8_t*) realloc(buf->bytes, size);
+    if (bytes_new == NULL) {
+      return -1;
+    }
+    buf->bytes = bytes_new;
+    buf->size = size;
+  }
+
+  memcpy(buf->bytes + buf->n, bytes, n);
+  buf->n += n;
+  return 0;
+}
+
+static int appendLiteral(DeltaBuf_t* buf, const uint8_t* src, uint32_t n) {
+  uint8_t op[5];
+  if (n == 0) return 0;
+
+  op[0] = DELTA_OP_LITERAL;
+  put32(op + 1, n);
+  return append(buf, op, sizeof(op)) || append(buf, src, n) ? -1 : 0;
+}
+
+static int appendCopy(DeltaBuf_t* buf, uint32_t first, uint32_t count) {
+  uint8_t op[9];
+  if (count == 0) return 0;
+
+  op[0] = DELTA_OP_COPY;
+  put32(op + 1, first);
+  put32(op + 5, count);
+  return append(buf, op, sizeof(op));
+}
+/* HELPERS END */
+
+
+/* SIGNATURES START */
+/**
+ * Picks a block size for a file of n bytes: roughly sqrt(n), as rsync does.
+ * @param n Size of the file.
+ * @return uint32_t block size.
+ */
+uint32_t deltaBlockSize(uint64_t n) {
+  uint32_t block = DELTA_MIN_BLOCK;
+  while (block < DELTA_MAX_BLOCK && (uint64_t) block * block < n) {
+    block <<= 1;
+  }
+  return block;
+}
+
+/**
+ * Builds the signature stream for a basis: a weak rolling checksum and a strong hash per full block.
+ * @param basis The receiver's current data.
+ * @param n Size of 'basis'.
+ * @param block Block size.
+ * @param out_n Set to the size of the returned buffer.
+ * @return Pointer to newly allocated signature stream, or NULL if out of memory.
+ */
+uint8_t* deltaSignatures(const uint8_t* basis, uint32_t n, uint32_t block, uint32_t* out_n) {
+  uint32_t count = n / block;
+  uint32_t size = DELTA_SIG_HEADER + count * DELTA_SIG_ENTRY;
+
+  uint8_t* sigs = (uint8_t*) malloc(size);
+  if (sigs == NULL) {
+    return NULL;
+  }
+
+  put32(sigs, size);
+  put32(sigs + 4, block);
+  put32(sigs + 8, count);
+
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t* p = basis + (uint64_t) i * block;
+    uint8_t* entry = sigs + DELTA_SIG_HEADER + i * DELTA_SIG_ENTRY;
+    uint32_t a = 0, b = 0;
+
+    for (uint32_t k = 0; k < block; k++) {
+      a += p[k];
+      b += (block - k) * p[k];
+    }
+
+    put32(entry, WEAK(a, b));
+    strongHash(p, block, entry + 4);
+  }
+
+  *out_n = size;
+  return sigs;
+}
+
+/**
+ * Whether a (partially) received signature stream is complete.
+ * @param sigs Bytes received so far.
+ * @param n Number of bytes received so far.
+ * @return true if the whole stream has arrived.
+ */
+bool deltaSignaturesComplete(const uint8_t* sigs, uint32_t n) {
+  return sigs != NULL && n >= DELTA_SIG_HEADER && n >= get32(sigs);
+}
+/* SIGNATURES END */
+
+
+/* DELTA START */
+/**
+ * Encodes 'src' against the receiver's signatures.
+ * @param sigs Signature stream from deltaSignatures().
+ * @param sig_n Size of 'sigs'.
+ * @param src The data to send.
+ * @param n Size of 'src'.
+ * @param out_n Set to the size of the returned buffer.
+ * @return Pointer to newly allocated delta stream, or NULL if the signatures are malformed or out of memory.
+ */
+uint8_t* deltaEncode(const uint8_t* sigs, uint32_t sig_n, const uint8_t* src, uint32_t n, uint32_t* out_n) {
+  DeltaBuf_t out = { NULL, 0, 0 };
+  uint8_t header[DELTA_HEADER];
+  uint8_t strong[16];
+
+  if (!deltaSignaturesComplete(sigs, sig_n)) {
+    return NULL;
+  }
+
+  uint32_t block = get32(sigs + 4);
+  uint32_t count = get32(sigs + 8);
+  if (block == 0 || DELTA_SIG_HEADER + (uint64_t) count * DELTA_SIG_ENTRY > sig_n) {
+    return NULL;
+  }
+  const uint8_t* entries = sigs + DELTA_SIG_HEADER;
+
+  /* Header: block size, result length and hash of the whole result for the receiver to verify */
+  put32(header, block);
+  put32(header + 4, n);
+  strongHash(src, n, header + 8);
+  if (append(&out, header, sizeof(header)) != 0) {
+    return NULL;
+  }
+
+  /* Open addressing table of weak checksum -> block index + 1 */
+  uint32_t slots = 16;
+  while (slots < count * 2) slots <<= 1;
+  uint32_t* table = (uint32_t*) calloc(slots, sizeof(uint32_t));
+  if (table == NULL) {
+    free(out.bytes);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t h = get32(entries + i * DELTA_SIG_ENTRY) * 2654435761u & (slots - 1);
+    while (table[h] != 0) h = (h + 1) & (slots - 1);
+    table[h] = i + 1;
+  }
+
+  /* Slide a window over src, rolling the weak checksum a byte at a time */
+  uint32_t i = 0, literal = 0, a = 0, b = 0;
+  uint32_t run_first = 0, run_count = 0;
+  int error = 0;
+  bool rolled = false;
+
+  while (count > 0 && (uint64_t) i + block <= n && !error) {
+    if (!rolled) {
+      a = b = 0;
+      for (uint32_t k = 0; k < block; k++) {
+        a += src[i + k];
+        b += (block - k) * src[i + k];
+      }
+      rolled = true;
+    }
+
+    uint32_t weak = WEAK(a, b);
+    uint32_t match = 0;
+    bool hashed = false;
+
+    for (uint32_t h = weak * 2654435761u & (slots - 1); table[h] != 0; h = (h + 1) & (slots - 1)) {
+      const uint8_t* entry = entries + (table[h] - 1) * DELTA_SIG_ENTRY;
+      if (get32(entry) != weak) continue;
+
+      if (!hashed) {
+        strongHash(src + i, block, strong);
+        hashed = true;
+      }
+      if (memcmp(entry + 4, strong, 16) == 0) {
+        match = table[h];
+        break;
+      }
+    }
+
+    if (match) {
+      /* Flush literal data, then extend or start a run of block references */
+      if (literal < i) {
+        error |= appendCopy(&out, run_first, run_count);
+        run_count = 0;
+        error |= appendLiteral(&out, src + literal, i - literal);
+      }
+      if (run_count > 0 && run_first + run_count == match - 1) {
+        run_count++;
+      } else {
+        error |= appendCopy(&out, run_first, run_count);
+        run_first = match - 1;
+        run_count = 1;
+      }
+
+      i += block;
+      literal = i;
+      rolled = false;
+      continue;
+    }
+
+    /* Roll the window forward by one byte */
+    if ((uint64_t) i + block < n) {
+      a = a - src[i] + src[i + block];
+      b = b - block * src[i] + a;
+    }
+    i++;
+  }
+
+  error |= appendCopy(&out, run_first, run_count);
+  error |= appendLiteral(&out, src + literal, n - literal);
+
+  uint8_t end = DELTA_OP_END;
+  error |= append(&out, &end, 1);
+  free(table);
+
+  if (error) {
+    free(out.bytes);
+    return NULL;
+  }
+
+  *out_n = out.n;
+  return out.bytes;
+}
+
+/**
+ * Rebuilds the sender's data from the basis and a delta stream, verifying the result's hash.
+ * @param basis The receiver's current data, that signatures were built from.
+ * @param basis_n Size of 'basis'.
+ * @param delta Delta stream from deltaEncode().
+ * @param n Size of 'delta'.
+ * @param out_n Set to the size of the returned buffer.
+ * @return Pointer to newly allocated data, or NULL if the delta is malformed or doesn't verify.
+ */
+uint8_t* deltaApply(const uint8_t* basis, uint32_t basis_n, const uint8_t* delta, uint32_t n, uint32_t* out_n) {
+  uint8_t strong[16];
+
+  if (n < DELTA_HEADER + 1) {
+    return NULL;
+  }
+
+  uint32_t block = get32(delta);
+  uint32_t length = get32(delta + 4);
+  uint8_t* out = (uint8_t*) malloc(length > 0 ? length : 1);
+  if (out == NULL || block == 0) {
+    free(out);
+    return NULL;
+  }
+
+  uint32_t i = DELTA_HEADER, o = 0;
+  while (i < n && delta[i] != DELTA_OP_END) {
+    uint8_t op = delta[i];
+
+    if (op == DELTA_OP_LITERAL && i + 5 <= n) {
+      uint32_t len = get32(delta + i + 1);
+      i += 5;
+      if ((uint64_t) i + len > n || (uint64_t) o + len > length) break;
+      memcpy(out + o, delta + i, len);
+      i += len;
+      o += len;
+    } else if (op == DELTA_OP_COPY && i + 9 <= n) {
+      uint64_t first = (uint64_t) get32(delta + i + 1) * block;
+      uint64_t len = (uint64_t) get32(delta + i + 5) * block;
+      i += 9;
+      if (first + len > basis_n || o + len > length) break;
+      memcpy(out + o, basis + first, len);
+      o += len;
+    } else {
+      break;
+    }
+  }
+
+  strongHash(out, o, strong);
+  if (i >= n || delta[i] != DELTA_OP_END || o != length || memcmp(strong, delta + 8, 16) != 0) {
+    free(out);
+    return NULL;
+  }
+
+  *out_n = length;
+  return out;
+}
+/* DELTA END */
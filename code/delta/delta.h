@@ -0,0 +1,26 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_DELTA_H
+#define CS3102_P2_DELTA_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define DELTA_MIN_BLOCK      ((uint32_t) 512)
+#define DELTA_MAX_BLOCK      ((uint32_t) 65536)
+#define DELTA_SIG_HEADER     ((uint32_t) 12)  // total length (4), block size (4), block count (4).
+#define DELTA_SIG_ENTRY      ((uint32_t) 20)  // weak checksum (4), strong hash (16).
+
+#define DELTA_OP_END         ((uint8_t) 0)
+#define DELTA_OP_LITERAL     ((uint8_t) 1)    // length (4), bytes.
+#define DELTA_OP_COPY        ((uint8_t) 2)    // first block (4), number of blocks (4).
+
+uint32_t deltaBlockSize(uint64_t n);
+uint8_t* deltaSignatures(const uint8_t* basis, uint32_t n, uint32_t block, uint32_t* out_n);
+bool deltaSignaturesComplete(const uint8_t* sigs, uint32_t n);
+uint8_t* deltaEncode(const uint8_t* sigs, uint32_t sig_n, const uint8_t* src, uint32_t n, uint32_t* out_n);
+uint8_t* deltaApply(const uint8_t* basis, uint32_t basis_n, const uint8_t* delta, uint32_t n, uint32_t* out_n);
+
+#endif //CS3102_P2_DELTA_H
@@ -0,0 +1,241 @@
+//
+// 190010906, October 2026.
+//
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+
+#include "multipath.h"
+
+/*
+  Paths to a peer, and which one the next packet goes on. Each packet is sent on the path with the
+  most capacity to spare: the one where a packet is expected to get through soonest, going by the
+  path's smoothed RTT, how many packets are already in flight on it, and how many of its packets are
+  lost. RTT grows with the queue a path builds up, so sockets sharing the paths spread their packets
+  over them in proportion to what each carries, and together get the sum of their bandwidth.
+
+  A path whose packet times out is taken out of use for PATH_RETRY, and the packet is sent again on
+  another one. Then the path is tried with one packet, and it's back in use if that's answered. With
+  stop-and-wait, each packet that times out holds the connection up for an RTO, so a path that has
+  just failed isn't tried again until it has had time to come back, and each time it fails again it
+  waits twice as long. If every path is out of use, the one due back first is used anyway.
+*/
+
+
+/**
+ * Looks up an IPv4 address.
+ * @param name Host name or dotted quad.
+ * @param addr Set to the address.
+ * @return 0 if found, -1 otherwise.
+ */
+static int lookupAddress(const char* name, struct in_addr* addr) {
+  struct addrinfo hints;
+  struct addrinfo* found;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(name, NULL, &hints, &found) != 0) {
+    return -1;
+  }
+
+  *addr = ((struct sockaddr_in*) found->ai_addr)->sin_addr;
+  freeaddrinfo(found);
+  return 0;
+}
+
+/**
+ * Sets up a set with no paths.
+ * @param set The set.
+ * @return 0 if successful, -1 otherwise.
+ */
+int pathSetInit(PathSet_t* set) {
+  memset(set->path, 0, sizeof(set->path));
+  set->count = 0;
+  return pthread_mutex_init(&set->lock, NULL) == 0 ? 0 : -1;
+}
+
+/**
+ * Adds a path.
+ * @param set The set.
+ * @param local Address to send from, or NULL to leave it to routing. Must be one of this host's.
+ * @param remote Address of the peer to send to.
+ * @return Number of the path, or -1 if an address isn't known or the set is full.
+ */
+int pathSetAdd(PathSet_t* set, const char* local, const char* remote) {
+  if (set->count >= PATH_MAX_PATHS) {
+    printf("At most %u paths.\n", PATH_MAX_PATHS);
+    return -1;
+  }
+
+  Path_t* path = &set->path[set->count];
+  memset(path, 0, sizeof(Path_t));
+  path->local.s_addr = htonl(INADDR_ANY);
+  if ((local != NULL && lookupAddress(local, &path->local) != 0) || lookupAddress(remote, &path->remote) != 0) {
+    printf("Unknown address for path: %s\n", local != NULL ? local : remote);
+    return -1;
+  }
+
+  return set->count++;
+}
+
+/**
+ * Cost of one more packet on a path: how long it's expected to take to get through. Lower is better.
+ * A path with no RTT sample yet costs nothing, so it's tried.
+ * @param path The path.
+ * @return The cost.
+ */
+static double pathCost(const Path_t* path) {
+  double delivered = 1.0 - (double) path->loss / PATH_LOSS_ONE;
+  if (delivered < 0.1) {
+    delivered = 0.1;
+  }
+  return (double) path->rto.s_n * (path->in_flight + 1) / delivered;
+}
+
+/**
+ * Picks the path for the next packet, and counts the packet as in flight on it. Call pathAcked(),
+ * pathLost() or pathRelease() once it's answered, times out, or is no longer waited for.
+ *
+ * A path whose time out of use is over, or that nothing has been sent on for PATH_PROBE, goes first,
+ * so its estimates are fresh. Otherwise the cheapest path goes, passing over any still being tried
+ * after a timeout. If every path is out of use, the one due back first goes anyway.
+ * @param set The set. Must have at least one path.
+ * @param now The time (us).
+ * @return Number of the path.
+ */
+uint16_t pathChoose(PathSet_t* set, uint64_t now) {
+  int best = -1;
+  int due = 0;
+
+  pthread_mutex_lock(&set->lock);
+  for (uint16_t i = 0; i < set->count; i++) {
+    Path_t* path = &set->path[i];
+
+    if (path->down_until > now) {
+      if (path->down_until < set->path[due].down_until || set->path[due].down_until <= now) {
+        due = i;
+      }
+      continue;
+    }
+
+    /* Back from being out of use, or not heard from in a while */
+    if (path->down_until != 0 || (path->in_flight == 0 && now - path->used >= PATH_PROBE)) {
+      path->down_until = 0;
+      best = i;
+      break;
+    }
+
+    if (best < 0 || (path->failures == 0) > (set->path[best].failures == 0) ||
+        ((path->failures == 0) == (set->path[best].failures == 0) && pathCost(path) < pathCost(&set->path[best]))) {
+      best = i;
+    }
+  }
+
+  if (best < 0) {
+    best = due;
+  }
+  set->path[best].in_flight++;
+  set->path[best].sent++;
+  set->path[best].used = now;
+  pthread_mutex_unlock(&set->lock);
+  return (uint16_t) best;
+}
+
+/**
+ * A packet sent on a path was answered: the path works.
+ * @param set The set.
+ * @param i Number of the path.
+ * @param rtt RTT sample (us), or 0 if there isn't one.
+ * @param bytes DATA payload the answer acknowledged.
+ */
+void pathAcked(PathSet_t* set, uint16_t i, uint32_t rtt, uint32_t bytes) {
+  pthread_mutex_lock(&set->lock);
+  Path_t* path = &set->path[i];
+  if (rtt != 0) {
+    calculateRTO(&path->rto, rtt);
+  }
+  if (path->failures > 0) {
+    printf("Path %u is back in use.\n", i);
+  }
+  path->loss -= path->loss >> 3;
+  path->failures = 0;
+  path->bytes += bytes;
+  path->in_flight -= path->in_flight > 0;
+  pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * A packet sent on a path timed out. The path is taken out of use for a while.
+ * @param set The set.
+ * @param i Number of the path.
+ * @param now The time (us).
+ */
+void pathLost(PathSet_t* set, uint16_t i, uint64_t now) {
+  pthread_mutex_lock(&set->lock);
+  Path_t* path = &set->path[i];
+  path->loss += (PATH_LOSS_ONE - path->loss) >> 3;
+  path->lost++;
+  path->failures++;
+  path->in_flight -= path->in_flight > 0;
+
+  uint32_t doublings = path->failures - 1 < 4 ? path->failures - 1 : 4;
+  path->down_until = now + (PATH_RETRY << doublings);
+  printf("Path %u is out of use for %us after %u timeouts in a row.\n", i, (uint32_t) ((PATH_RETRY << doublings) / 1000000), path->failures);
+  pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * A packet sent on a path is no longer waited for, neither answered nor timed out.
+ * @param set The set.
+ * @param i Number of the path.
+ */
+void pathRelease(PathSet_t* set, uint16_t i) {
+  pthread_mutex_lock(&set->lock);
+  set->path[i].in_flight -= set->path[i].in_flight > 0;
+  pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * RTO of a path.
+ * @param set The set.
+ * @param i Number of the path.
+ * @return The RTO (us), or 0 if the path has no RTT sample yet.
+ */
+uint32_t pathRto(PathSet_t* set, uint16_t i) {
+  pthread_mutex_lock(&set->lock);
+  uint32_t rto = set->path[i].rto.T_rto;
+  pthread_mutex_unlock(&set->lock);
+  return rto;
+}
+
+/**
+ * Prints each path, with what has been measured of it.
+ * @param out Where to print.
+ * @param set The set.
+ */
+void pathSetPrint(FILE* out, PathSet_t* set) {
+  char local[INET_ADDRSTRLEN];
+  char remote[INET_ADDRSTRLEN];
+
+  pthread_mutex_lock(&set->lock);
+  for (uint16_t i = 0; i < set->count; i++) {
+    const Path_t* path = &set->path[i];
+    inet_ntop(AF_INET, &path->local, local, sizeof(local));
+    inet_ntop(AF_INET, &path->remote, remote, sizeof(remote));
+    fprintf(out, "Path %u: %s > %s, %s, SRTT %.3fms, RTO %.1fms, loss %.1f%%, %" PRIu64 " sent, %" PRIu64
+            " timed out, %" PRIu64 " bytes acknowledged.\n", i, local, remote, path->down_until != 0 ? "out of use" : "in use",
+            US_TO_MS(path->rto.s_n), US_TO_MS(path->rto.T_rto), 100.0 * path->loss / PATH_LOSS_ONE,
+            path->sent, path->lost, path->bytes);
+  }
+  pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Frees what pathSetInit() set up.
+ * @param set The set.
+ */
+void pathSetFree(PathSet_t* set) {
+  pthread_mutex_destroy(&set->lock);
+  set->count = 0;
+}
@@ -0,0 +1,53 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_MULTIPATH_H
+#define CS3102_P2_MULTIPATH_H
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "../rto/rto.h"
+
+#define PATH_MAX_PATHS    ((uint16_t) 8)
+#define PATH_RETRY        ((uint64_t) 5000000)  // How long (us) a path that timed out is out of use. Doubles with each timeout in a row, up to 16 times.
+#define PATH_PROBE        ((uint64_t) 1000000)  // A path nothing has been sent on for this long (us) gets the next segment, to refresh its estimates.
+#define PATH_LOSS_ONE     ((uint32_t) 65536)    // Loss rate of 1, in the fixed point of Path_t.loss.
+
+/* One path: a local address to send from and a remote address to send to */
+typedef struct Path_s {
+  struct in_addr  local;      // Source address, or INADDR_ANY to leave it to routing.
+  struct in_addr  remote;
+  RtoState_t      rto;        // RTT estimate and RTO of the path. Not backed off: what times out is sent again on another path.
+  uint32_t        loss;       // Share of transmissions lost, as a moving average, in 1/PATH_LOSS_ONE.
+  uint32_t        in_flight;  // Packets sent on the path and not yet answered, over every socket using it.
+  uint32_t        failures;   // Timeouts in a row.
+  uint64_t        down_until; // Out of use until then (us, rdtClock()), 0 if in use.
+  uint64_t        used;       // When a packet was last sent on it (us).
+  uint64_t        sent;       // Packets sent on it.
+  uint64_t        lost;       // Of those, ones that timed out.
+  uint64_t        bytes;      // DATA payload acknowledged after being sent on it.
+} Path_t;
+
+/* Paths to one peer. Sockets on several threads may share them, so what each learns helps the others. */
+typedef struct PathSet_s {
+  Path_t          path[PATH_MAX_PATHS];
+  uint16_t        count;
+  pthread_mutex_t lock;
+} PathSet_t;
+
+int pathSetInit(PathSet_t* set);
+int pathSetAdd(PathSet_t* set, const char* local, const char* remote);
+uint16_t pathChoose(PathSet_t* set, uint64_t now);
+void pathAcked(PathSet_t* set, uint16_t i, uint32_t rtt, uint32_t bytes);
+void pathLost(PathSet_t* set, uint16_t i, uint64_t now);
+void pathRelease(PathSet_t* set, uint16_t i);
+uint32_t pathRto(PathSet_t* set, uint16_t i);
+void pathSetPrint(FILE* out, PathSet_t* set);
+void pathSetFree(PathSet_t* set);
+
+#endif //CS3102_P2_MULTIPATH_H
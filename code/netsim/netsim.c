@@ -0,0 +1,452 @@
+//
+// 190010906, October 2026.
+//
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "netsim.h"
+#include "../rto/rto.h"
+#include "../sigalrm/sigalrm.h"
+
+/*
+  Deterministic network emulator. Both ends of a connection run in one process, taking turns on the
+  rdt globals through rdtSwapState(). Datagrams, timers and the RTT clock are redirected through the
+  UdpSocket, sigalrm and rto hooks, so nothing touches a socket, a signal or the wall clock: time is
+  virtual and only moves when netsimStep() jumps to the next event. A run depends only on its seed.
+*/
+
+
+/* STRUCTS START */
+typedef struct NetsimPacket_s {
+  uint64_t                at;       // Arrival time (virtual us).
+  uint64_t                order;    // Tie-break between packets arriving at the same time.
+  int                     to;       // Destination endpoint.
+  uint16_t                n;
+  struct NetsimPacket_s*  next;     // Inbox link, once delivered.
+  uint8_t                 bytes[sizeof(RdtPacket_t)];
+} NetsimPacket_t;
+
+typedef struct NetsimEndpoint_s {
+  RdtState_t*         state;
+  struct sockaddr_in  addr;
+  uint64_t            timer;        // RTO deadline (virtual us), or 0 if not armed.
+  NetsimPacket_t*     inbox;        // Delivered, not yet read by recvUdp().
+  NetsimPacket_t*     inbox_tail;
+} NetsimEndpoint_t;
+
+typedef struct NetsimPath_s {
+  NetsimLink_t        link;
+  NetsimCounters_t    counters;
+  uint64_t            busy_until;   // When the bottleneck finishes sending what's already queued.
+  uint64_t*           departures;   // Ring of departure times of queued packets, for 'queue'.
+  uint32_t            head;
+  uint32_t            count;
+} NetsimPath_t;
+/* STRUCTS END */
+
+
+/* GLOBAL VARIABLES START */
+uint64_t          G_netsim_now;       // Virtual clock (us).
+uint64_t          G_netsim_rng;       // xorshift64* state.
+uint64_t          G_netsim_order;
+int               G_netsim_active = -1;
+NetsimEndpoint_t  G_netsim_endpoints[NETSIM_ENDPOINTS];
+NetsimPath_t      G_netsim_paths[NETSIM_ENDPOINTS];
+NetsimPacket_t**  G_netsim_heap;      // In-flight packets, min-heap on (at, order).
+uint32_t          G_netsim_heap_size;
+uint32_t          G_netsim_heap_max;
+/* GLOBAL VARIABLES END */
+
+
+/* RANDOM START */
+/**
+ * xorshift64* - small, fast and, unlike random(), private to the emulator.
+ * @return uint64_t Next pseudo-random number.
+ */
+uint64_t netsimRandom() {
+  G_netsim_rng ^= G_netsim_rng >> 12;
+  G_netsim_rng ^= G_netsim_rng << 25;
+  G_netsim_rng ^= G_netsim_rng >> 27;
+  return G_netsim_rng * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @return double Uniform in [0, 1).
+ */
+double netsimUniform() {
+  return (double) (netsimRandom() >> 11) / (double) (1ULL << 53);
+}
+
+/**
+ * G_isn_hook: initial sequence numbers from the seed, so runs repeat.
+ * @return uint32_t Next initial sequence number.
+ */
+uint32_t netsimSequence() {
+  return (uint32_t) random();
+}
+/* RANDOM END */
+
+
+/* EVENT QUEUE START */
+/**
+ * @return bool True if packet a arrives before packet b.
+ */
+bool netsimBefore(const NetsimPacket_t* a, const NetsimPacket_t* b) {
+  return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+/**
+ * Adds a packet to the in-flight heap.
+ * @param packet Packet with 'at' set.
+ * @return int 0 on success, -1 if out of memory.
+ */
+int netsimPush(NetsimPacket_t* packet) {
+  if (G_netsim_heap_size == G_netsim_heap_max) {
+    uint32_t max = G_netsim_heap_max ? G_netsim_heap_max * 2 : 64;
+    NetsimPacket_t** heap = realloc(G_netsim_heap, max * sizeof(NetsimPacket_t*));
+    if (heap == NULL) {
+      return -1;
+    }
+    G_netsim_heap = heap;
+    G_netsim_heap_max = max;
+  }
+
+  packet->order = G_netsim_order++;
+  uint32_t i = G_netsim_heap_size++;
+  while (i > 0 && netsimBefore(packet, G_netsim_heap[(i - 1) / 2])) {
+    G_netsim_heap[i] = G_netsim_heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  G_netsim_heap[i] = packet;
+  return 0;
+}
+
+/**
+ * Removes the packet that arrives first from the in-flight heap.
+ * @return NetsimPacket_t* The packet, or NULL if nothing is in flight.
+ */
+NetsimPacket_t* netsimPop() {
+  if (G_netsim_heap_size == 0) {
+    return NULL;
+  }
+
+  NetsimPacket_t* top = G_netsim_heap[0];
+  NetsimPacket_t* last = G_netsim_heap[--G_netsim_heap_size];
+  uint32_t i = 0;
+  for (;;) {
+    uint32_t child = 2 * i + 1;
+    if (child >= G_netsim_heap_size) break;
+    if (child + 1 < G_netsim_heap_size && netsimBefore(G_netsim_heap[child + 1], G_netsim_heap[child])) child++;
+    if (!netsimBefore(G_netsim_heap[child], last)) break;
+    G_netsim_heap[i] = G_netsim_heap[child];
+    i = child;
+  }
+  G_netsim_heap[i] = last;
+  return top;
+}
+/* EVENT QUEUE END */
+
+
+/* LINK START */
+/**
+ * Passes a datagram through the bottleneck queue of a path.
+ * @param path The path to send on.
+ * @param n Datagram size in bytes.
+ * @return uint64_t Time the datagram leaves the bottleneck, or 0 if the queue dropped it.
+ */
+uint64_t netsimEnqueue(NetsimPath_t* path, uint16_t n) {
+  if (path->link.rate == 0) {
+    return G_netsim_now;
+  }
+
+  /* Forget packets that have left the queue */
+  while (path->count > 0 && path->departures[path->head] <= G_netsim_now) {
+    path->head = (path->head + 1) % path->link.queue;
+    path->count--;
+  }
+
+  if (path->link.queue != 0 && path->count == path->link.queue) {
+    path->counters.queue_drops++;
+    return 0;
+  }
+
+  uint64_t start = path->busy_until > G_netsim_now ? path->busy_until : G_netsim_now;
+  path->busy_until = start + ((uint64_t) n * 1000000 + path->link.rate - 1) / path->link.rate;
+
+  if (path->link.queue != 0) {
+    path->departures[(path->head + path->count) % path->link.queue] = path->busy_until;
+    path->count++;
+  }
+
+  return path->busy_until;
+}
+
+/**
+ * Puts a copy of a datagram in flight.
+ * @return int 0 on success, -1 if out of memory.
+ */
+int netsimLaunch(int to, const UdpBuffer_t* buffer, uint64_t at) {
+  NetsimPacket_t* packet = malloc(sizeof(NetsimPacket_t));
+  if (packet == NULL) {
+    return -1;
+  }
+
+  packet->at = at;
+  packet->to = to;
+  packet->n = buffer->n < sizeof(packet->bytes) ? buffer->n : sizeof(packet->bytes);
+  packet->next = NULL;
+  memcpy(packet->bytes, buffer->bytes, packet->n);
+
+  if (netsimPush(packet) < 0) {
+    free(packet);
+    return -1;
+  }
+  return 0;
+}
+/* LINK END */
+
+
+/* HOOKS START */
+/**
+ * sendUdp() replacement: sends from the active endpoint to the other one, through the path's
+ * loss, queue, delay, jitter, reordering and duplication.
+ */
+int netsimSend(const UdpSocket_t* local, const UdpSocket_t* remote, const UdpBuffer_t* buffer) {
+  int to = 1 - G_netsim_active;
+  NetsimPath_t* path = &G_netsim_paths[G_netsim_active];
+  NetsimLink_t* link = &path->link;
+
+  path->counters.sent++;
+
+  if (netsimUniform() < link->loss) {
+    path->counters.lost++;
+    return buffer->n;
+  }
+
+  uint64_t departure = netsimEnqueue(path, buffer->n);
+  if (departure == 0) {
+    return buffer->n;
+  }
+
+  uint64_t at = departure + link->delay;
+  if (link->jitter > 0) {
+    at += netsimRandom() % ((uint64_t) link->jitter + 1);
+  }
+  if (link->reorder > 0 && netsimUniform() < link->reorder) {
+    at += link->delay > 0 ? link->delay : 1000;
+    path->counters.reordered++;
+  }
+
+  if (netsimLaunch(to, buffer, at) < 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  if (link->duplicate > 0 && netsimUniform() < link->duplicate) {
+    path->counters.duplicated++;
+    netsimLaunch(to, buffer, at + 1);
+  }
+
+  return buffer->n;
+}
+
+/**
+ * recvUdp() replacement: reads the next delivered datagram of the active endpoint.
+ * @return int Bytes received, or -1 with errno EAGAIN if there's nothing, like a non-blocking socket.
+ */
+int netsimRecv(const UdpSocket_t* local, const UdpSocket_t* remote, UdpBuffer_t* buffer) {
+  NetsimEndpoint_t* endpoint = &G_netsim_endpoints[G_netsim_active];
+  NetsimPacket_t* packet = endpoint->inbox;
+
+  if (packet == NULL) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  endpoint->inbox = packet->next;
+  if (endpoint->inbox == NULL) endpoint->inbox_tail = NULL;
+
+  uint16_t n = packet->n < buffer->n ? packet->n : buffer->n;
+  memcpy(buffer->bytes, packet->bytes, n);
+  ((UdpSocket_t*) remote)->addr = G_netsim_endpoints[1 - G_netsim_active].addr;
+  free(packet);
+  return n;
+}
+
+/**
+ * setITIMER() replacement: arms (or with 0, 0 cancels) the active endpoint's RTO on the virtual clock.
+ */
+int netsimTimer(unsigned int sec, unsigned int usec) {
+  NetsimEndpoint_t* endpoint = &G_netsim_endpoints[G_netsim_active];
+  endpoint->timer = (sec == 0 && usec == 0) ? 0 : G_netsim_now + (uint64_t) sec * 1000000 + usec;
+  return 0;
+}
+
+/**
+ * CLOCK_MONOTONIC replacement for the RTT clock.
+ */
+int netsimClock(struct timespec* now) {
+  now->tv_sec = G_netsim_now / 1000000;
+  now->tv_nsec = (G_netsim_now % 1000000) * 1000;
+  return 0;
+}
+
+const UdpTransport_t G_netsim_transport = { netsimSend, netsimRecv };
+/* HOOKS END */
+
+
+/* API START */
+/**
+ * Starts a new emulated network and redirects the rdt library onto it.
+ * @param seed Seed for every random choice. The same seed replays the same run.
+ * @param forward Link from endpoint 0 to endpoint 1.
+ * @param reverse Link from endpoint 1 to endpoint 0.
+ */
+void netsimInit(uint64_t seed, const NetsimLink_t* forward, const NetsimLink_t* reverse) {
+  memset(G_netsim_endpoints, 0, sizeof(G_netsim_endpoints));
+  memset(G_netsim_paths, 0, sizeof(G_netsim_paths));
+
+  G_netsim_paths[NETSIM_FORWARD].link = *forward;
+  G_netsim_paths[NETSIM_REVERSE].link = *reverse;
+  for (int i = 0; i < NETSIM_ENDPOINTS; i++) {
+    NetsimPath_t* path = &G_netsim_paths[i];
+    if (path->link.rate != 0 && path->link.queue != 0) {
+      path->departures = calloc(path->link.queue, sizeof(uint64_t));
+      if (path->departures == NULL) path->link.queue = 0;
+    }
+  }
+
+  G_netsim_now = 1000000; // Keep timestamps away from 0, which means 'none' on the wire.
+  G_netsim_rng = seed ^ 0x9E3779B97F4A7C15ULL;
+  if (G_netsim_rng == 0) G_netsim_rng = 1;
+  G_netsim_order = 0;
+  G_netsim_active = -1;
+  G_netsim_heap_size = 0;
+
+  srandom((unsigned int) seed); // Initial sequence numbers.
+  G_isn_hook = netsimSequence;
+
+  G_udp_transport = &G_netsim_transport;
+  G_timer_hook = netsimTimer;
+  G_clock_hook = netsimClock;
+}
+
+/**
+ * Gives an endpoint its connection state and address.
+ * @param endpoint 0 or 1.
+ * @param state From rdtCreateState(). Owned by the caller, and only valid while not active.
+ * @param address Dotted IPv4 address the peer sees it as.
+ */
+void netsimAttach(int endpoint, RdtState_t* state, const char* address) {
+  NetsimEndpoint_t* e = &G_netsim_endpoints[endpoint];
+  e->state = state;
+  e->addr.sin_family = AF_INET;
+  e->addr.sin_port = htons(1); // Any non-zero port: setRemoteSocket() needs one.
+  inet_pton(AF_INET, address, &e->addr.sin_addr);
+}
+
+/**
+ * Switches the rdt globals to an endpoint's connection, saving the current one's.
+ * @param endpoint 0 or 1, or -1 to give the globals back to the caller.
+ */
+void netsimActivate(int endpoint) {
+  if (endpoint == G_netsim_active) {
+    return;
+  }
+  if (G_netsim_active >= 0) {
+    rdtSwapState(G_netsim_endpoints[G_netsim_active].state);
+  }
+  if (endpoint >= 0) {
+    rdtSwapState(G_netsim_endpoints[endpoint].state);
+  }
+  G_netsim_active = endpoint;
+}
+
+/**
+ * Advances the virtual clock to the next event - a datagram arriving or an RTO firing - and runs it
+ * on the endpoint it belongs to. The endpoint is left active.
+ * @return int 0 if an event ran, -1 if there are none left.
+ */
+int netsimStep() {
+  int timer = -1;
+  for (int i = 0; i < NETSIM_ENDPOINTS; i++) {
+    uint64_t t = G_netsim_endpoints[i].timer;
+    if (t != 0 && (timer < 0 || t < G_netsim_endpoints[timer].timer)) timer = i;
+  }
+
+  /* Arrivals win ties with timers, as an ACK usually does against a timeout in practice */
+  if (G_netsim_heap_size > 0 && (timer < 0 || G_netsim_heap[0]->at <= G_netsim_endpoints[timer].timer)) {
+    NetsimPacket_t* packet = netsimPop();
+    NetsimEndpoint_t* endpoint = &G_netsim_endpoints[packet->to];
+
+    G_netsim_now = packet->at;
+    G_netsim_paths[1 - packet->to].counters.delivered++;
+
+    if (endpoint->inbox_tail) endpoint->inbox_tail->next = packet;
+    else endpoint->inbox = packet;
+    endpoint->inbox_tail = packet;
+
+    netsimActivate(packet->to);
+    rdtPoll();
+    return 0;
+  }
+
+  if (timer >= 0) {
+    G_netsim_now = G_netsim_endpoints[timer].timer;
+    G_netsim_endpoints[timer].timer = 0;
+
+    netsimActivate(timer);
+    fsm(RDT_EVENT_RTO);
+    return 0;
+  }
+
+  return -1;
+}
+
+/**
+ * @return uint64_t The virtual clock (us).
+ */
+uint64_t netsimNow() {
+  return G_netsim_now;
+}
+
+/**
+ * @param link NETSIM_FORWARD or NETSIM_REVERSE.
+ * @param counters Filled with what the link did to the packets sent on it.
+ */
+void netsimGetCounters(int link, NetsimCounters_t* counters) {
+  *counters = G_netsim_paths[link].counters;
+}
+
+/**
+ * Gives the globals back to the caller, drops everything still in flight and puts the rdt library
+ * back on real sockets, timers and clock.
+ */
+void netsimShutdown() {
+  netsimActivate(-1);
+
+  NetsimPacket_t* packet;
+  while ((packet = netsimPop()) != NULL) {
+    free(packet);
+  }
+  for (int i = 0; i < NETSIM_ENDPOINTS; i++) {
+    while ((packet = G_netsim_endpoints[i].inbox) != NULL) {
+      G_netsim_endpoints[i].inbox = packet->next;
+      free(packet);
+    }
+    free(G_netsim_paths[i].departures);
+    G_netsim_paths[i].departures = NULL;
+  }
+  free(G_netsim_heap);
+  G_netsim_heap = NULL;
+  G_netsim_heap_max = 0;
+
+  G_udp_transport = NULL;
+  G_timer_hook = NULL;
+  G_clock_hook = NULL;
+  G_isn_hook = NULL;
+}
+/* API END */
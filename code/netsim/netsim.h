@@ -0,0 +1,43 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_NETSIM_H
+#define CS3102_P2_NETSIM_H
+
+#include <inttypes.h>
+
+#include "../rdt.h"
+
+#define NETSIM_ENDPOINTS     2
+#define NETSIM_FORWARD       0   // Link from endpoint 0 to endpoint 1.
+#define NETSIM_REVERSE       1   // Link from endpoint 1 to endpoint 0.
+
+typedef struct NetsimLink_s {
+  uint32_t delay;       // One-way propagation delay (us).
+  uint32_t jitter;      // Extra delay, uniform in [0, jitter] (us).
+  double   loss;        // Probability a packet is dropped.
+  double   reorder;     // Probability a packet is held back by another 'delay', so later ones overtake it.
+  double   duplicate;   // Probability a packet is delivered twice.
+  uint32_t rate;        // Bottleneck rate (bytes/s). 0 for unlimited.
+  uint32_t queue;       // Bottleneck queue size (packets), drop-tail. 0 for unlimited.
+} NetsimLink_t;
+
+typedef struct NetsimCounters_s {
+  uint32_t sent;        // Packets offered to the link.
+  uint32_t delivered;   // Packets delivered, including duplicates.
+  uint32_t lost;        // Dropped by random loss.
+  uint32_t queue_drops; // Dropped because the bottleneck queue was full.
+  uint32_t duplicated;
+  uint32_t reordered;
+} NetsimCounters_t;
+
+void netsimInit(uint64_t seed, const NetsimLink_t* forward, const NetsimLink_t* reverse);
+void netsimAttach(int endpoint, RdtState_t* state, const char* address);
+void netsimActivate(int endpoint);
+int netsimStep();
+uint64_t netsimNow();
+void netsimGetCounters(int link, NetsimCounters_t* counters);
+void netsimShutdown();
+
+#endif //CS3102_P2_NETSIM_H
@@ -0,0 +1,222 @@
+//
+// 190010906, October 2026.
+//
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pcap.h"
+#include "../checksum/checksum.h"
+
+/*
+  Captures RDT datagrams to a pcap file, for Wireshark (see pcap/rdt.lua) or tcpdump -r, without
+  needing capture privileges.
+
+  The hot path only timestamps the datagram and copies it, behind made-up IPv4 and UDP headers, into
+  a slot of a fixed ring. A slot is claimed with a compare-and-swap on the head, and published by
+  writing its id last. Nothing blocks, so it's safe in the SIGIO handler, and if the ring is full the
+  datagram is counted as dropped instead. A writer thread drains the ring into a buffered FILE and
+  does all the I/O.
+*/
+
+
+/* STRUCTS START */
+typedef struct PcapFileHeader_s {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t  thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} PcapFileHeader_t;
+
+typedef struct PcapRecordHeader_s {
+  uint32_t ts_sec;
+  uint32_t ts_nsec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} PcapRecordHeader_t;
+
+typedef struct PcapIpUdp_s {
+  uint8_t  version_ihl;
+  uint8_t  tos;
+  uint16_t total_length;
+  uint16_t id;
+  uint16_t fragment;
+  uint8_t  ttl;
+  uint8_t  protocol;
+  uint16_t checksum;
+  uint32_t src;
+  uint32_t dst;
+  uint16_t sport;
+  uint16_t dport;
+  uint16_t length;
+  uint16_t udp_checksum;
+} PcapIpUdp_t;
+
+typedef struct PcapSlot_s {
+  uint64_t id;      // Position + 1 once the record is complete.
+  uint32_t n;       // Bytes of the record.
+  uint8_t  bytes[PCAP_SLOT_SIZE];
+} PcapSlot_t;
+/* STRUCTS END */
+
+
+/* GLOBAL VARIABLES START */
+bool        G_pcap = false;         // Capturing.
+PcapSlot_t  G_pcap_slots[PCAP_SLOTS];
+uint64_t    G_pcap_head = 0;        // Next position to claim.
+uint64_t    G_pcap_tail = 0;        // Next position the writer reads.
+uint64_t    G_pcap_drops = 0;
+uint16_t    G_pcap_ip_id = 0;
+bool        G_pcap_stop = false;
+FILE*       G_pcap_file = NULL;
+pthread_t   G_pcap_writer;
+/* GLOBAL VARIABLES END */
+
+
+/**
+ * Writer thread: moves completed records from the ring to the file, in order.
+ */
+void* pcapWriter(void* arg) {
+  struct timespec idle = { 0, PCAP_IDLE_US * 1000 };
+
+  for (;;) {
+    uint64_t tail = __atomic_load_n(&G_pcap_tail, __ATOMIC_RELAXED);
+    PcapSlot_t* slot = &G_pcap_slots[tail & (PCAP_SLOTS - 1)];
+
+    if (__atomic_load_n(&slot->id, __ATOMIC_ACQUIRE) == tail + 1) {
+      fwrite(slot->bytes, 1, slot->n, G_pcap_file);
+      __atomic_store_n(&G_pcap_tail, tail + 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    /* Stopped, and nothing claimed is still being written */
+    if (__atomic_load_n(&G_pcap_stop, __ATOMIC_ACQUIRE) && __atomic_load_n(&G_pcap_head, __ATOMIC_ACQUIRE) == tail) {
+      break;
+    }
+
+    fflush(G_pcap_file);
+    nanosleep(&idle, NULL);
+  }
+
+  return NULL;
+}
+
+/**
+ * Starts capturing to a new pcap file.
+ * @param path File to write. Truncated if it exists.
+ * @return int 0 on success, -1 on error.
+ */
+int pcapOpen(const char* path) {
+  PcapFileHeader_t header = { PCAP_MAGIC_NS, 2, 4, 0, 0, PCAP_SNAPLEN, PCAP_LINKTYPE_RAW };
+
+  G_pcap_file = fopen(path, "wb");
+  if (G_pcap_file == NULL) {
+    perror("Couldn't create capture file");
+    return -1;
+  }
+  if (fwrite(&header, sizeof(header), 1, G_pcap_file) != 1) {
+    perror("Couldn't write capture file");
+    fclose(G_pcap_file);
+    return -1;
+  }
+
+  G_pcap_head = G_pcap_tail = G_pcap_drops = 0;
+  G_pcap_stop = false;
+  memset(G_pcap_slots, 0, sizeof(G_pcap_slots));
+
+  /* The writer must never take SIGIO or SIGALRM: the handlers run the fsm, on the main thread only */
+  sigset_t all, mask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &mask);
+  int r = pthread_create(&G_pcap_writer, NULL, pcapWriter, NULL);
+  pthread_sigmask(SIG_SETMASK, &mask, NULL);
+  if (r != 0) {
+    perror("Couldn't start capture writer");
+    fclose(G_pcap_file);
+    return -1;
+  }
+
+  __atomic_store_n(&G_pcap, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Captures one datagram. Called on the hot path: it never blocks or does I/O.
+ * @param src Where it came from.
+ * @param dst Where it went.
+ * @param data The UDP payload (RDT header and data).
+ * @param n Size of 'data'.
+ */
+void pcapPacket(const struct sockaddr_in* src, const struct sockaddr_in* dst, const void* data, uint16_t n) {
+  struct timespec now;
+  uint64_t head;
+
+  if (!__atomic_load_n(&G_pcap, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  /* Claim a slot, unless the writer has fallen a whole ring behind */
+  head = __atomic_load_n(&G_pcap_head, __ATOMIC_RELAXED);
+  do {
+    if (head - __atomic_load_n(&G_pcap_tail, __ATOMIC_ACQUIRE) >= PCAP_SLOTS) {
+      __atomic_fetch_add(&G_pcap_drops, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&G_pcap_head, &head, head + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  PcapSlot_t* slot = &G_pcap_slots[head & (PCAP_SLOTS - 1)];
+  PcapRecordHeader_t* record = (PcapRecordHeader_t*) slot->bytes;
+  PcapIpUdp_t* ip = (PcapIpUdp_t*) (slot->bytes + sizeof(PcapRecordHeader_t));
+  uint32_t room = PCAP_SLOT_SIZE - sizeof(PcapRecordHeader_t) - sizeof(PcapIpUdp_t);
+  uint16_t captured = n < room ? n : (uint16_t) room;
+
+  record->ts_sec = (uint32_t) now.tv_sec;
+  record->ts_nsec = (uint32_t) now.tv_nsec;
+  record->incl_len = sizeof(PcapIpUdp_t) + captured;
+  record->orig_len = sizeof(PcapIpUdp_t) + n;
+
+  ip->version_ihl = 0x45;
+  ip->tos = 0;
+  ip->total_length = htons(sizeof(PcapIpUdp_t) + n);
+  ip->id = htons(__atomic_fetch_add(&G_pcap_ip_id, 1, __ATOMIC_RELAXED));
+  ip->fragment = 0;
+  ip->ttl = 64;
+  ip->protocol = IPPROTO_UDP;
+  ip->checksum = 0;
+  ip->src = src->sin_addr.s_addr;
+  ip->dst = dst->sin_addr.s_addr;
+  ip->checksum = ipv4_header_checksum(ip, 20);
+  ip->sport = src->sin_port;
+  ip->dport = dst->sin_port;
+  ip->length = htons(8 + n);
+  ip->udp_checksum = 0; // Optional in IPv4.
+  memcpy(slot->bytes + sizeof(PcapRecordHeader_t) + sizeof(PcapIpUdp_t), data, captured);
+
+  slot->n = sizeof(PcapRecordHeader_t) + record->incl_len;
+  __atomic_store_n(&slot->id, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Stops capturing, and waits for the writer to write out everything captured.
+ * @return uint64_t Datagrams dropped because the ring was full.
+ */
+uint64_t pcapClose() {
+  if (!G_pcap) {
+    return 0;
+  }
+
+  __atomic_store_n(&G_pcap, false, __ATOMIC_RELEASE);
+  __atomic_store_n(&G_pcap_stop, true, __ATOMIC_RELEASE);
+  pthread_join(G_pcap_writer, NULL);
+  fclose(G_pcap_file);
+  G_pcap_file = NULL;
+  return G_pcap_drops;
+}
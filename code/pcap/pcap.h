@@ -0,0 +1,25 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_PCAP_H
+#define CS3102_P2_PCAP_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#define PCAP_MAGIC_NS       ((uint32_t) 0xa1b23c4d)  // pcap with nanosecond timestamps.
+#define PCAP_LINKTYPE_RAW   ((uint32_t) 101)         // Packets start with their IPv4 header.
+#define PCAP_SNAPLEN        ((uint32_t) 65535)
+#define PCAP_SLOTS          ((uint32_t) 1024)        // Datagrams buffered for the writer. Power of two.
+#define PCAP_SLOT_SIZE      ((uint32_t) 1408)        // Record header + IPv4 + UDP + largest RDT packet.
+#define PCAP_IDLE_US        ((long) 2000)            // Writer sleeps this long when there's nothing to do.
+
+extern bool G_pcap;
+
+int pcapOpen(const char* path);
+void pcapPacket(const struct sockaddr_in* src, const struct sockaddr_in* dst, const void* data, uint16_t n);
+uint64_t pcapClose();
+
+#endif //CS3102_P2_PCAP_H
@@ -0,0 +1,182 @@
+--
+-- 190010906, October 2026.
+--
+-- Wireshark dissector for RDT over UDP. Works on captures written with the 'capture' option of
+-- RdtClient and RdtServer, and on live traffic.
+--
+--   wireshark -X lua_script:pcap/rdt.lua capture.pcap
+--   tshark -X lua_script:pcap/rdt.lua -r capture.pcap
+--
+-- RDT has no fixed port, so packets are picked out heuristically. If that misses some, use
+-- Decode As... > UDP port > RDT.
+--
+-- RdtHeader_t, all fields in network byte order:
+--
+--   offset  size  field
+--        0     4  sequence   Sequence number. Bytes sent so far, from the initial sequence number.
+--        4     2  type       SYN, SYN_ACK, DATA, ACK, FIN, FIN_ACK, RST or FORWARD.
+--        6     2  checksum   Internet checksum over header and payload, computed with this field 0.
+--        8     2  size       Bytes of payload after the header.
+--       10     2  window     Bytes the sender of the packet can receive, >> the shift in its WINDOW option.
+--       12     4  timestamp  Sender's clock when sent (us, CLOCK_MONOTONIC).
+--       16     4  echo       Timestamp of the last intact packet received from the peer, or 0.
+--       20     4  ack        Full duplex, DATA: next sequence number expected of the peer's data.
+--       24  size  payload    Data, or TLV options (kind, length, value) in a SYN or SYN_ACK. In a FORWARD,
+--                            the sequence number the abandoned message started at.
+--
+
+local rdt = Proto("rdt", "Reliable Data Transfer")
+
+local HEADER_SIZE = 24
+local MAX_SIZE = 1300
+
+local types = {
+  [0] = "SYN",
+  [1] = "SYN_ACK",
+  [2] = "DATA",
+  [3] = "ACK",
+  [4] = "FIN",
+  [5] = "FIN_ACK",
+  [6] = "RST",
+  [7] = "FORWARD",
+}
+
+local options = {
+  [0] = "END",
+  [1] = "CODECS",
+  [2] = "OFFSET",
+  [3] = "TRANSFER_ID",
+  [4] = "DELTA",
+  [5] = "FRAMED",
+  [6] = "EARLY_DATA",
+  [7] = "LENGTH",
+  [8] = "WINDOW",
+  [9] = "DUPLEX",
+  [10] = "PARTIAL",
+  [11] = "STREAMS",
+  [12] = "MULTIPATH",
+}
+
+local f = rdt.fields
+f.sequence     = ProtoField.uint32("rdt.sequence", "Sequence", base.DEC)
+f.type         = ProtoField.uint16("rdt.type", "Type", base.DEC, types)
+f.checksum     = ProtoField.uint16("rdt.checksum", "Checksum", base.HEX)
+f.size         = ProtoField.uint16("rdt.size", "Size", base.DEC)
+f.window       = ProtoField.uint16("rdt.window", "Window (scaled)", base.DEC)
+f.timestamp    = ProtoField.uint32("rdt.timestamp", "Timestamp (us)", base.DEC)
+f.echo         = ProtoField.uint32("rdt.echo", "Echo (us)", base.DEC)
+f.ack          = ProtoField.uint32("rdt.ack", "Ack", base.DEC)
+f.payload      = ProtoField.bytes("rdt.payload", "Payload")
+f.forward      = ProtoField.uint32("rdt.forward", "Abandoned message start", base.DEC)
+f.option       = ProtoField.none("rdt.option", "Option")
+f.option_kind  = ProtoField.uint8("rdt.option.kind", "Kind", base.DEC, options)
+f.option_len   = ProtoField.uint8("rdt.option.length", "Length", base.DEC)
+f.codecs       = ProtoField.uint8("rdt.option.codecs", "Codecs", base.HEX)
+f.offset       = ProtoField.uint64("rdt.option.offset", "Offset", base.DEC)
+f.transfer_id  = ProtoField.uint64("rdt.option.transfer_id", "Transfer ID", base.HEX)
+f.delta_block  = ProtoField.uint32("rdt.option.delta_block", "Delta block size", base.DEC)
+f.early_data   = ProtoField.uint16("rdt.option.early_data", "Early data", base.DEC)
+f.length       = ProtoField.uint64("rdt.option.length_bytes", "Transfer length", base.DEC)
+f.window_shift = ProtoField.uint8("rdt.option.window_shift", "Window shift", base.DEC)
+f.option_value = ProtoField.bytes("rdt.option.value", "Value")
+
+local option_fields = {
+  [1] = { f.codecs, 1 },
+  [2] = { f.offset, 8 },
+  [3] = { f.transfer_id, 8 },
+  [4] = { f.delta_block, 4 },
+  [6] = { f.early_data, 2 },
+  [7] = { f.length, 8 },
+  [8] = { f.window_shift, 1 },
+}
+
+-- SYN and SYN_ACK payloads: TLV options up to END, then any early data
+local function dissect_options(buffer, tree)
+  local n = buffer:len()
+  local i = 0
+
+  while i + 2 <= n do
+    local kind = buffer(i, 1):uint()
+    if kind == 0 then
+      tree:add(f.option_kind, buffer(i, 1))
+      return i + 1
+    end
+
+    local len = buffer(i + 1, 1):uint()
+    if i + 2 + len > n then
+      break
+    end
+
+    local option = tree:add(f.option, buffer(i, 2 + len)):set_text("Option: " .. (options[kind] or kind))
+    option:add(f.option_kind, buffer(i, 1))
+    option:add(f.option_len, buffer(i + 1, 1))
+    if len > 0 then
+      local field = option_fields[kind]
+      if field ~= nil and field[2] == len then
+        option:add(field[1], buffer(i + 2, len))
+      else
+        option:add(f.option_value, buffer(i + 2, len))
+      end
+    end
+
+    i = i + 2 + len
+  end
+
+  return i
+end
+
+function rdt.dissector(buffer, pinfo, tree)
+  if buffer:len() < HEADER_SIZE then
+    return 0
+  end
+
+  local kind = buffer(4, 2):uint()
+  local size = buffer(8, 2):uint()
+
+  pinfo.cols.protocol = "RDT"
+  pinfo.cols.info = string.format("%s seq=%u size=%u", types[kind] or tostring(kind), buffer(0, 4):uint(), size)
+
+  local header = tree:add(rdt, buffer(0, HEADER_SIZE + math.min(size, buffer:len() - HEADER_SIZE)))
+  header:add(f.sequence, buffer(0, 4))
+  header:add(f.type, buffer(4, 2))
+  header:add(f.checksum, buffer(6, 2))
+  header:add(f.size, buffer(8, 2))
+  header:add(f.window, buffer(10, 2))
+  header:add(f.timestamp, buffer(12, 4))
+  header:add(f.echo, buffer(16, 4))
+  header:add(f.ack, buffer(20, 4))
+
+  local n = math.min(size, buffer:len() - HEADER_SIZE)
+  if n > 0 then
+    local payload = buffer(HEADER_SIZE, n)
+    if kind == 0 or kind == 1 then
+      local used = dissect_options(payload:tvb(), header)
+      if used < n then
+        header:add(f.payload, buffer(HEADER_SIZE + used, n - used)):set_text("Early data: " .. (n - used) .. " bytes")
+      end
+    elseif kind == 7 and n == 4 then
+      header:add(f.forward, payload)
+    else
+      header:add(f.payload, payload)
+    end
+  end
+
+  return HEADER_SIZE + n
+end
+
+-- Looks like RDT: a whole header, a known type, and a payload that fits
+local function heuristic(buffer, pinfo, tree)
+  local n = buffer:len()
+  if n < HEADER_SIZE or n > HEADER_SIZE + MAX_SIZE then
+    return false
+  end
+  if buffer(4, 2):uint() > 7 or buffer(8, 2):uint() ~= n - HEADER_SIZE then
+    return false
+  end
+
+  rdt.dissector(buffer, pinfo, tree)
+  return true
+end
+
+rdt:register_heuristic("udp", heuristic)
+DissectorTable.get("udp.port"):add_for_decode_as(rdt)
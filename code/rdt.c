@@ -1,58 +1,161 @@
 // Copyright 2022 190010906
 //
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "checkpoint/checkpoint.h"
 #include "checksum/checksum.h"
+#include "compress/compress.h"
+#include "conntable/conntable.h"
+#include "delta/delta.h"
+#include "multipath/multipath.h"
+#include "pcap/pcap.h"
 #include "rdt.h"
 #include "rto/rto.h"
 #include "sigalrm/sigalrm.h"
 #include "sigio/sigio.h"
+#include "trace/trace.h"
 #include "UdpSocket/UdpSocket.h"
 
-/* GLOBAL VARIABLES START */
-RdtSocket_t*      G_socket;                     // Global socket for connections.
-RdtPacket_t*      received;                     // Received packet. Set by SIGIO handler.
-RdtPacket_t*      G_packet;                     // Outbound packet.
-
-struct timespec   G_timestamp;                  // Timestamp used for calculating RTT for variable re-transmission.
-
-uint32_t          G_seq_init;                   // Initial sequence number.
-uint32_t          G_seq_no;                     // Current sequence number.
-uint32_t          G_rtt;                        // RTT for last segment in microseconds (us).
-
-uint8_t*          G_buf;                        // Data buffer for sending or receiving.
-uint32_t          G_buf_size;                   // Size of buf.
-uint16_t          G_prev_size;                  // Size of previous packet sent.
-bool              G_checksum_match;             // Flag for packet checksum match.
+/* STRUCTS START */
+/* One stream of a connection. The sender queues messages on it, framed; the receiver reassembles it. */
+typedef struct RdtStream_s {
+  uint8_t*  data;       // Sender: messages queued and not yet acknowledged. Receiver: everything received on the stream.
+  uint32_t  size;       // Bytes in data.
+  uint32_t  capacity;   // Bytes allocated for data.
+  uint32_t  sent;       // Sender: bytes of data acknowledged. Receiver: bytes of data given to the message hook.
+  uint32_t  offset;     // Sender: position of data[0] in the stream.
+  uint8_t   priority;   // Sender: 0 is sent first.
+} RdtStream_t;
+
+/* Streams of a connection. rdtStreamSend_r() may add to the sender's queues from any thread. */
+typedef struct RdtStreams_s {
+  RdtStream_t     stream[RDT_STREAMS];
+  pthread_mutex_t lock;                   // Sender: guards the streams.
+  uint8_t         chunk[RDT_MAX_SIZE];    // Sender: the chunk in flight, header and data.
+  int             in_flight;              // Sender: stream of the chunk in flight, or -1.
+  uint32_t        chunk_size;             // Sender: bytes of stream data in the chunk in flight.
+  uint16_t        next;                   // Sender: stream the round robin starts from.
+  uint32_t        demuxed;                // Receiver: bytes of the connection split up into chunks.
+} RdtStreams_t;
+/* STRUCTS END */
 
-int               G_errors  = 0;                // Error counter. Will cause transmission to stop if too many errors encountered.
-int               G_retries = 0;                // Global retries counter.
-int               G_state   = RDT_STATE_CLOSED; // Global FSM state.
-bool              G_debug   = false;            // Debug output flag.
-bool              G_sender  = false;            // Whether in send or receive mode.
 
-double            G_avg_rtt     = 1;            // Average RTT.
-uint32_t          G_rtt_counter = 0;            // Number of times RTT average has been calculated.
+/* GLOBAL VARIABLES START */
+RdtState_t        G_connection = {              // The one connection of a process, unless swapped out.
+  .state = RDT_STATE_CLOSED,
+  .codec = RDT_CODEC_NONE,
+  .out_fd = -1,
+  .avg_rtt = 1,
+  .snd_wnd = UINT32_MAX
+};
+RdtState_t*       G_conn = &G_connection;       // Connection the API and signal handlers work on.
+bool              G_debug   = false;            // Debug output flag. Programs print the fsm trace with it.
+
+ConnTable_t       G_server_table;               // rdtServe(): open connections, by peer.
+RdtSocket_t*      G_server_socket = NULL;       // rdtServe(): the socket every connection arrives on.
+RdtState_t*       G_server_listener = NULL;     // rdtServe(): G_conn when no connection is being handled.
+const RdtServerHooks_t* G_server_hooks = NULL;  // rdtServe(): callbacks.
+uint32_t          G_server_limit = 0;           // rdtServe(): connections to serve before returning. 0 for no limit.
+uint32_t          G_server_served = 0;          // rdtServe(): connections finished.
+RdtState_t**      G_server_queue = NULL;        // rdtServe(): ring of connections for the main loop.
+uint32_t          G_server_queue_head = 0;
+uint32_t          G_server_queue_count = 0;
+uint64_t          G_server_alarm = 0;           // rdtServe(): when the real timer goes off (us), or 0 if it isn't set.
+volatile sig_atomic_t G_server_stop = 0;        // rdtServe(): take no new connections, and return once the open ones finish.
+uint32_t (*G_isn_hook)(void) = NULL;            // If set, replaces getrandom() for initial sequence numbers (e.g. a seeded emulator).
 /* GLOBAL VARIABLES END */
 
 
-#define DEBUG(fmt, ...) if (G_debug) printf(fmt, __VA_ARGS__)
-
 void fsm(int input);
-void rdtOpen(RdtSocket_t* socket);
-void rdtClose();
+uint32_t initialSequence();
+void fsmInput(RdtState_t* c, int input);
+void rdtOpen(RdtState_t* c, RdtSocket_t* socket);
+void rdtClose(RdtState_t* c);
+void startClose(RdtState_t* c);
+int prepareSend(RdtState_t* c, const void* buf, uint32_t n);
+void freeSend(RdtState_t* c);
+void attachSocket(RdtState_t* c, RdtSocket_t* socket);
+void holdConnection(RdtState_t* c, sigset_t* mask);
+void releaseConnection(RdtState_t* c, const sigset_t* mask);
+void waitConnection(RdtState_t* c, const sigset_t* mask);
+void drainConnection(RdtState_t* c);
+void expireTimer(RdtState_t* c);
+uint64_t rdtClock();
+void startAsync(RdtState_t* c, const RdtCallbacks_t* callbacks, int step);
+int stepAsync(RdtState_t* c);
+void reportProgress(RdtState_t* c);
+void failAsync(RdtState_t* c, int error);
+int finishAsync(RdtState_t* c, uint32_t n);
+int armTimer(RdtState_t* c, uint32_t us);
 void handleSIGALRM(int sig);
 void handleSIGIO(int sig);
-void printProgress(int input);
+void printProgress(RdtState_t* c, int input);
+void resetStats(RdtState_t* c);
+void recordRTT(RdtState_t* c, uint32_t rtt);
 int rdtTypeToRdtEvent(RDTPacketType_t type);
+RdtPacket_t* createPacket(RdtState_t* c, RDTPacketType_t type, uint32_t seq_no, uint8_t* data);
+void addOption(RdtPacket_t* packet, uint8_t kind, const void* value, uint8_t len);
+uint16_t addEarlyData(RdtState_t* c, RdtPacket_t* packet);
+uint16_t parseOptions(RdtState_t* c, const RdtPacket_t* packet);
+void resumeCheckpoint(RdtState_t* c);
+void commitCheckpoint(RdtState_t* c, uint64_t committed);
+void endSignaturePhase(RdtState_t* c);
+bool writeThrough(const RdtState_t* c);
+bool storeSegment(RdtState_t* c, const uint8_t* data, uint16_t n);
+void reserveTransfer(RdtState_t* c, uint64_t end);
+int writeStaged(RdtState_t* c, const sigset_t* mask);
+uint32_t finishReceive(RdtState_t* c);
+RdtPacket_t* readDatagram(RdtSocket_t* socket, int* n);
+bool unpackDatagram(RdtState_t* c, RdtPacket_t* packet, int n);
+uint16_t advertisedWindow(RdtState_t* c);
+int sendAck(RdtState_t* c);
+void transmitPacket(RdtState_t* c, RdtPacket_t* packet);
+void handleServerSIGIO(int sig);
+void handleServerSIGALRM(int sig);
+int serverTimer(unsigned int sec, unsigned int usec);
+void activateConnection(RdtState_t* c);
+void queueConnection(RdtState_t* c);
+RdtState_t* dequeueConnection();
+void freeConnection(RdtState_t* c);
+int sendRst(RdtState_t* c);
+int enterPersist(RdtState_t* c);
+int abandonMessage(RdtState_t* c);
+int sendForward(RdtState_t* c);
+uint32_t capToDeadline(const RdtState_t* c, uint32_t us);
+bool growBuffer(RdtState_t* c, uint32_t size);
+void updateWindow(RdtState_t* c, const RdtPacket_t* packet);
+RdtState_t* openReverse(RdtState_t* c, uint32_t seq_init, uint64_t length);
+void freeReverse(RdtState_t* c);
+void dropReverse(RdtState_t* c);
+bool connectionOpen(const RdtState_t* c);
+void duplexFsm(RdtState_t* c, const RdtEvent_t* event);
+void addStats(RdtStats_t* to, const RdtStats_t* from);
+RdtStreams_t* openStreams(RdtState_t* c);
+void freeStreams(RdtState_t* c);
+bool growStream(RdtStream_t* s, uint32_t size);
+bool nextChunk(RdtState_t* c);
+void deliverStreams(RdtState_t* c);
+uint8_t* nextFrame(uint8_t* buf, uint32_t size, uint32_t* offset, uint32_t* n);
+void choosePath(RdtState_t* c);
+void trackPath(RdtState_t* c, const RdtEvent_t* event);
+void followPath(RdtState_t* c);
+int sendOnPath(const RdtSocket_t* socket, const UdpBuffer_t* buffer);
 
 /* API START */
 /**
@@ -62,11 +165,23 @@ int rdtTypeToRdtEvent(RDTPacketType_t type);
  * @return Pointer to RdtSocket_t.
  */
 RdtSocket_t* setupRdtSocket_t(const char* hostname, const uint16_t port) {
+  return setupRdtSocketFrom_t(hostname, port, port);
+}
+
+/**
+ * Sets up and opens UDP sockets to support RDT, sending from a different local port than the remote
+ * one. Lets many clients on one host connect to the same server.
+ * @param hostname The name of the host to open socket to.
+ * @param port The port to open socket to.
+ * @param local_port The port to send from. 0 for any free port.
+ * @return Pointer to RdtSocket_t.
+ */
+RdtSocket_t* setupRdtSocketFrom_t(const char* hostname, const uint16_t port, const uint16_t local_port) {
   RdtSocket_t* socket = (RdtSocket_t*) calloc(1, sizeof(RdtSocket_t));
   int error = 0;
 
   /* setup local UDP socket */
-  socket->local = setupUdpSocket_t((char *) 0, port);
+  socket->local = setupUdpSocket_t((char *) 0, local_port);
   if (socket->local == (UdpSocket_t *) 0) {
     errno = ENOTCONN;
     perror("Couldn't setup local UDP socket");
@@ -103,751 +218,3800 @@ RdtSocket_t* setupRdtSocket_t(const char* hostname, const uint16_t port) {
   return socket;
 }
 
+/**
+ * Sets up and opens a UDP socket to listen on, sharing its port with any other socket bound to it
+ * with SO_REUSEPORT. The kernel spreads peers across the sockets by address and port, so each peer's
+ * datagrams always arrive on the same one.
+ * @param port The port to listen on.
+ * @return Pointer to RdtSocket_t, or (RdtSocket_t*) -1 on failure.
+ */
+RdtSocket_t* setupRdtSocketReusePort_t(const uint16_t port) {
+  RdtSocket_t* listener = (RdtSocket_t*) calloc(1, sizeof(RdtSocket_t));
+  int on = 1;
+
+  listener->local = setupUdpSocket_t((char *) 0, port);
+  listener->remote = setupUdpSocket_t((char *) 0, port);
+  if (listener->local == (UdpSocket_t *) 0 || listener->remote == (UdpSocket_t *) 0) {
+    errno = ENOTCONN;
+    perror("Couldn't setup UDP socket");
+    free(listener->local);
+    free(listener->remote);
+    free(listener);
+    return (RdtSocket_t *) -1;
+  }
+
+  /* openUdp(), with SO_REUSEPORT set before the bind */
+  listener->local->sd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (listener->local->sd < 0 ||
+      setsockopt(listener->local->sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+      bind(listener->local->sd, (struct sockaddr *) &listener->local->addr, sizeof(listener->local->addr)) != 0) {
+    perror("Couldn't open UDP socket");
+    if (listener->local->sd >= 0) close(listener->local->sd);
+    free(listener->local);
+    free(listener->remote);
+    free(listener);
+    return (RdtSocket_t *) -1;
+  }
+
+  printf("Opening shared socket on port %d...\n", port);
+  return listener;
+}
+
 /**
  * Send data over RDT.
  * @param socket The socket to send data over.
  * @param buf Buffer containing the data
  * @param n The size of 'buf'
+ * @return 0 if all data was acknowledged, -1 otherwise.
+ */
+int rdtSend(RdtSocket_t* socket, const void* buf, uint32_t n) {
+  return rdtSend_r(G_conn, socket, buf, n);
+}
+
+/**
+ * Send data over RDT on a given connection. With c->polled, the connection is driven from the
+ * calling thread, so each thread can run its own. With c->duplex, whatever the receiver sends back
+ * is received at the same time, for rdtReply_r(), and the connection is polled.
+ * @param c The connection, from rdtCreateState().
+ * @param socket The socket to send data over. Only this connection may use it.
+ * @param buf Buffer containing the data
+ * @param n The size of 'buf'
+ * @return 0 if all data was acknowledged, -1 otherwise.
  */
-void rdtSend(RdtSocket_t* socket, const void* buf, uint32_t n) {
-  G_buf = (uint8_t*) buf;
-  G_buf_size = n;
-  G_sender = true;
+int rdtSend_r(RdtState_t* c, RdtSocket_t* socket, const void* buf, uint32_t n) {
+  sigset_t mask;
 
-  /* Seed srand */
-  srandom(time(NULL));
+  c->buf = (uint8_t*) buf;
+  c->buf_size = n;
+  c->sender = true;
+  c->framed = false;
+  c->polled |= c->duplex;
 
   printf("Connecting to remote host...\n");
-  rdtOpen(socket);
+  rdtOpen(c, socket);
 
-  if (G_state == RDT_STATE_CLOSED) {
+  if (c->state == RDT_STATE_CLOSED) {
     printf("Unable to connect to remote host. Aborting!\n");
-    return;
+    return -1;
+  }
+
+  /* Signals stay blocked, except while waiting, until the first segment is sent, so the FSM doesn't
+   * see an ACK, or a late segment of the signature stream, while the send buffer is being prepared. */
+  holdConnection(c, &mask);
+
+  /* Delta mode: wait for the receiver's block signatures, then encode our data against them */
+  if (c->delta_block != 0) {
+    printf("Waiting for block signatures...\n");
+    while (c->state == RDT_STATE_ESTABLISHED && !deltaSignaturesComplete(c->buf, c->seq_no - c->seq_init)) {
+      waitConnection(c, &mask);
+    }
+
+    if (c->state != RDT_STATE_ESTABLISHED) {
+      printf("Connection lost while receiving block signatures. Aborting!\n");
+      free(c->buf);
+      c->buf = NULL;
+      c->buf_size = 0;
+      releaseConnection(c, &mask);
+      rdtClose(c);
+      return -1;
+    }
+  }
+
+  if (prepareSend(c, buf, n) != 0) {
+    releaseConnection(c, &mask);
+    rdtClose(c);
+    return -1;
   }
 
-  printf("Sending %d bytes...\n", n);
-  fsm(RDT_INPUT_SEND);
+  /* Whatever rode in the SYN has already been acknowledged by the SYN_ACK */
+  if (c->seq_no - c->seq_init < c->buf_size) {
+    printf("Sending %d bytes...\n", c->buf_size - (c->seq_no - c->seq_init));
+    fsmInput(c, RDT_INPUT_SEND);
+  }
 
-  while(G_state != RDT_STATE_ESTABLISHED && G_state != RDT_STATE_CLOSED) {
-    (void) pause(); // Wait for signal
+  while(c->state != RDT_STATE_ESTABLISHED && c->state != RDT_STATE_CLOSED) {
+    waitConnection(c, &mask);
   }
+  releaseConnection(c, &mask);
   printf("Finished!\n");
+  freeSend(c);
+
+  int r = c->state == RDT_STATE_ESTABLISHED ? 0 : -1;
 
-  rdtClose();
+  rdtClose(c);
   printf("Bye!\n");
+  return r;
 }
 
 /**
- * Listen for RDT connections on socket.
- * @param socket Socket to listen on.
+ * Sender, once connected: turns the data into what's sent. In delta mode it's encoded against the
+ * receiver's block signatures, which must all have arrived. Whatever a resumed receiver already has
+ * is skipped, and the rest compressed. What's allocated is kept in the connection for freeSend().
+ * @param c The connection, established.
+ * @param buf The data.
+ * @param n The size of 'buf'.
+ * @return 0 if successful, -1 if out of memory.
  */
-void rdtListen(RdtSocket_t* socket) {
-  G_socket = socket;
-  G_state = RDT_STATE_LISTEN;
+int prepareSend(RdtState_t* c, const void* buf, uint32_t n) {
+  if (c->delta_block != 0) {
+    /* Switch direction: encode our data against the signatures and send it after them */
+    uint8_t* sigs = c->buf;
+    c->delta_data = deltaEncode(sigs, c->seq_no - c->seq_init, (const uint8_t*) buf, n, &c->buf_size);
+    free(sigs);
+    c->buf = c->delta_data;
+    c->seq_init = c->seq_no;
+
+    if (c->delta_data == NULL) {
+      printf("Couldn't encode delta. Aborting!\n");
+      return -1;
+    }
+    printf("Delta of %d bytes is %d bytes.\n", n, c->buf_size);
+  }
 
-  setupSIGIO(G_socket->local->sd, handleSIGIO);
-  setupSIGALRM(handleSIGALRM);
+  /* Skip whatever the receiver has already committed */
+  if (c->resume_offset > c->offset) {
+    uint32_t skip = c->resume_offset - c->offset < n ? (uint32_t) (c->resume_offset - c->offset) : n;
+    c->buf += skip;
+    c->buf_size -= skip;
+    printf("Resuming at byte %" PRIu64 "...\n", c->resume_offset);
+  }
 
-  printf("Listening on port %d...\n", ntohs(socket->local->addr.sin_port));
+  /* Compression stage between the send buffer and segmentation */
+  if (c->codec != RDT_CODEC_NONE) {
+    uint32_t raw = c->buf_size;
+    c->encoded = encodeBuffer(c->codec, c->buf, c->buf_size, &c->buf_size);
+    if (c->encoded == NULL) {
+      printf("Couldn't allocate compression buffer. Aborting!\n");
+      freeSend(c);
+      return -1;
+    }
 
-  while(G_state != RDT_STATE_CLOSED) {
-    (void) pause(); // Wait for signal
+    c->buf = c->encoded;
+    if (c->encoded[0] == RDT_CODEC_NONE) {
+      printf("Data doesn't compress. Sending uncompressed.\n");
+    } else {
+      printf("Compressed %d bytes to %d bytes (%s).\n", raw, c->buf_size, codecName(c->encoded[0]));
+    }
   }
+
+  return 0;
 }
 
 /**
- * Cleans up and closes the underlying UDP sockets.
- * @param socket The socket to close.
+ * Frees what prepareSend() allocated, once the data has been sent.
+ * @param c The connection.
  */
-void closeRdtSocket_t(RdtSocket_t* socket) {
-  closeUdp(socket->local);
-  closeUdp(socket->remote);
-  free(socket);
+void freeSend(RdtState_t* c) {
+  free(c->encoded);
+  free(c->delta_data);
+  c->encoded = NULL;
+  c->delta_data = NULL;
 }
-/* API END */
-
 
-/* SOCKETS START */
 /**
- * Sets remote socket to hostname supplied. Allows accepting SYN initially, then setting remote hostname to whoever we
- * received SYN from
- * @param hostname
- * @return int 0 if success, -1 if failure.
+ * Opens a persistent connection for sending a sequence of messages with rdtSendMessage().
+ * The RTT estimate and RTO carry over from one message to the next.
+ * @param socket The socket to connect over.
+ * @return 0 if connected, -1 otherwise.
  */
-int setRemoteSocket(char* hostname) {
-  G_socket->remote = setupUdpSocket_t(hostname, ntohs(G_socket->receive.addr.sin_port));
-  if (G_socket->remote == (UdpSocket_t *) 0) {
-    errno = ENOTCONN;
-    perror("Couldn't setup remote UDP socket\n");
-    return -1;
-  }
-
-  return 0;
+int rdtConnect(RdtSocket_t* socket) {
+  return rdtConnect_r(G_conn, socket);
 }
 
-
-/* CONNECTION MANAGEMENT START */
 /**
- * Open an RDT socket.
- * @param socket Uninitialised RDT socket.
+ * rdtConnect() on a given connection, for rdtSendMessage_r().
+ * @param c The connection, from rdtCreateState().
+ * @param socket The socket to connect over. Only this connection may use it.
+ * @return 0 if connected, -1 otherwise.
  */
-void rdtOpen(RdtSocket_t* socket) {
-  /* Setup SIGIO to handle network events. */
-  G_socket = socket;
+int rdtConnect_r(RdtState_t* c, RdtSocket_t* socket) {
+  bool streams = c->streams;
+
+  c->buf = NULL;
+  c->buf_size = 0;
+  c->sender = true;
+  c->framed = true;
+
+  /* Queues for the streams, before any thread can add to them */
+  freeStreams(c);
+  if (streams && openStreams(c) == NULL) {
+    printf("Couldn't set up streams. Aborting!\n");
+    return -1;
+  }
 
-  setupSIGIO(G_socket->local->sd, handleSIGIO);
-  setupSIGALRM(handleSIGALRM);
+  printf("Connecting to remote host...\n");
+  rdtOpen(c, socket);
+
+  if (c->state == RDT_STATE_CLOSED) {
+    printf("Unable to connect to remote host. Aborting!\n");
+    return -1;
+  }
 
-  fsm(RDT_INPUT_ACTIVE_OPEN);
+  if (!c->framed) {
+    printf("Remote host doesn't support persistent connections. Aborting!\n");
+    rdtClose(c);
+    return -1;
+  }
 
-  while(G_state != RDT_STATE_ESTABLISHED  && G_state != RDT_STATE_CLOSED) {
-    (void) pause(); // Wait for signal
+  if (streams && !c->streams) {
+    printf("Remote host doesn't support streams. Aborting!\n");
+    rdtClose(c);
+    return -1;
   }
+
+  return 0;
 }
 
 /**
- * Closes an RDT socket.
- * @param socket The socket to close.
+ * Sends one message over a connection opened with rdtConnect(). Each message is prefixed with its
+ * length, so the receiver can split the stream up again with rdtNextMessage().
+ * @param buf Buffer containing the message.
+ * @param n The size of 'buf'.
+ * @return 0 if the message was acknowledged, -1 otherwise.
  */
-void rdtClose() {
-  fsm(RDT_INPUT_CLOSE);
-
-  while(G_state != RDT_STATE_CLOSED) {
-    (void) pause();
-  }
+int rdtSendMessage(const void* buf, uint32_t n) {
+  return rdtSendMessage_r(G_conn, buf, n);
 }
-/* CONNECTION MANAGEMENT CLOSE */
 
+/**
+ * rdtSendMessage() on a connection opened with rdtConnect_r().
+ * @param c The connection.
+ * @param buf Buffer containing the message.
+ * @param n The size of 'buf'.
+ * @return 0 if the message was acknowledged, -1 otherwise.
+ */
+int rdtSendMessage_r(RdtState_t* c, const void* buf, uint32_t n) {
+  return rdtSendMessageWithin_r(c, buf, n, 0) == 0 ? 0 : -1;
+}
 
-/* PACKETS START */
 /**
- * Receive an RDT packet from the socket.
- * @param socket Pointer to RdtSocket_t to receive packet from.
- * @return Pointer to RdtPacket_t.
+ * Sends one message that's only worth delivering within 'lifetime' ms, e.g. a reading that a newer
+ * one replaces. Once that passes, the message isn't retransmitted any more, and the receiver is told
+ * to skip past it. rdtNextMessage() leaves it out. A receiver that doesn't support this gets every
+ * message reliably, and so does a message bigger than RDT_MAX_PARTIAL.
+ * @param buf Buffer containing the message.
+ * @param n The size of 'buf'.
+ * @param lifetime Time (ms) from now to deliver the message within, or 0 to deliver it however long it takes.
+ * @return 0 if the message was acknowledged, 1 if it was abandoned (all of it may have arrived, if
+ * only the ACKs were lost), -1 if the connection failed.
  */
-RdtPacket_t* recvRdtPacket(RdtSocket_t* socket) {
-  int r, error = 0;
-  int size = sizeof(RdtPacket_t);
+int rdtSendMessageWithin(const void* buf, uint32_t n, uint32_t lifetime) {
+  return rdtSendMessageWithin_r(G_conn, buf, n, lifetime);
+}
 
-  /* Create UdpBuffer_t to receive datagram */
-  UdpBuffer_t buffer;
-  uint8_t bytes[size];
-  buffer.bytes = bytes;
-  buffer.n = size;
+/**
+ * rdtSendMessageWithin() on a connection opened with rdtConnect_r().
+ * @param c The connection.
+ * @param buf Buffer containing the message.
+ * @param n The size of 'buf'.
+ * @param lifetime Time (ms) from now to deliver the message within, or 0 to deliver it however long it takes.
+ * @return 0 if the message was acknowledged, 1 if it was abandoned, -1 if the connection failed.
+ */
+int rdtSendMessageWithin_r(RdtState_t* c, const void* buf, uint32_t n, uint32_t lifetime) {
+  sigset_t mask;
 
-  /* Receive UDP datagram */
-  r = recvUdp(socket->local, &(socket->receive), &buffer);
-  if (r < 0) {
-    perror("Couldn't receive RDT packet");
-    error = 1;
-    return (RdtPacket_t*) 0;
+  if (!c->framed || c->streams || c->state != RDT_STATE_ESTABLISHED || n >= RDT_FRAME_ABANDONED) {
+    return -1;
   }
 
-  /* Create RdtPacket_t and copy bytes */
-  RdtPacket_t* packet = calloc(1, size);
-  memcpy(packet, buffer.bytes, r);
-
-  /* Calculate expected checksum and compare */
-  uint16_t checksum = packet->header.checksum;
-  packet->header.checksum = 0;
-  uint16_t expected = ipv4_header_checksum(packet, r);
-
-  G_checksum_match = (expected == checksum);
+  /* Next message carries on in the same sequence space. Its length goes ahead of it from c->frame,
+   * so the message is sent from the caller's buffer. */
+  uint32_t length = htonl(n);
+  holdConnection(c, &mask);
+  memcpy(c->frame, &length, RDT_FRAME_HEADER);
+  c->frame_size = RDT_FRAME_HEADER;
+  c->buf = (uint8_t*) buf;
+  c->buf_size = RDT_FRAME_HEADER + n;
+  c->seq_init = c->seq_no;
+  c->expires = c->partial && lifetime > 0 && n <= RDT_MAX_PARTIAL ? rdtClock() + (uint64_t) lifetime * 1000 : 0;
+  c->abandoned = false;
+  fsmInput(c, RDT_INPUT_SEND);
+
+  while(c->state != RDT_STATE_ESTABLISHED && c->state != RDT_STATE_CLOSED) {
+    waitConnection(c, &mask);
+  }
+  releaseConnection(c, &mask);
 
-  /* Convert header fields to host byteorder */
-  packet->header.sequence = ntohl(packet->header.sequence);
-  packet->header.size = ntohs(packet->header.size);
-  packet->header.type = ntohs(packet->header.type);
-  packet->header.checksum = checksum;
+  c->buf = NULL;
+  c->buf_size = 0;
+  c->frame_size = 0;
+  c->expires = 0;
 
-  return packet;
+  if (c->state != RDT_STATE_ESTABLISHED) {
+    return -1;
+  }
+  return c->abandoned ? 1 : 0;
 }
 
 /**
- * Sends an RdtPacket_t over the specified RdtSocket.
- * @param socket The socket to send the packet over.
- * @param packet Pointer to the packet to send.
- * @param n The size of 'packet' (header + data).
- * @return Number of bytes sent.
+ * Closes a connection opened with rdtConnect(). Anything still queued on its streams is sent first.
  */
-int sendRdtPacket(const RdtSocket_t* socket, RdtPacket_t* packet, const uint16_t n) {
-  UdpBuffer_t buffer;
-  uint8_t bytes[n];
-
-  memcpy(bytes, packet, n);
-  buffer.n = n;
-  buffer.bytes = bytes;
+void rdtDisconnect() {
+  rdtDisconnect_r(G_conn);
+}
 
-  return sendUdp(socket->local, socket->remote, &buffer);
+/**
+ * Closes a connection opened with rdtConnect_r(). Anything still queued on its streams is sent first.
+ * @param c The connection.
+ */
+void rdtDisconnect_r(RdtState_t* c) {
+  if (c->streams) {
+    rdtStreamFlush_r(c);
+  }
+  if (c->state != RDT_STATE_CLOSED) {
+    rdtClose(c);
+  }
+  c->framed = false;
+  printf("Bye!\n");
 }
 
 /**
- * Creates an RDTPacket for a given type, sequence number and (optional) data.
- * @param type The RDTPacketType_t of the packet to create.
- * @param seq_no The uint16_t sequence number to give the packet.
- * @param data (Optional) pointer to uint8_t data. Should be NULL if type is not DATA.
- * @return Pointer to created RdtPacket_t.
+ * Listen for RDT connections on socket.
+ * If G_conn->out_fd is set, received data is written to it at G_conn->offset rather than kept in G_conn->buf.
+ * If G_conn->checkpoint_path is also set, resumable transfers are checkpointed there.
+ * @param socket Socket to listen on.
+ * @return Number of bytes received.
  */
-RdtPacket_t* createPacket(RDTPacketType_t type, uint32_t seq_no, uint8_t* data) {
-  uint16_t n = 0;
+uint32_t rdtListen(RdtSocket_t* socket) {
+  return rdtListen_r(G_conn, socket);
+}
 
-  /* Allocate memory for packet. Set type and sequence number. Zero checksum value. */
-  RdtPacket_t* packet = (RdtPacket_t *) calloc(1, sizeof(RdtPacket_t));
-  packet->header.type = htons(type);
-  packet->header.sequence = htonl(seq_no);
-  packet->header.checksum = htons(0);
+/**
+ * rdtListen() on a given connection. With c->polled, the connection is driven from the calling
+ * thread, so each thread can listen on its own socket. With c->reply set, a sender that asks for full
+ * duplex gets it sent back on the same connection, and this returns once both directions are done.
+ * @param c The connection, from rdtCreateState(), set up as G_conn would be for rdtListen().
+ * @param socket Socket to listen on. Only this connection may use it.
+ * @return Number of bytes received.
+ */
+uint32_t rdtListen_r(RdtState_t* c, RdtSocket_t* socket) {
+  c->polled |= c->reply != NULL;
+  freeReverse(c);
+  c->state = RDT_STATE_LISTEN;
+  resetStats(c);
+  attachSocket(c, socket);
 
-  /* Calculate the header field value */
-  if (data != NULL) {
-    uint32_t diff = G_buf_size - (G_seq_no - G_seq_init);
+  printf("Listening on port %d...\n", ntohs(socket->local->addr.sin_port));
 
-    if (diff > RDT_MAX_SIZE) {
-      n = RDT_MAX_SIZE;
-    } else {
-      n = diff;
+  /* Write staged data to the output file between signals. Signals are blocked for the checks, and
+   * waitConnection() unblocks them while it waits, so a segment arriving between them isn't missed. */
+  sigset_t mask;
+  int written = 0;
+  holdConnection(c, &mask);
+  while(connectionOpen(c) && written >= 0) {
+    written = writeStaged(c, &mask);
+    if (c->streams) {
+      deliverStreams(c);
+    }
+    if (written == 0) {
+      waitConnection(c, &mask);
     }
-
-    memcpy(&packet->data, data + (G_seq_no - G_seq_init), n);
+  }
+  /* The rest of what arrived before the FIN, which may have come with it while waiting */
+  if (written >= 0) {
+    do {
+      written = writeStaged(c, &mask);
+    } while (written > 0);
+  }
+  releaseConnection(c, &mask);
+  free(c->stage);
+  c->stage = NULL;
+  if (written < 0) {
+    return 0;
   }
 
-  /* Set header size and checksum */
-  packet->header.size = htons(n);
-  packet->header.checksum = ipv4_header_checksum(packet, sizeof(RdtHeader_t) + n);
-  return packet;
+  return finishReceive(c);
 }
-/* PACKETS END */
-
 
-/* SIGNALS START */
 /**
- * SIGIO handler. Called when packets are received.
- * @param sig
+ * Finishes off what a closed connection received: decodes it, rebuilds it from a delta, writes out
+ * whatever was buffered, and checkpoints it.
+ * @param c The connection. Its staged data must all have been written.
+ * @return Number of bytes received.
  */
-void handleSIGIO(int sig) {
-  if (sig == SIGIO) {
-    /* protect the network and keyboard reads from signals */
-    sigprocmask(SIG_BLOCK, &G_sigmask, (sigset_t *) 0);
+uint32_t finishReceive(RdtState_t* c) {
+  uint32_t n = c->seq_no - c->seq_init;
 
-    received = recvRdtPacket(G_socket);
+  /* Messages on streams that completed since they were last looked at */
+  if (c->streams) {
+    deliverStreams(c);
+  }
 
-    int input = rdtTypeToRdtEvent(received->header.type);
+  /* Undo the sender's compression stage */
+  if (c->codec != RDT_CODEC_NONE && c->buf != NULL) {
+    uint8_t* decoded = decodeBuffer(c->buf, n, &n);
+    if (decoded == NULL) {
+      printf("Couldn't decode received data!\n");
+      return 0;
+    }
 
-    fsm(input);
+    free(c->buf);
+    c->buf = decoded;
+    c->buf_size = n;
+  }
 
-    free(received);
+  /* Rebuild the data from our basis and the sender's delta */
+  if (c->delta_block != 0 && c->buf != NULL) {
+    uint8_t* data = deltaApply(c->basis, c->basis_size, c->buf, n, &n);
+    if (data == NULL) {
+      printf("Couldn't apply received delta!\n");
+      return 0;
+    }
 
-    /* allow the signals to be delivered */
-    sigprocmask(SIG_UNBLOCK, &G_sigmask, (sigset_t *) 0);
-  }
-  else {
-    perror("handleSIGIO(): got a bad signal number");
-    exit(1);
+    printf("Rebuilt %d bytes from a %d byte delta.\n", n, c->seq_no - c->seq_init);
+    free(c->buf);
+    c->buf = data;
+    c->buf_size = n;
   }
-}
-
-/**
- * SIGALRM handler. Triggered 200ms after ITIMER set for alarm.
- * @param sig
- */
-void handleSIGALRM(int sig) {
-  if (sig == SIGALRM) {
-    /* protect handler actions from signals */
-    sigprocmask(SIG_BLOCK, &G_sigmask, (sigset_t *) 0);
 
-    /* Send a packet */
-    fsm(RDT_EVENT_RTO);
+  /* Buffered data still needs writing to the output file. Messages are left for rdtNextMessage(). */
+  if (c->out_fd >= 0 && !writeThrough(c) && !c->framed && c->buf != NULL) {
+    if (pwrite(c->out_fd, c->buf, n, (off_t) c->offset) != (ssize_t) n) {
+      perror("Couldn't write to output file");
+      return 0;
+    }
+  }
 
-    /* protect handler actions from signals */
-    sigprocmask(SIG_UNBLOCK, &G_sigmask, (sigset_t *) 0);
+  /* Record how far we got, so an interrupted transfer resumes from here */
+  if (c->out_fd >= 0 && c->checkpoint_path != NULL && c->transfer_id != 0) {
+    commitCheckpoint(c, c->offset + n);
   }
-  else {
-    perror("handleSIGALRM() got a bad signal");
-    exit(1);
+
+  if (c->buf != NULL) {
+    c->buf_size = n;
   }
+  return n;
 }
-/* SIGNALS END */
 
-
-/* OTHER*/
 /**
- * RDT Finite State Machine
- * @param input
+ * Serves connections from any number of peers at once on one socket, each with its own state. The
+ * accept hook sets up each new connection, like G_conn is set up for rdtListen(), and the done hook
+ * gets it once it has closed and its data has been written out. G_conn is the connection a hook is
+ * called for, so rdtGetStats() and rdtNextMessage() work in the done hook. The connection, and its
+ * buffer, are freed after the hook returns.
+ * @param socket Socket to listen on.
+ * @param hooks Callbacks, or NULL.
+ * @param connections Connections to serve before returning, or 0 to serve until rdtServeStop().
+ * @return Number of connections served.
  */
-void fsm(int input) {
-  DEBUG("fsm: old_state=%-12s input=%-12s seq=%u/%-8u ", fsm_strings[G_state], fsm_strings[input], (G_seq_no - G_seq_init), G_buf_size);
-  int r, size;
-  int output = 0;
+uint32_t rdtServe(RdtSocket_t* socket, const RdtServerHooks_t* hooks, uint32_t connections) {
+  struct itimerval off = { { 0, 0 }, { 0, 0 } };
+  sigset_t mask;
+
+  if (connTableInit(&G_server_table, RDT_SERVER_CONNECTIONS) != 0 ||
+      (G_server_queue = (RdtState_t**) calloc(RDT_SERVER_CONNECTIONS, sizeof(RdtState_t*))) == NULL) {
+    perror("Couldn't allocate connection table");
+    connTableFree(&G_server_table);
+    return 0;
+  }
 
-  /* If RST is ever received as input, close the connection immediately. */
-  if (input == RDT_EVENT_RCV_RST) {
-    G_state = RDT_STATE_CLOSED;
-    return;
+  G_server_socket = socket;
+  G_server_hooks = hooks;
+  G_server_listener = G_conn;
+  G_server_limit = connections;
+  G_server_served = 0;
+  G_server_queue_head = 0;
+  G_server_queue_count = 0;
+  G_server_alarm = 0;
+
+  /* Each connection's timer is a deadline. The real timer goes off at the earliest. */
+  int (*timer_hook)(unsigned int sec, unsigned int usec) = G_timer_hook;
+  G_timer_hook = serverTimer;
+
+  /* Room for a burst of datagrams from many peers at once, e.g. their SYNs */
+  int rcvbuf = RDT_SERVER_RCVBUF;
+  if (setsockopt(socket->local->sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0) {
+    perror("Couldn't set socket receive buffer");
   }
 
-  switch (G_state) {
+  setupSIGIO(socket->local->sd, handleServerSIGIO);
+  setupSIGALRM(handleServerSIGALRM);
 
-    /* CLOSED */
-    case RDT_STATE_CLOSED:
-      switch (input) {
+  printf("Serving on port %d...\n", ntohs(socket->local->addr.sin_port));
 
-        /* ACTIVE OPEN */
-        open:
-        case RDT_INPUT_ACTIVE_OPEN: {
-          /* Set G_seq_init and G_seq_no to a random starter value,
-           * to minimise "old" packet ambiguity/predictability */
-          G_seq_init = (uint32_t) random();
-          G_seq_no = G_seq_init;
+  /* Write out staged data, and finish closed connections, for whichever connections the handlers
+   * queued. Signals are blocked except while writing, and while waiting in sigsuspend(). */
+  sigprocmask(SIG_BLOCK, &G_sigmask, &mask);
+  while ((G_server_limit == 0 || G_server_served < G_server_limit) && !(G_server_stop && G_server_table.count == 0)) {
+    RdtState_t* c = dequeueConnection();
+    if (c == NULL) {
+      sigsuspend(&mask); // Wait for signal
+      continue;
+    }
 
-          /* If this is the first attempt, set RTO to 200ms */
-          if (T_rto == 0) {
-            T_rto = HANDSHAKE_RTO;
-          }
+    int written = writeStaged(c, &mask);
+    if (written < 0) {
+      c->written = c->seq_no - c->seq_init; // Reset by writeStaged(). Drop what's staged.
+    }
+    if (written != 0 || c->state != RDT_STATE_CLOSED) {
+      queueConnection(c); // If there's more to write, or it has closed since
+      continue;
+    }
 
-          /* Create and send SYN packet */
-          G_packet = createPacket(SYN, G_seq_no, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+    /* Closed, with everything written. Nothing was unblocked, so it can't have been queued again. */
+    activateConnection(c);
+    uint32_t n = finishReceive(c);
+    if (hooks != NULL && hooks->done != NULL) {
+      hooks->done(c, n, hooks->arg);
+    }
+    activateConnection(G_server_listener);
 
-          /* Set ITIMER to RTO, starting from 200ms for handshake */
-          if (setITIMER(RTO_TO_SEC(T_rto), RTO_TO_USEC(T_rto)) != 0) {
-            perror("Couldn't set timeout");
-          }
+    connTableRemove(&G_server_table, connKey(&c->socket->receive.addr));
+    freeConnection(c);
+    G_server_served++;
+  }
 
-          /* Update state and output flag */
-          G_state = RDT_STATE_SYN_SENT;
-          output = RDT_ACTION_SND_SYN;
-          free(G_packet);
-          break;
-        }
+  setitimer(ITIMER_REAL, &off, (struct itimerval *) 0);
+  G_timer_hook = timer_hook;
+  G_server_stop = 0;
+  sigprocmask(SIG_SETMASK, &mask, (sigset_t *) 0);
 
-        /* PASSIVE OPEN */
-        case RDT_INPUT_PASSIVE_OPEN:
-          G_state = RDT_STATE_LISTEN;
-          break;
-      }
-      break;
+  free(G_server_queue);
+  G_server_queue = NULL;
+  connTableFree(&G_server_table);
+  return G_server_served;
+}
 
-    /* LISTENING */
-    case RDT_STATE_LISTEN:
-      switch (input) {
-
-        /* RCV SYN */
-        syn:
-        case RDT_EVENT_RCV_SYN: {
-          /* Set sequence number to received sequence number */
-          G_seq_init = received->header.sequence;
-          G_seq_no = G_seq_init;
-
-          /* Set remote socket to host that we've received SYN from */
-          printf("Receiving bytes from %s...\n", inet_ntoa(G_socket->receive.addr.sin_addr));
-          if (setRemoteSocket(inet_ntoa(G_socket->receive.addr.sin_addr)) < 0) {
-            errno = ECONNABORTED;
-            perror("Couldn't set up remote socket. Aborting!");
-            exit(-1);
-          }
+/**
+ * Asks rdtServe() to take no new connections, and to return once the open ones have finished. If
+ * it isn't running yet, the next call returns straight away. Safe in a signal handler. Add the signal
+ * to G_sigmask before calling rdtServe(), so it's only taken while rdtServe() waits, and can't slip
+ * in between its checks.
+ */
+void rdtServeStop() {
+  G_server_stop = 1;
+}
 
-          /* Create and send SYN ACK packet */
-          G_packet = createPacket(SYN_ACK, G_seq_init, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+/**
+ * Iterates over the messages received by rdtListen() on a persistent connection.
+ * @param offset Position of the next message in G_conn->buf. Start at 0; updated on each call.
+ * @param n Set to the size of the message.
+ * @return Pointer to the message within G_conn->buf, or NULL when there are no more.
+ */
+uint8_t* rdtNextMessage(uint32_t* offset, uint32_t* n) {
+  return rdtNextMessage_r(G_conn, offset, n);
+}
 
-          /* Update state and set output flag */
-          G_state = RDT_STATE_ESTABLISHED;
-          output = RDT_ACTION_SND_SYN_ACK;
-          free(G_packet);
-          break;
-        }
+/**
+ * rdtNextMessage() on a given connection. Messages the sender abandoned are skipped.
+ * @param c The connection.
+ * @param offset Position of the next message in c->buf. Start at 0; updated on each call.
+ * @param n Set to the size of the message.
+ * @return Pointer to the message within c->buf, or NULL when there are no more.
+ */
+uint8_t* rdtNextMessage_r(const RdtState_t* c, uint32_t* offset, uint32_t* n) {
+  return c->buf != NULL ? nextFrame(c->buf, c->buf_size, offset, n) : NULL;
+}
 
-        /* DEFAULT / ALL OTHER PACKET TYPES */
-        default: {
-          /* Create and send RST */
-          G_packet = createPacket(RST, 0, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+/**
+ * Queues a message on one of the streams of a connection opened with rdtConnect() after setting
+ * G_conn->streams. rdtStreamFlush() sends it. Each stream's messages arrive in order, but the streams
+ * are interleaved a chunk at a time: the most urgent stream with data waiting goes next, and streams
+ * of equal priority take turns. So a small message on an urgent stream only waits for the chunk in
+ * flight, not for a bulk transfer queued on another stream.
+ * @param stream The stream, from 0 to RDT_STREAMS - 1.
+ * @param buf Buffer containing the message.
+ * @param n The size of 'buf'.
+ * @param priority The stream's priority, 0 being the most urgent. Applies to everything queued on it.
+ * @return 0 if queued, -1 otherwise.
+ */
+int rdtStreamSend(uint16_t stream, const void* buf, uint32_t n, uint8_t priority) {
+  return rdtStreamSend_r(G_conn, stream, buf, n, priority);
+}
 
-          /* Remain in LISTEN state */
-          G_state = RDT_STATE_CLOSED;
-          output = RDT_ACTION_SND_RST;
-          free(G_packet);
-        }
+/**
+ * rdtStreamSend() on a connection opened with rdtConnect_r(). Other threads may queue messages while
+ * one is in rdtStreamFlush_r(); they're picked up between chunks.
+ * @param c The connection.
+ * @param stream The stream, from 0 to RDT_STREAMS - 1.
+ * @param buf Buffer containing the message.
+ * @param n The size of 'buf'.
+ * @param priority The stream's priority, 0 being the most urgent. Applies to everything queued on it.
+ * @return 0 if queued, -1 otherwise.
+ */
+int rdtStreamSend_r(RdtState_t* c, uint16_t stream, const void* buf, uint32_t n, uint8_t priority) {
+  RdtStreams_t* set = c->stream_set;
+  int r = -1;
 
+  if (!c->streams || set == NULL || stream >= RDT_STREAMS || n >= RDT_FRAME_ABANDONED) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&set->lock);
+  RdtStream_t* s = &set->stream[stream];
+  if (n <= UINT32_MAX - RDT_FRAME_HEADER - s->size && growStream(s, s->size + RDT_FRAME_HEADER + n)) {
+    uint32_t length = htonl(n);
+    memcpy(s->data + s->size, &length, RDT_FRAME_HEADER);
+    memcpy(s->data + s->size + RDT_FRAME_HEADER, buf, n);
+    s->size += RDT_FRAME_HEADER + n;
+    s->priority = priority;
+    r = 0;
+  }
+  pthread_mutex_unlock(&set->lock);
+  return r;
+}
+
+/**
+ * Sends what's queued on G_conn's streams, until all of it is acknowledged.
+ * @return 0 if it was, -1 if the connection failed.
+ */
+int rdtStreamFlush() {
+  return rdtStreamFlush_r(G_conn);
+}
+
+/**
+ * rdtStreamFlush() on a connection opened with rdtConnect_r(). The next chunk is picked as each one
+ * is acknowledged, so messages queued meanwhile are sent too, by their priority.
+ * @param c The connection.
+ * @return 0 if everything queued was acknowledged, -1 if the connection failed.
+ */
+int rdtStreamFlush_r(RdtState_t* c) {
+  RdtStreams_t* set = c->stream_set;
+  sigset_t mask;
+
+  if (!c->streams || set == NULL) {
+    return -1;
+  }
+
+  holdConnection(c, &mask);
+  while (c->state != RDT_STATE_CLOSED) {
+    if (c->state != RDT_STATE_ESTABLISHED) {
+      waitConnection(c, &mask);
+      continue;
+    }
+
+    /* The chunk in flight has been acknowledged */
+    if (set->in_flight >= 0) {
+      pthread_mutex_lock(&set->lock);
+      RdtStream_t* s = &set->stream[set->in_flight];
+      s->sent += set->chunk_size;
+      if (s->sent == s->size) {
+        s->offset += s->size;
+        s->size = 0;
+        s->sent = 0;
       }
+      pthread_mutex_unlock(&set->lock);
+      set->in_flight = -1;
+    }
+
+    if (!nextChunk(c)) {
       break;
+    }
+    fsmInput(c, RDT_INPUT_SEND);
+  }
+  releaseConnection(c, &mask);
 
-    /* SYN_SENT */
-    case RDT_STATE_SYN_SENT:
-      switch(input) {
-
-        /* RCV SYN_ACK */
-        case RDT_EVENT_RCV_SYN_ACK: {
-          G_state = RDT_STATE_ESTABLISHED;
-          T_rto = 0;
-          G_avg_rtt = 0;
-          G_rtt_counter = 0;
-          break;
-        }
+  c->buf = NULL;
+  c->buf_size = 0;
+  return c->state == RDT_STATE_ESTABLISHED ? 0 : -1;
+}
 
-        /* TIMEOUT */
-        case RDT_EVENT_RTO: {
-          G_state = RDT_STATE_CLOSED;
+/**
+ * Iterates over the messages received on one stream of G_conn.
+ * @param stream The stream.
+ * @param offset Position of the next message in the stream. Start at 0; updated on each call.
+ * @param n Set to the size of the message.
+ * @return Pointer to the message, or NULL when there are no more.
+ */
+uint8_t* rdtNextStreamMessage(uint16_t stream, uint32_t* offset, uint32_t* n) {
+  return rdtNextStreamMessage_r(G_conn, stream, offset, n);
+}
 
-          if (G_retries < RDT_MAX_RETRIES) {
-            G_retries++;
-            T_rto = T_rto * 2 > MAX_RTO ? MAX_RTO : T_rto * 2;  // Double RTO
-            goto open;
-          }
+/**
+ * rdtNextStreamMessage() on a given connection.
+ * @param c The connection.
+ * @param stream The stream.
+ * @param offset Position of the next message in the stream. Start at 0; updated on each call.
+ * @param n Set to the size of the message.
+ * @return Pointer to the message, or NULL when there are no more.
+ */
+uint8_t* rdtNextStreamMessage_r(const RdtState_t* c, uint16_t stream, uint32_t* offset, uint32_t* n) {
+  if (c->stream_set == NULL || stream >= RDT_STREAMS || c->stream_set->stream[stream].data == NULL) {
+    return NULL;
+  }
 
-          G_packet = createPacket(RST, 0, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+  const RdtStream_t* s = &c->stream_set->stream[stream];
+  return nextFrame(s->data, s->size, offset, n);
+}
 
-          output = RDT_ACTION_SND_RST;
-          free(G_packet);
-          G_state = RDT_STATE_CLOSED;
-          break;
-        }
+/**
+ * What the receiver sent back on the last full-duplex connection of G_conn.
+ * @param n Set to the size of the reply.
+ * @return Pointer to the reply, or NULL if there wasn't a complete one.
+ */
+uint8_t* rdtReply(uint32_t* n) {
+  return rdtReply_r(G_conn, n);
+}
 
-        /* DEFAULT / ALL OTHER PACKET TYPES */
-        default: {
-          /* Create and send RST */
-          G_packet = createPacket(RST, 0, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+/**
+ * rdtReply() on a given connection.
+ * @param c The connection, closed.
+ * @param n Set to the size of the reply.
+ * @return Pointer to the reply, which the connection keeps until its next transfer, or NULL if the
+ * receiver didn't take up full duplex, or the reply didn't arrive complete.
+ */
+uint8_t* rdtReply_r(const RdtState_t* c, uint32_t* n) {
+  const RdtState_t* reverse = c->reverse;
 
-          /* Remain in SYN_SENT state */
-          G_state = RDT_STATE_SYN_SENT;
-          output = RDT_ACTION_SND_RST;
-          free(G_packet);
-          break;
-      }
+  if (reverse == NULL || reverse->sender || !reverse->complete) {
+    return NULL;
+  }
 
-      }
-      break;
+  *n = reverse->seq_no - reverse->seq_init;
+  return reverse->buf;
+}
 
-    /* ESTABLISHED */
-    case RDT_STATE_ESTABLISHED:
-      switch (input) {
-
-        /* SEND */
-        send:
-        case RDT_INPUT_SEND:
-        {
-          /* Create packet */
-          G_packet = createPacket(DATA, G_seq_no, G_buf);
-
-          /* Calculate RTO based on previous RTT, or use default value of 1s. */
-          uint32_t curr_rto = T_rto;
-          if (G_seq_no == G_seq_init) {
-            curr_rto = MIN_RTO;
-          }
+/**
+ * Gets the statistics of the current connection, or of the last one once it has closed.
+ * @param stats Filled in with a copy of the counters.
+ */
+void rdtGetStats(RdtStats_t* stats) {
+  rdtGetStats_r(G_conn, stats);
+}
 
-          /* Start RTT timer. */
-          if (clock_gettime(CLOCK_REALTIME, &G_timestamp) != 0) {
-            perror("Couldn't start RTT timer.");
-          }
+/**
+ * rdtGetStats() for a given connection.
+ * @param c The connection.
+ * @param stats Filled in with a copy of the counters.
+ */
+void rdtGetStats_r(RdtState_t* c, RdtStats_t* stats) {
+  sigset_t mask;
+
+  /* Copy with signals blocked, so the handlers don't update the counters halfway through */
+  holdConnection(c, &mask);
+  *stats = c->stats;
+  if (c->state != RDT_STATE_CLOSED) {
+    stats->rto = c->rto.T_rto;
+  }
+  if (c->reverse != NULL) {
+    addStats(stats, &c->reverse->stats);
+  }
+  releaseConnection(c, &mask);
+}
 
-          /* Send packet*/
-          size = sizeof(RdtHeader_t) + ntohs(G_packet->header.size);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+/**
+ * Prints statistics from rdtGetStats() in a readable form.
+ * @param out Where to print to.
+ * @param stats The statistics to print.
+ */
+void rdtPrintStats(FILE* out, const RdtStats_t* stats) {
+  fprintf(out, "Packets:     %u sent, %u received\n", stats->packets_sent, stats->packets_received);
+  fprintf(out, "Data:        %u segments (%" PRIu64 " bytes) sent, %u segments (%" PRIu64 " bytes) received, %u duplicate\n",
+          stats->segments_sent, stats->bytes_sent, stats->segments_received, stats->bytes_received, stats->segments_duplicate);
+  fprintf(out, "ACKs:        %u sent, %u piggybacked on DATA\n", stats->acks_sent, stats->acks_piggybacked);
+  if (stats->messages_abandoned > 0) {
+    fprintf(out, "Messages:    %u abandoned at their deadline\n", stats->messages_abandoned);
+  }
+  fprintf(out, "Retransmits: %u on RTO, %u on ACK, %u SYN, %u FIN\n",
+          stats->retransmits_rto, stats->retransmits_ack, stats->retransmits_syn, stats->retransmits_fin);
+  fprintf(out, "Errors:      %u bad checksums, %u RST sent, %u RST received\n",
+          stats->checksum_failures, stats->rst_sent, stats->rst_received);
+  fprintf(out, "RTO:         %.3fms\n", US_TO_MS(stats->rto));
 
-          /* Set ITIMER for RTO. */
-          if (setITIMER(RTO_TO_SEC(curr_rto), RTO_TO_USEC(curr_rto)) != 0) {
-            perror("Couldn't set RTO");
-          }
+  if (stats->rtt_samples == 0) {
+    return;
+  }
 
-          /* Update state, sequence number, output (for fsm debug), etc. */
-          G_prev_size = ntohs(G_packet->header.size);
-          G_state = RDT_STATE_DATA_SENT;
-          G_seq_no += (uint32_t) ntohs(G_packet->header.size);
-          output = RDT_ACTION_SND_DATA;
-          free(G_packet);
-          break;
-        }
+  fprintf(out, "RTT:         %u samples, min %.3fms, max %.3fms\n", stats->rtt_samples,
+          US_TO_MS(stats->rtt_min), US_TO_MS(stats->rtt_max));
+  for (int i = 0; i < RDT_RTT_BUCKETS; i++) {
+    uint32_t low = 1u << i;
+    uint32_t high = 2u << i;
+    if (stats->rtt_histogram[i] > 0) {
+      fprintf(out, "  %10.3fms - %10.3fms: %u\n", US_TO_MS(low), US_TO_MS(high), stats->rtt_histogram[i]);
+    }
+  }
+}
 
-        /* RECEIVE DATA */
-        case RDT_EVENT_RCV_DATA: {
-          if (!G_checksum_match) {
-            /* Create and send ACK packet */
-            G_packet = createPacket(ACK, G_seq_no, NULL);
-            size = sizeof(RdtHeader_t);
-            if (sendRdtPacket(G_socket, G_packet, size) != size) {
-              errno = ECOMM;
-              perror("Error sending RDT packet.");
-              if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-            }
-
-            output = RDT_ACTION_SND_ACK;
-            free(G_packet);
-            break;
-          }
+/**
+ * Cleans up and closes the underlying UDP sockets.
+ * @param socket The socket to close.
+ */
+void closeRdtSocket_t(RdtSocket_t* socket) {
+  if (socket->paths != NULL && socket->in_flight) {
+    pathRelease(socket->paths, socket->path);
+  }
+  closeUdp(socket->local);
+  closeUdp(socket->remote);
+  free(socket);
+}
+/* API END */
 
-          /* Discard packet if the sequence number is lower than expected */
-          if (received->header.sequence < G_seq_no) {
-            G_seq_no = received->header.sequence;
-          }
 
-          /* ACK the expected sequence number if received sequence number is greater
-           * than expected. This means a DATA packet has likely been dropped */
-          if (received->header.sequence > G_seq_no) {
-            /* Create and send packet */
-            G_packet = createPacket(ACK, G_seq_no, NULL);
-            size = sizeof(RdtHeader_t);
-            if (sendRdtPacket(G_socket, G_packet, size) != size) {
-              errno = ECOMM;
-              perror("Error sending RDT packet.");
-              if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-            }
-
-            /* Set output flag */
-            output = RDT_ACTION_SND_ACK;
-            free(G_packet);
-            break;
-          }
+/* SOCKETS START */
+/**
+ * Sets remote socket to hostname supplied. Allows accepting SYN initially, then setting remote hostname to whoever we
+ * received SYN from
+ * @param c The connection.
+ * @param hostname
+ * @return int 0 if success, -1 if failure.
+ */
+int setRemoteSocket(RdtState_t* c, char* hostname) {
+  UdpSocket_t* remote = setupUdpSocket_t(hostname, ntohs(c->socket->receive.addr.sin_port));
+  if (remote == (UdpSocket_t *) 0) {
+    errno = ENOTCONN;
+    perror("Couldn't setup remote UDP socket\n");
+    return -1;
+  }
 
-          /* Sequence number is expected, so can read the data into our buffer */
-          if (G_buf == NULL) {
-            G_buf_size = received->header.size;
-            G_buf = (uint8_t*) calloc(1, G_buf_size);
-            memcpy(G_buf, &(received->data), G_buf_size);
-          } else {
-            if (G_buf_size < (G_seq_no - G_seq_init) + received->header.size) {
-              G_buf = (uint8_t*) realloc(G_buf, G_buf_size * 2);
-              G_buf_size = G_buf_size * 2;
-            }
+  /* Reuse the one we have, so a server taking connection after connection doesn't leak them */
+  if (c->socket->remote != (UdpSocket_t *) 0) {
+    c->socket->remote->addr = remote->addr;
+    free(remote);
+  } else {
+    c->socket->remote = remote;
+  }
 
-            memcpy(G_buf + (G_seq_no - G_seq_init), &(received->data), received->header.size);
-          }
+  return 0;
+}
 
-          G_seq_no += received->header.size;
-          G_packet = createPacket(ACK, G_seq_no, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
 
-          G_state = RDT_STATE_ESTABLISHED;
-          output = RDT_ACTION_SND_ACK;
-          free(G_packet);
-          break;
-        }
+/* CONNECTION MANAGEMENT START */
+/**
+ * Open an RDT socket.
+ * @param c The connection.
+ * @param socket Uninitialised RDT socket.
+ */
+void rdtOpen(RdtState_t* c, RdtSocket_t* socket) {
+  sigset_t mask;
 
-        /* CLOSE INPUT */
-        close:
-        case RDT_INPUT_CLOSE: {
-          /* If this is the first attempt, set RTO to 200ms */
-          if (T_rto == 0) {
-            T_rto = HANDSHAKE_RTO;
-          }
+  attachSocket(c, socket);
 
-          G_packet = createPacket(FIN, G_seq_no, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+  /* Block signals while the FSM runs, so the SYN_ACK isn't handled before we're in SYN_SENT, and
+   * wait with sigsuspend() so a signal between the check and the wait isn't missed. */
+  holdConnection(c, &mask);
+  c->retries = 0;
+  resetStats(c);
+  fsmInput(c, RDT_INPUT_ACTIVE_OPEN);
 
-          /* Set ITIMER for RTO */
-          if (setITIMER(RTO_TO_SEC(T_rto), RTO_TO_USEC(T_rto)) != 0) {
-            perror("Couldn't set timeout");
-          }
+  while(c->state != RDT_STATE_ESTABLISHED  && c->state != RDT_STATE_CLOSED) {
+    waitConnection(c, &mask);
+  }
+  releaseConnection(c, &mask);
+}
 
-          G_state = RDT_STATE_FIN_SENT;
-          output = RDT_ACTION_SND_FIN;
-          free(G_packet);
-          break;
-        }
+/**
+ * Closes an RDT socket.
+ * @param c The connection.
+ */
+void rdtClose(RdtState_t* c) {
+  sigset_t mask;
 
-        /* RECEIVE FIN */
-        case RDT_EVENT_RCV_FIN: {
-          /* Create and send FIN ACK packet */
-          G_packet = createPacket(FIN_ACK, received->header.sequence, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+  holdConnection(c, &mask);
+  startClose(c);
 
-          G_state = RDT_STATE_CLOSED;
-          output = RDT_ACTION_SND_FIN_ACK;
-          free(G_packet);
-          setRemoteSocket(NULL);
-          printf("Done!\n");
-          break;
-        }
+  while(connectionOpen(c)) {
+    waitConnection(c, &mask);
+  }
+  releaseConnection(c, &mask);
+}
 
-        /* RECEIVE SYN */
-        case RDT_EVENT_RCV_SYN: {
-          goto syn;
-        }
+/**
+ * Starts closing a connection: keeps its RTT estimate for the next connection to the peer, and sends
+ * the FIN. Called with the connection held.
+ * @param c The connection.
+ */
+void startClose(RdtState_t* c) {
+  /* Remember the RTT estimate, so the next connection to this peer starts warm */
+  if (c->sender && c->state == RDT_STATE_ESTABLISHED) {
+    uint64_t elapsed = calculateRTT(&c->established);
+    uint64_t bytes = c->seq_no - c->seq_start;
+    rtoCacheStore(&c->rto, c->socket->remote->addr.sin_addr.s_addr, elapsed > 0 ? (uint32_t) (bytes * 1000000 / elapsed) : 0);
+  }
 
-      }
-      break;
+  /* Set RTO to 0 for termination, so the FIN starts from the handshake RTO. Stats keep the last one. */
+  c->stats.rto = c->rto.T_rto;
+  c->rto.T_rto = 0;
+  fsmInput(c, RDT_INPUT_CLOSE);
+}
+
+/**
+ * Makes a socket the connection's, and sets up what drives the connection: the signal handlers, or,
+ * if it's polled, a non-blocking socket for waitConnection() to poll.
+ * @param c The connection.
+ * @param socket The socket.
+ */
+void attachSocket(RdtState_t* c, RdtSocket_t* socket) {
+  c->socket = socket;
+
+  if (c->polled) {
+    if (fcntl(socket->local->sd, F_SETFL, fcntl(socket->local->sd, F_GETFL) | O_NONBLOCK) < 0) {
+      perror("Couldn't make socket non-blocking");
+    }
+    return;
+  }
 
-    /* DATA_SENT */
-    case RDT_STATE_DATA_SENT:
-      switch (input) {
+  /* Setup SIGIO to handle network events. */
+  setupSIGIO(socket->local->sd, handleSIGIO);
+  setupSIGALRM(handleSIGALRM);
+}
+/* CONNECTION MANAGEMENT CLOSE */
 
-        /* RECEIVE ACK */
-        case RDT_EVENT_RCV_ACK: {
-          /* Calculate the RTT in microseconds */
-          G_rtt = calculateRTT(&G_timestamp);
 
-          /* Calculate averate RTT */
-          if (G_rtt_counter > 0) {
-            double temp = G_rtt + (G_avg_rtt * G_rtt_counter);
-            G_rtt_counter++;
-            G_avg_rtt = (double) (temp / G_rtt_counter);
-          } else {
-            G_avg_rtt = (double) G_rtt;
-            G_rtt_counter = 1;
-          }
+/* PACKETS START */
+/**
+ * Receive an RDT packet from the connection's socket.
+ * @param c The connection.
+ * @param intact Set to whether the packet's checksum matched.
+ * @return Pointer to RdtPacket_t, or NULL if there are no more datagrams waiting.
+ */
+RdtPacket_t* recvRdtPacket(RdtState_t* c, bool* intact) {
+  int n;
 
-          /* Calculate next RTO */
-          calculateRTO(G_rtt);
+  RdtPacket_t* packet = readDatagram(c->socket, &n);
+  if (packet != NULL) {
+    *intact = unpackDatagram(c, packet, n);
+  }
+  return packet;
+}
 
-          /* If the whole buffer hasn't been sent, send the next packet. */
-          if ((G_seq_no - G_seq_init) < G_buf_size) {
-            if (received->header.sequence < G_seq_no) {
-              G_seq_no = received->header.sequence;
-            }
+/**
+ * Reads the next datagram waiting on a socket, as it arrived. Its source is left in socket->receive.
+ * @param socket The socket.
+ * @param n Set to the size of the datagram.
+ * @return Pointer to RdtPacket_t, header in network byte order, or NULL if there are no more datagrams waiting.
+ */
+RdtPacket_t* readDatagram(RdtSocket_t* socket, int* n) {
+  int r;
+  int size = sizeof(RdtPacket_t);
 
-            G_retries = 0;
-            goto send;
-          }
+  /* Create UdpBuffer_t to receive datagram */
+  UdpBuffer_t buffer;
+  uint8_t bytes[size];
+  buffer.bytes = bytes;
+  buffer.n = size;
 
-          /* If whole buffer has been sent, return to the established state. */
-          G_state = RDT_STATE_ESTABLISHED;
-          G_retries = 0;
+  /* Receive UDP datagram */
+  r = recvUdp(socket->local, &(socket->receive), &buffer);
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Couldn't receive RDT packet");
+    return (RdtPacket_t*) 0;
+  }
+  pcapPacket(&socket->receive.addr, &socket->local->addr, buffer.bytes, r);
 
-          /* Set RTO to 0 for termination */
-          T_rto = 0;
-          break;
-        }
+  /* Create RdtPacket_t and copy bytes */
+  RdtPacket_t* packet = calloc(1, size);
+  memcpy(packet, buffer.bytes, r);
 
-        /* CLOSE INPUT */
-        case RDT_INPUT_CLOSE: {
-          goto close;
-        }
+  *n = r;
+  return packet;
+}
 
-        /* RTO */
-        case RDT_EVENT_RTO: {
-          if (G_retries < RDT_MAX_RETRIES) {
-            G_retries++;  // Increment retries counter
-            G_seq_no -= G_prev_size;  // Reduce sequence number to last ACK'd.
-            T_rto = T_rto * 2 > MAX_RTO ? MAX_RTO : T_rto * 2;  // Double RTO
-            goto send;
-          }
+/**
+ * Checks a datagram from readDatagram() and converts its header to host byte order, counting it
+ * against the connection it belongs to.
+ * @param c The connection.
+ * @param packet The datagram.
+ * @param n The size of the datagram.
+ * @return bool Whether the packet's checksum matched and its size fits the datagram.
+ */
+bool unpackDatagram(RdtState_t* c, RdtPacket_t* packet, int n) {
+  /* Calculate expected checksum and compare */
+  uint16_t checksum = packet->header.checksum;
+  packet->header.checksum = 0;
+  uint16_t expected = ipv4_header_checksum(packet, n);
 
-          G_state = RDT_STATE_CLOSED;
-          break;
-        }
+  bool intact = (expected == checksum);
+  c->stats.packets_received++;
+  c->stats.checksum_failures += !intact;
 
-      }
-      break;
+  /* Convert header fields to host byteorder */
+  packet->header.sequence = ntohl(packet->header.sequence);
+  packet->header.size = ntohs(packet->header.size);
+  packet->header.type = ntohs(packet->header.type);
+  packet->header.timestamp = ntohl(packet->header.timestamp);
+  packet->header.echo = ntohl(packet->header.echo);
+  packet->header.ack = ntohl(packet->header.ack);
+  packet->header.window = ntohs(packet->header.window);
+  packet->header.checksum = checksum;
 
-    /* FIN_SENT */
-    case RDT_STATE_FIN_SENT:
-      switch(input) {
+  /* The size is the peer's to set, so it can't be trusted any more than the checksum. Handlers read
+   * that many bytes of payload, and must only find what arrived. */
+  if (n < (int) sizeof(RdtHeader_t) || packet->header.size > n - (int) sizeof(RdtHeader_t) ||
+      packet->header.size > RDT_MAX_SIZE) {
+    intact = false;
+  }
 
-        /* RECEIVE FIN ACK */
-        case RDT_EVENT_RCV_FIN_ACK: {
-          G_state = RDT_STATE_CLOSED;
-          printf("Connection terminated gracefully!\n");
-          break;
-        }
+  /* Remember the timestamp to echo. Not from a corrupt packet, whose timestamp can't be trusted. */
+  if (intact) {
+    c->ts_recent = packet->header.timestamp;
+  }
 
-        /* RTO */
-        case RDT_EVENT_RTO: {
-          if (G_retries < RDT_MAX_RETRIES) {
-            G_retries++;
-            T_rto = T_rto * 2 > MAX_RTO ? MAX_RTO : T_rto * 2;  // Double RTO
-            goto close;
-          }
+  return intact;
+}
 
-          /* Create and send packet */
-          G_packet = createPacket(RST, 0, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+/**
+ * Sends an RdtPacket_t over the connection's socket.
+ * @param c The connection.
+ * @param packet Pointer to the packet to send.
+ * @param n The size of 'packet' (header + data).
+ * @return Number of bytes sent.
+ */
+int sendRdtPacket(RdtState_t* c, RdtPacket_t* packet, const uint16_t n) {
+  const RdtSocket_t* socket = c->socket;
+  UdpBuffer_t buffer;
+  uint8_t bytes[n];
 
-          /* Update state, etc */
-          G_state = RDT_STATE_CLOSED;
-          output = RDT_ACTION_SND_RST;
-          free(G_packet);
-          printf("Unable to terminate gracefully. Terminating abruptly!\n");
-          break;
-        }
+  c->stats.packets_sent++;
+  if (packet->header.type == htons(DATA)) {
+    c->stats.segments_sent++;
+    c->stats.bytes_sent += n - sizeof(RdtHeader_t);
+  } else if (packet->header.type == htons(ACK)) {
+    c->stats.acks_sent++;
+  } else if (packet->header.type == htons(RST)) {
+    c->stats.rst_sent++;
+  }
 
-        /* DEFAULT */
-        default: {
-          G_packet = createPacket(RST, 0, NULL);
-          size = sizeof(RdtHeader_t);
-          if (sendRdtPacket(G_socket, G_packet, size) != size) {
-            errno = ECOMM;
-            perror("Error sending RDT packet.");
-            if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-          }
+  memcpy(bytes, packet, n);
+  buffer.n = n;
+  buffer.bytes = bytes;
+  if (socket->paths != NULL) {
+    return sendOnPath(socket, &buffer);
+  }
+  pcapPacket(&socket->local->addr, &socket->remote->addr, bytes, n);
 
-          G_state = RDT_STATE_CLOSED;
-          output = RDT_ACTION_SND_RST;
-          free(G_packet);
-        }
+  return sendUdp(socket->local, socket->remote, &buffer);
+}
 
-      }
-      break;
+/**
+ * Creates an RDTPacket for a given type, sequence number and (optional) data.
+ * @param c The connection.
+ * @param type The RDTPacketType_t of the packet to create.
+ * @param seq_no The uint16_t sequence number to give the packet.
+ * @param data (Optional) pointer to uint8_t data. Should be NULL if type is not DATA. A message's length
+ * prefix in c->frame goes ahead of it.
+ * @return Pointer to created RdtPacket_t.
+ */
+RdtPacket_t* createPacket(RdtState_t* c, RDTPacketType_t type, uint32_t seq_no, uint8_t* data) {
+  uint16_t n = 0;
 
-    default:
-      /* Create and send RST packet */
-      G_packet = createPacket(RST, 0, NULL);
-      size = sizeof(RdtHeader_t);
-      if (sendRdtPacket(G_socket, G_packet, size) != size) {
-        errno = ECOMM;
-        perror("Error sending RDT packet.");
-        if (G_errors++ > RDT_MAX_ERROR) exit(errno);
-      }
+  /* Allocate memory for packet. Set type and sequence number. Zero checksum value. */
+  RdtPacket_t* packet = (RdtPacket_t *) calloc(1, sizeof(RdtPacket_t));
+  packet->header.type = htons(type);
+  packet->header.sequence = htonl(seq_no);
+  packet->header.timestamp = htonl(rtoTimestamp());
+  packet->header.echo = htonl(c->ts_recent);
+  packet->header.checksum = htons(0);
+
+  /* Full duplex: what we send carries the window of the other direction, and a DATA its ACK too */
+  RdtState_t* receiving = c->sender && c->reverse != NULL ? c->reverse : c;
+  packet->header.window = htons(advertisedWindow(receiving));
+  if (receiving != c && type == DATA) {
+    packet->header.ack = htonl(receiving->seq_no);
+    if (receiving->ack_pending) {
+      receiving->ack_pending = false;
+      receiving->stats.acks_piggybacked++;
+    }
+  }
+
+  /* Calculate the header field value */
+  if (data != NULL) {
+    uint32_t diff = c->buf_size - (c->seq_no - c->seq_init);
+
+    if (diff > RDT_MAX_SIZE) {
+      n = RDT_MAX_SIZE;
+    } else {
+      n = diff;
+    }
+
+    /* Never more than the receiver can take. With a zero window, this is a probe. */
+    if (n > c->snd_wnd) {
+      n = (uint16_t) c->snd_wnd;
+    }
+
+    /* What's left of a message's length prefix, then the data after it */
+    uint32_t at = c->seq_no - c->seq_init;
+    uint16_t prefix = 0;
+    if (at < c->frame_size) {
+      prefix = c->frame_size - at < n ? (uint16_t) (c->frame_size - at) : n;
+      memcpy(packet->data, c->frame + at, prefix);
+    }
+    if (n > prefix) {
+      memcpy(packet->data + prefix, data + (at + prefix - c->frame_size), n - prefix);
+    }
+  }
+
+  /* Set header size and checksum */
+  packet->header.size = htons(n);
+  packet->header.checksum = ipv4_header_checksum(packet, sizeof(RdtHeader_t) + n);
+  return packet;
+}
+
+/**
+ * Appends a TLV option to the payload of a SYN or SYN_ACK created by createPacket().
+ * @param packet The packet to add the option to. Header must be in network byte order.
+ * @param kind The RDT_OPT_* kind.
+ * @param value Pointer to the option value.
+ * @param len The size of 'value'.
+ */
+void addOption(RdtPacket_t* packet, uint8_t kind, const void* value, uint8_t len) {
+  uint16_t n = ntohs(packet->header.size);
 
-      /* Update state etc */
-      G_state = RDT_STATE_CLOSED;
-      output = RDT_ACTION_SND_RST;
-      free(G_packet);
-      G_state = RDT_INVALID;
+  if (n + 2 + len > RDT_MAX_SIZE) {
+    return;
+  }
+
+  packet->data[n] = kind;
+  packet->data[n + 1] = len;
+  if (len > 0) {
+    memcpy(&packet->data[n + 2], value, len);
   }
+  n += 2 + len;
 
-  DEBUG("new_state=%-12s output=%-12s \n", fsm_strings[G_state], fsm_strings[output]);
-  printProgress(input);
+  /* Update header size and checksum */
+  packet->header.size = htons(n);
+  packet->header.checksum = 0;
+  packet->header.checksum = ipv4_header_checksum(packet, sizeof(RdtHeader_t) + n);
 }
 
+/**
+ * Appends the first bytes of the send buffer to a SYN, after its options, so small transfers don't
+ * wait a round trip for the SYN_ACK. Only plain transfers qualify: the other modes need the
+ * handshake to finish before the data is known.
+ * @param c The connection.
+ * @param packet The SYN to add data to. Header must be in network byte order.
+ * @return The number of bytes added.
+ */
+uint16_t addEarlyData(RdtState_t* c, RdtPacket_t* packet) {
+  uint16_t n = ntohs(packet->header.size);
+  uint16_t early;
+
+  if (c->buf == NULL || c->buf_size == 0 || c->compress || c->delta || c->framed || c->transfer_id != 0) {
+    return 0;
+  }
+
+  /* EARLY_DATA option (4 bytes) and END marker come first */
+  if (n + 5 >= RDT_MAX_SIZE) {
+    return 0;
+  }
+  early = c->buf_size < (uint32_t) (RDT_MAX_SIZE - n - 5) ? (uint16_t) c->buf_size : RDT_MAX_SIZE - n - 5;
+
+  uint16_t length = htons(early);
+  addOption(packet, RDT_OPT_EARLY_DATA, &length, sizeof(length));
+  n = ntohs(packet->header.size);
+  packet->data[n] = RDT_OPT_END;
+  memcpy(&packet->data[n + 1], c->buf, early);
+  n += 1 + early;
+
+  /* Update header size and checksum */
+  packet->header.size = htons(n);
+  packet->header.checksum = 0;
+  packet->header.checksum = ipv4_header_checksum(packet, sizeof(RdtHeader_t) + n);
+  return early;
+}
+
+/**
+ * Parses the TLV options of a received SYN or SYN_ACK, updating the negotiated connection state.
+ * @param c The connection.
+ * @param packet The received packet. Header must be in host byte order.
+ * @return Number of payload bytes taken up by options.
+ */
+uint16_t parseOptions(RdtState_t* c, const RdtPacket_t* packet) {
+  uint16_t i = 0;
+  uint16_t n = packet->header.size > RDT_MAX_SIZE ? RDT_MAX_SIZE : packet->header.size;
+
+  while (i + 2 <= n && packet->data[i] != RDT_OPT_END) {
+    uint8_t kind = packet->data[i];
+    uint8_t len = packet->data[i + 1];
+    const uint8_t* value = &packet->data[i + 2];
+
+    if (i + 2 + len > n) {
+      break;
+    }
+
+    switch (kind) {
+      /* Receiver picks one of the offered codecs; sender adopts the pick if it supports it */
+      case RDT_OPT_CODECS:
+        if (len == 1) {
+          c->codec = c->sender ? (value[0] & supportedCodecs()) : chooseCodec(value[0]);
+        }
+        break;
+
+      /* Position of this transfer within the output file. In a SYN_ACK, where to resume from. */
+      case RDT_OPT_OFFSET:
+        if (len == sizeof(uint64_t)) {
+          uint64_t offset;
+          memcpy(&offset, value, sizeof(offset));
+          if (c->sender) {
+            c->resume_offset = be64toh(offset);
+          } else {
+            c->offset = be64toh(offset);
+          }
+        }
+        break;
+
+      /* Delta mode block size. Receiver accepts if it has a basis; sender adopts the echo. */
+      case RDT_OPT_DELTA:
+        if (len == sizeof(uint32_t) && (c->sender || c->delta)) {
+          uint32_t block;
+          memcpy(&block, value, sizeof(block));
+          block = ntohl(block);
+          if (block >= DELTA_MIN_BLOCK && block <= DELTA_MAX_BLOCK) {
+            c->delta_block = block;
+          }
+        }
+        break;
+
+      /* Persistent connection carrying framed messages. Receiver always accepts. */
+      case RDT_OPT_FRAMED:
+        c->framed = true;
+        break;
+
+      /* Messages may be abandoned at their deadline. Receiver always accepts; sender adopts the echo. */
+      case RDT_OPT_PARTIAL:
+        c->partial = true;
+        break;
+
+      /* Messages go on streams, as chunks. Receiver always accepts; sender adopts the echo. */
+      case RDT_OPT_STREAMS:
+        c->streams = true;
+        break;
+
+      /* Packets may come from any of the sender's addresses. Receiver accepts unless it finds
+       * connections by address; sender adopts the echo. */
+      case RDT_OPT_MULTIPATH:
+        c->multipath = true;
+        break;
+
+      /* Data carried in the SYN. In a SYN_ACK, how much of it the receiver accepted. */
+      case RDT_OPT_EARLY_DATA:
+        if (len == sizeof(uint16_t)) {
+          uint16_t early;
+          memcpy(&early, value, sizeof(early));
+          early = ntohs(early);
+          if (c->sender) {
+            c->seq_no = c->seq_init + (early < c->early ? early : c->early);
+          } else {
+            c->early = early;
+          }
+        }
+        break;
+
+      /* Bytes in the transfer, from its offset. Left out for a stream of messages. */
+      case RDT_OPT_LENGTH:
+        if (len == sizeof(uint64_t) && !c->sender) {
+          uint64_t length;
+          memcpy(&length, value, sizeof(length));
+          c->length = be64toh(length);
+        }
+        break;
+
+      /* Receive windows, and the scale of the peer's */
+      case RDT_OPT_WINDOW:
+        if (len == 1 && value[0] <= 16) {
+          c->windowed = true;
+          c->snd_shift = value[0];
+        }
+        break;
+
+      /* Full duplex. In a SYN_ACK, the initial sequence number and length of what comes back. */
+      case RDT_OPT_DUPLEX:
+        if (!c->sender) {
+          c->duplex = true;
+        } else if (c->duplex && c->reverse == NULL && len == sizeof(uint32_t) + sizeof(uint64_t)) {
+          uint32_t seq_init;
+          uint64_t length;
+          memcpy(&seq_init, value, sizeof(seq_init));
+          memcpy(&length, value + sizeof(seq_init), sizeof(length));
+          openReverse(c, ntohl(seq_init), be64toh(length));
+        }
+        break;
+
+      /* Identifies a resumable transfer */
+      case RDT_OPT_TRANSFER_ID:
+        if (len == sizeof(uint64_t) && !c->sender) {
+          uint64_t id;
+          memcpy(&id, value, sizeof(id));
+          c->transfer_id = be64toh(id);
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    i += 2 + len;
+  }
+
+  return i;
+}
+/* PACKETS END */
+
+
+/* STATS START */
+/**
+ * Adds the counters of the other direction of a full-duplex connection to its statistics.
+ * @param to The connection's statistics.
+ * @param from The other direction's.
+ */
+void addStats(RdtStats_t* to, const RdtStats_t* from) {
+  to->bytes_sent += from->bytes_sent;
+  to->bytes_received += from->bytes_received;
+  to->packets_sent += from->packets_sent;
+  to->packets_received += from->packets_received;
+  to->segments_sent += from->segments_sent;
+  to->segments_received += from->segments_received;
+  to->segments_duplicate += from->segments_duplicate;
+  to->retransmits_rto += from->retransmits_rto;
+  to->retransmits_ack += from->retransmits_ack;
+  to->retransmits_syn += from->retransmits_syn;
+  to->retransmits_fin += from->retransmits_fin;
+  to->checksum_failures += from->checksum_failures;
+  to->rst_sent += from->rst_sent;
+  to->rst_received += from->rst_received;
+  to->acks_sent += from->acks_sent;
+  to->acks_piggybacked += from->acks_piggybacked;
+  to->messages_abandoned += from->messages_abandoned;
+
+  if (from->rtt_samples > 0) {
+    to->rtt_min = to->rtt_samples == 0 || from->rtt_min < to->rtt_min ? from->rtt_min : to->rtt_min;
+    to->rtt_max = from->rtt_max > to->rtt_max ? from->rtt_max : to->rtt_max;
+    to->rtt_samples += from->rtt_samples;
+    for (int i = 0; i < RDT_RTT_BUCKETS; i++) {
+      to->rtt_histogram[i] += from->rtt_histogram[i];
+    }
+  }
+}
+
+/**
+ * Zeroes the statistics at the start of a connection.
+ * @param c The connection.
+ */
+void resetStats(RdtState_t* c) {
+  memset(&c->stats, 0, sizeof(c->stats));
+}
+
+/**
+ * Adds an RTT sample to the statistics. The histogram bucket is the sample's highest set bit.
+ * @param c The connection.
+ * @param rtt The RTT sample in microseconds.
+ */
+void recordRTT(RdtState_t* c, uint32_t rtt) {
+  int bucket = 31 - __builtin_clz(rtt | 1);
+
+  c->stats.rtt_histogram[bucket < RDT_RTT_BUCKETS ? bucket : RDT_RTT_BUCKETS - 1]++;
+  if (c->stats.rtt_samples == 0 || rtt < c->stats.rtt_min) {
+    c->stats.rtt_min = rtt;
+  }
+  if (rtt > c->stats.rtt_max) {
+    c->stats.rtt_max = rtt;
+  }
+  c->stats.rtt_samples++;
+}
+/* STATS END */
+
+
+/* RECEIVE BUFFER START */
+/**
+ * Whether received data goes straight to out_fd. Compressed, delta and framed streams are buffered,
+ * as they can only be processed once complete.
+ * @param c The connection.
+ * @return true if writing through to out_fd.
+ */
+bool writeThrough(const RdtState_t* c) {
+  return c->out_fd >= 0 && c->codec == RDT_CODEC_NONE && c->delta_block == 0 && !c->framed;
+}
+
+/**
+ * Stores the next in-order segment. Stages it for writeStaged() to write to the output file at its
+ * position (positioned writes, so stripes can land in any order), or reads the data into our buffer.
+ * Compressed data is buffered as it can only be decoded once complete.
+ * @param c The connection.
+ * @param data The segment's data.
+ * @param n The size of 'data'.
+ * @return true if stored and seq_no advanced, false if it couldn't be written.
+ */
+bool storeSegment(RdtState_t* c, const uint8_t* data, uint16_t n) {
+  if (writeThrough(c) && c->stage != NULL) {
+    uint32_t received = c->seq_no - c->seq_init;
+    if (received - c->written + n > RDT_STAGE_SIZE) {
+      return false; // Past the window we advertised.
+    }
+
+    uint32_t at = received % RDT_STAGE_SIZE;
+    uint32_t first = RDT_STAGE_SIZE - at < n ? RDT_STAGE_SIZE - at : n;
+    memcpy(c->stage + at, data, first);
+    memcpy(c->stage, data + first, n - first);
+  } else if (writeThrough(c)) {
+    off_t position = (off_t) (c->offset + (c->seq_no - c->seq_init));
+    if (pwrite(c->out_fd, data, n, position) != n) {
+      perror("Couldn't write to output file");
+      return false;
+    }
+  } else if (c->buf == NULL) {
+    c->buf_size = n;
+    c->buf = (uint8_t*) calloc(1, c->buf_size > 0 ? c->buf_size : 1);
+    memcpy(c->buf, data, n);
+  } else {
+    if (!growBuffer(c, (c->seq_no - c->seq_init) + n)) {
+      return false;
+    }
+
+    memcpy(c->buf + (c->seq_no - c->seq_init), data, n);
+  }
+
+  c->seq_no += n;
+  c->stats.segments_received++;
+  c->stats.bytes_received += n;
+
+  /* Periodically make written data durable, so a resumed transfer can skip it. Staged data is
+   * checkpointed once writeStaged() has written it. */
+  if (writeThrough(c) && c->stage == NULL && c->checkpoint_path != NULL && c->transfer_id != 0 &&
+      c->seq_no - c->checkpoint_seq >= RDT_CHECKPOINT_INTERVAL) {
+    commitCheckpoint(c, c->offset + (c->seq_no - c->seq_init));
+  }
+  return true;
+}
+
+/**
+ * Grows the receive buffer, doubling it, until it holds 'size' bytes.
+ * @param c The connection.
+ * @param size Bytes of the transfer the buffer must hold.
+ * @return true if it does, false if out of memory or it's too big.
+ */
+bool growBuffer(RdtState_t* c, uint32_t size) {
+  uint32_t capacity = c->buf != NULL ? c->buf_size : 0;
+
+  if (capacity >= size) {
+    return true;
+  }
+  while (capacity < size) {
+    if (capacity > UINT32_MAX / 2) {
+      return false; // Doubling would wrap around.
+    }
+    capacity = capacity > 0 ? capacity * 2 : RDT_MAX_SIZE;
+  }
+
+  uint8_t* buf = (uint8_t*) realloc(c->buf, capacity);
+  if (buf == NULL) {
+    return false;
+  }
+  c->buf = buf;
+  c->buf_size = capacity;
+  return true;
+}
+
+/**
+ * Reserves room for a transfer whose length the sender announced, so it's stored without growing
+ * anything. The output file gets the blocks up to 'end' allocated in one go (its size is left alone,
+ * so an interrupted transfer doesn't leave zeros behind), and a buffer in memory is allocated at its
+ * final size. A compressed transfer is at most CODEC_HEADER_SIZE bigger than its data. A delta's size
+ * isn't known until it's encoded, so its buffer still grows.
+ * @param c The connection.
+ * @param end File position the transfer ends at.
+ */
+void reserveTransfer(RdtState_t* c, uint64_t end) {
+  if (end <= c->offset) {
+    return;
+  }
+
+  if (c->out_fd >= 0 && fallocate(c->out_fd, FALLOC_FL_KEEP_SIZE, (off_t) c->offset, (off_t) (end - c->offset)) != 0 &&
+      errno != EOPNOTSUPP && errno != ENOSYS) {
+    perror("Couldn't preallocate output file");
+  }
+
+  if (writeThrough(c) || c->framed || c->delta_block != 0 || end - c->offset > UINT32_MAX - CODEC_HEADER_SIZE) {
+    return;
+  }
+
+  uint32_t size = (uint32_t) (end - c->offset) + (c->codec != RDT_CODEC_NONE ? CODEC_HEADER_SIZE : 0);
+  if (c->buf == NULL || c->buf_size < size) {
+    free(c->buf);
+    c->buf = (uint8_t*) malloc(size);
+    c->buf_size = c->buf != NULL ? size : 0;
+  }
+}
+
+/**
+ * Writes data staged by storeSegment() to out_fd. Runs outside the signal handlers, so a slow disk
+ * doesn't hold up ACKs: the window shrinks instead, and the sender waits for it to reopen. Called
+ * with signals blocked (holdConnection()). They're unblocked during the write, as the handlers only
+ * touch the part of the ring after what's being written.
+ * @param c The connection.
+ * @param mask Signal mask to write with.
+ * @return int 1 if something was written, 0 if there was nothing to write, -1 on error.
+ */
+int writeStaged(RdtState_t* c, const sigset_t* mask) {
+  uint32_t received = c->seq_no - c->seq_init;
+  uint32_t start = c->written;
+  uint32_t epoch = c->stage_epoch;
+
+  if (c->stage == NULL || !writeThrough(c) || received == start) {
+    return 0;
+  }
+
+  /* Up to the end of the ring. What wrapped round is written next time. */
+  uint32_t at = start % RDT_STAGE_SIZE;
+  uint32_t n = received - start < RDT_STAGE_SIZE - at ? received - start : RDT_STAGE_SIZE - at;
+
+  releaseConnection(c, mask);
+  ssize_t r = pwrite(c->out_fd, c->stage + at, n, (off_t) (c->offset + start));
+  holdConnection(c, (sigset_t *) 0);
+
+  /* It's been acknowledged, so the sender won't send it again. Reset the connection. */
+  if (r != (ssize_t) n) {
+    perror("Couldn't write to output file");
+    if (c->state != RDT_STATE_CLOSED) {
+      c->state = RDT_STATE_CLOSED;
+      sendRst(c);
+    }
+    return -1;
+  }
+
+  /* A SYN started the transfer again while we were writing */
+  if (c->stage_epoch != epoch) {
+    return 1;
+  }
+  c->written += n;
+
+  /* Periodically make written data durable, so a resumed transfer can skip it */
+  if (c->checkpoint_path != NULL && c->transfer_id != 0 &&
+      c->seq_init + c->written - c->checkpoint_seq >= RDT_CHECKPOINT_INTERVAL) {
+    commitCheckpoint(c, c->offset + c->written);
+  }
+
+  /* Tell a sender waiting on a zero window that there's room again */
+  if (c->wnd_closed && c->state == RDT_STATE_ESTABLISHED && advertisedWindow(c) > 0) {
+    sendAck(c);
+  }
+  return 1;
+}
+/* RECEIVE BUFFER END */
+
+
+/* WINDOWS START */
+/**
+ * The receive window to advertise: room left in the staging ring, or the most we can advertise if
+ * data isn't staged. Windows smaller than a segment are advertised as zero, so the sender doesn't
+ * dribble out small segments as the ring drains (silly window syndrome).
+ * @param c The connection.
+ * @return uint16_t The window, >> RDT_WINDOW_SHIFT.
+ */
+uint16_t advertisedWindow(RdtState_t* c) {
+  if (c->stage == NULL || !writeThrough(c)) {
+    return RDT_WINDOW_MAX;
+  }
+
+  uint32_t room = RDT_STAGE_SIZE - (c->seq_no - c->seq_init - c->written);
+  c->wnd_closed = room < RDT_MAX_SIZE;
+  if (c->wnd_closed) {
+    return 0;
+  }
+  return (room >> RDT_WINDOW_SHIFT) < RDT_WINDOW_MAX ? (uint16_t) (room >> RDT_WINDOW_SHIFT) : RDT_WINDOW_MAX;
+}
+
+/**
+ * Takes the peer's window from a packet it sent, if windows were negotiated.
+ * @param c The connection.
+ * @param packet The packet. Header must be in host byte order.
+ */
+void updateWindow(RdtState_t* c, const RdtPacket_t* packet) {
+  c->snd_wnd = c->windowed ? (uint32_t) packet->header.window << c->snd_shift : UINT32_MAX;
+}
+/* WINDOWS END */
+
+
+/* CHECKPOINTS START */
+/**
+ * Moves the receiver's starting position forward to the committed bytes of a matching checkpoint.
+ * @param c The connection.
+ */
+void resumeCheckpoint(RdtState_t* c) {
+  Checkpoint_t checkpoint;
+
+  if (c->checkpoint_path == NULL || loadCheckpoint(c->checkpoint_path, &checkpoint) != 0) {
+    return;
+  }
+
+  if (checkpoint.transfer_id == c->transfer_id && checkpoint.committed > c->offset) {
+    printf("Resuming transfer %016" PRIx64 " at byte %" PRIu64 "...\n", c->transfer_id, checkpoint.committed);
+    c->offset = checkpoint.committed;
+  }
+}
+
+/**
+ * Syncs the output file and records the bytes committed to it.
+ * @param c The connection.
+ * @param committed File position up to which all data has been written.
+ */
+void commitCheckpoint(RdtState_t* c, uint64_t committed) {
+  Checkpoint_t checkpoint = { c->transfer_id, committed };
+
+  if (fdatasync(c->out_fd) != 0) {
+    perror("Couldn't sync output file");
+    return;
+  }
+
+  if (saveCheckpoint(c->checkpoint_path, &checkpoint) != 0) {
+    perror("Couldn't save checkpoint");
+    return;
+  }
+
+  c->checkpoint_seq = c->seq_init + (uint32_t) (committed - c->offset);
+}
+/* CHECKPOINTS END */
+
+
+/* DELTA START */
+/**
+ * Receiver: the sender has all of our block signatures. Free them and start receiving its delta,
+ * which follows on in the same sequence space.
+ * @param c The connection.
+ */
+void endSignaturePhase(RdtState_t* c) {
+  free(c->delta_sigs);
+  c->delta_sigs = NULL;
+  c->buf = NULL;
+  c->buf_size = 0;
+  c->seq_init = c->seq_no;
+  c->retries = 0;
+}
+/* DELTA END */
+
+
+/* SIGNALS START */
+/**
+ * SIGIO handler. Called when packets are received.
+ * @param sig
+ */
+void handleSIGIO(int sig) {
+  if (sig == SIGIO) {
+    /* protect the network and keyboard reads from signals */
+    sigprocmask(SIG_BLOCK, &G_sigmask, (sigset_t *) 0);
+
+    /* Signals don't queue, so drain every datagram waiting on the (non-blocking) socket */
+    rdtPoll();
+
+    /* allow the signals to be delivered */
+    sigprocmask(SIG_UNBLOCK, &G_sigmask, (sigset_t *) 0);
+  }
+  else {
+    perror("handleSIGIO(): got a bad signal number");
+    exit(1);
+  }
+}
+
+/**
+ * SIGALRM handler. Triggered 200ms after ITIMER set for alarm.
+ * @param sig
+ */
+void handleSIGALRM(int sig) {
+  if (sig == SIGALRM) {
+    /* protect handler actions from signals */
+    sigprocmask(SIG_BLOCK, &G_sigmask, (sigset_t *) 0);
+
+    /* Send a packet */
+    fsm(RDT_EVENT_RTO);
+
+    /* protect handler actions from signals */
+    sigprocmask(SIG_UNBLOCK, &G_sigmask, (sigset_t *) 0);
+  }
+  else {
+    perror("handleSIGALRM() got a bad signal");
+    exit(1);
+  }
+}
+
+/**
+ * Runs every datagram waiting on G_conn->socket through the FSM. Called with signals blocked.
+ */
+void rdtPoll() {
+  drainConnection(G_conn);
+}
+
+/**
+ * Runs every datagram waiting on a connection's socket through its FSM. Called with signals blocked,
+ * unless the connection is polled.
+ * @param c The connection.
+ */
+void drainConnection(RdtState_t* c) {
+  RdtPacket_t* packet;
+  RdtEvent_t event;
+
+  while ((packet = recvRdtPacket(c, &event.intact)) != NULL) {
+    event.input = rdtTypeToRdtEvent(packet->header.type);
+    event.packet = packet;
+    if (event.intact) {
+      followPath(c);
+    }
+
+    if (c->reverse != NULL) {
+      duplexFsm(c, &event);
+    } else {
+      rdtFsm(c, &event);
+    }
+
+    free(packet);
+  }
+}
+/* SIGNALS END */
+
+
+/* WAITING START */
+/*
+  A connection is driven either by signals, like G_conn, or, if c->polled, by whichever thread is
+  waiting on it in the API. A polled connection has no handlers: waitConnection() polls its socket
+  until a datagram arrives or its deadline passes, and runs the FSM itself. Nothing about it is
+  global, so threads can each run their own.
+*/
+
+/**
+ * Blocks the signals that drive a connection, so it can be checked and the FSM run on it without a
+ * handler getting in. A polled connection has no handlers, so this does nothing.
+ * @param c The connection.
+ * @param mask Set to the signal mask to restore with releaseConnection(). May be NULL.
+ */
+void holdConnection(RdtState_t* c, sigset_t* mask) {
+  if (!c->polled) {
+    sigprocmask(SIG_BLOCK, &G_sigmask, mask);
+  }
+}
+
+/**
+ * Undoes holdConnection().
+ * @param c The connection.
+ * @param mask The signal mask holdConnection() saved.
+ */
+void releaseConnection(RdtState_t* c, const sigset_t* mask) {
+  if (!c->polled) {
+    sigprocmask(SIG_SETMASK, mask, (sigset_t *) 0);
+  }
+}
+
+/**
+ * Waits for something to happen on a held connection: a handler to run, or if it's polled, a datagram
+ * to arrive or its timer to go off, which are then run through the FSM here.
+ * @param c The connection.
+ * @param mask The signal mask holdConnection() saved.
+ */
+void waitConnection(RdtState_t* c, const sigset_t* mask) {
+  struct pollfd fd = { c->socket->local->sd, POLLIN, 0 };
+
+  if (!c->polled) {
+    sigsuspend(mask); // Wait for signal
+    return;
+  }
+
+  if (poll(&fd, 1, rdtTimeout(c)) > 0) {
+    drainConnection(c);
+  }
+  expireTimer(c);
+}
+
+/**
+ * Runs a polled connection's timer through the FSM, if its deadline has passed.
+ * @param c The connection.
+ */
+void expireTimer(RdtState_t* c) {
+  RdtEvent_t event = { RDT_EVENT_RTO, NULL, false };
+  RdtState_t* halves[2] = { c, c->reverse };
+
+  /* Full duplex: each direction has its own */
+  for (int i = 0; i < 2; i++) {
+    if (halves[i] != NULL && halves[i]->deadline != 0 && rdtClock() >= halves[i]->deadline) {
+      halves[i]->deadline = 0;
+      rdtFsm(halves[i], &event);
+    }
+  }
+}
+
+/**
+ * How long a polled connection can be left before its timer needs running, e.g. as the timeout of
+ * poll() or epoll_wait() on rdtFd() before calling rdtProcess().
+ * @param c The connection.
+ * @return int Milliseconds, rounded up, 0 if it's due now, or -1 if no timer is set.
+ */
+int rdtTimeout(const RdtState_t* c) {
+  uint64_t deadline = c->deadline;
+
+  /* Full duplex: whichever direction's timer goes off first */
+  if (c->reverse != NULL && c->reverse->deadline != 0 && (deadline == 0 || c->reverse->deadline < deadline)) {
+    deadline = c->reverse->deadline;
+  }
+  if (deadline == 0) {
+    return -1;
+  }
+
+  uint64_t now = rdtClock();
+  return deadline > now ? (int) ((deadline - now + 999) / 1000) : 0;
+}
+
+/**
+ * Draws an initial sequence number from the kernel, independently for each connection, so
+ * connections opened at the same time on different threads don't share one.
+ * @return uint32_t initial sequence number.
+ */
+uint32_t initialSequence() {
+  uint32_t isn;
+
+  if (G_isn_hook != NULL) {
+    return G_isn_hook();
+  }
+  if (getrandom(&isn, sizeof(isn), GRND_NONBLOCK) != (ssize_t) sizeof(isn)) {
+    isn = (uint32_t) (rdtClock() * 2654435761u);
+  }
+  return isn;
+}
+
+/**
+ * Current time for connection deadlines.
+ * @return uint64_t time in microseconds (CLOCK_MONOTONIC).
+ */
+uint64_t rdtClock() {
+  struct timespec now;
+
+  if (rtoClock(&now) != 0) {
+    perror("Couldn't get current time");
+  }
+  return (uint64_t) now.tv_sec * 1000000 + (uint64_t) (now.tv_nsec / 1000);
+}
+
+/**
+ * Sets a connection's timer: its deadline, and unless it's polled, the interval timer with setITIMER().
+ * @param c The connection.
+ * @param us Microseconds from now, or 0 to cancel it.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int armTimer(RdtState_t* c, uint32_t us) {
+  c->deadline = us != 0 ? rdtClock() + us : 0;
+  if (c->polled) {
+    return 0;
+  }
+  return setITIMER(RTO_TO_SEC(us), RTO_TO_USEC(us));
+}
+/* WAITING END */
+
+
+/* ASYNC START */
+/*
+  rdtSendAsync() and rdtListenAsync() start a transfer on a polled connection and return at once.
+  The program's own event loop then waits for rdtFd() to be readable, for at most rdtTimeout(), and
+  calls rdtProcess(), which does what waitConnection() and the blocking API would: runs what arrived
+  and any timer through the FSM, writes out staged data, and moves the transfer on to its next step.
+  Callbacks report progress, failure and the end of the transfer, so one thread can run any number
+  of them.
+*/
+
+/**
+ * Starts sending data without waiting: sends the SYN, and leaves the rest to rdtProcess(). The
+ * connection becomes polled.
+ * @param c The connection, from rdtCreateState(), closed, set up as for rdtSend_r().
+ * @param socket The socket to send over. Only this connection may use it.
+ * @param buf Buffer containing the data. Must stay valid until the done callback.
+ * @param n The size of 'buf'
+ * @param callbacks Callbacks, or NULL. Must stay valid until the done callback.
+ * @return 0 if the transfer started, -1 if the connection is busy.
+ */
+int rdtSendAsync(RdtState_t* c, RdtSocket_t* socket, const void* buf, uint32_t n, const RdtCallbacks_t* callbacks) {
+  if (c->async != RDT_ASYNC_NONE || c->state != RDT_STATE_CLOSED) {
+    return -1;
+  }
+
+  c->polled = true;
+  c->buf = (uint8_t*) buf;
+  c->buf_size = n;
+  c->sender = true;
+  c->framed = false;
+  c->source = (const uint8_t*) buf;
+  c->source_size = n;
+  startAsync(c, callbacks, RDT_ASYNC_OPENING);
+
+  attachSocket(c, socket);
+  c->retries = 0;
+  resetStats(c);
+  fsmInput(c, RDT_INPUT_ACTIVE_OPEN);
+  return 0;
+}
+
+/**
+ * Starts listening for one transfer without waiting, and leaves it to rdtProcess(). The connection
+ * becomes polled.
+ * @param c The connection, from rdtCreateState(), closed, set up as for rdtListen_r().
+ * @param socket Socket to listen on. Only this connection may use it.
+ * @param callbacks Callbacks, or NULL. Must stay valid until the done callback.
+ * @return 0 if listening, -1 if the connection is busy.
+ */
+int rdtListenAsync(RdtState_t* c, RdtSocket_t* socket, const RdtCallbacks_t* callbacks) {
+  if (c->async != RDT_ASYNC_NONE || c->state != RDT_STATE_CLOSED) {
+    return -1;
+  }
+
+  c->polled = true;
+  freeReverse(c);
+  startAsync(c, callbacks, RDT_ASYNC_RECEIVING);
+
+  c->state = RDT_STATE_LISTEN;
+  resetStats(c);
+  attachSocket(c, socket);
+  return 0;
+}
+
+/**
+ * Does whatever an asynchronous transfer is waiting for, without blocking. Call it when rdtFd() is
+ * readable, or rdtTimeout() has passed, or just each time round the event loop.
+ * @param c The connection.
+ * @return int 1 while the transfer is under way, 0 once it has finished (after the done callback).
+ */
+int rdtProcess(RdtState_t* c) {
+  if (c->async == RDT_ASYNC_NONE) {
+    return 0;
+  }
+
+  drainConnection(c);
+  expireTimer(c);
+  return stepAsync(c);
+}
+
+/**
+ * The descriptor to wait on for an asynchronous transfer: readable when datagrams have arrived.
+ * @param c The connection, after rdtSendAsync() or rdtListenAsync().
+ * @return int The socket's descriptor.
+ */
+int rdtFd(const RdtState_t* c) {
+  return c->socket->local->sd;
+}
+
+/**
+ * Sets up the bookkeeping of an asynchronous transfer.
+ * @param c The connection.
+ * @param callbacks Its callbacks, or NULL.
+ * @param step The step it starts at.
+ */
+void startAsync(RdtState_t* c, const RdtCallbacks_t* callbacks, int step) {
+  c->async = step;
+  c->callbacks = callbacks;
+  c->result = 0;
+  c->reported = 0;
+}
+
+/**
+ * Moves an asynchronous transfer on as far as its connection allows. Each step may lead straight into
+ * the next, e.g. a failure into closing, and closing into done.
+ * @param c The connection.
+ * @return int 1 while the transfer is under way, 0 once it has finished.
+ */
+int stepAsync(RdtState_t* c) {
+  if (c->async == RDT_ASYNC_OPENING) {
+    if (c->state == RDT_STATE_CLOSED) {
+      /* What arrived of the signature stream */
+      if (c->delta_block != 0 && c->buf != c->source) {
+        free(c->buf);
+        c->buf = NULL;
+      }
+      failAsync(c, c->stats.rst_received > 0 ? ECONNREFUSED : ETIMEDOUT);
+    } else if (c->state == RDT_STATE_ESTABLISHED &&
+               (c->delta_block == 0 || deltaSignaturesComplete(c->buf, c->seq_no - c->seq_init))) {
+      if (prepareSend(c, c->source, c->source_size) != 0) {
+        failAsync(c, ENOMEM);
+      } else {
+        c->async = RDT_ASYNC_SENDING;
+
+        /* Whatever rode in the SYN has already been acknowledged by the SYN_ACK */
+        if (c->seq_no - c->seq_init < c->buf_size) {
+          fsmInput(c, RDT_INPUT_SEND);
+        }
+      }
+    }
+  }
+
+  if (c->async == RDT_ASYNC_SENDING) {
+    if (c->state == RDT_STATE_ESTABLISHED) {
+      reportProgress(c);
+      freeSend(c);
+      startClose(c);
+      c->async = RDT_ASYNC_CLOSING;
+    } else if (c->state == RDT_STATE_CLOSED) {
+      freeSend(c);
+      failAsync(c, c->stats.rst_received > 0 ? ECONNRESET : ETIMEDOUT);
+    } else {
+      reportProgress(c);
+    }
+  }
+
+  if (c->async == RDT_ASYNC_RECEIVING) {
+    int written;
+    do {
+      written = writeStaged(c, NULL);
+    } while (written > 0);
+    reportProgress(c);
+
+    if (written < 0) {
+      free(c->stage);
+      c->stage = NULL;
+      failAsync(c, EIO);
+    } else if (!connectionOpen(c)) {
+      free(c->stage);
+      c->stage = NULL;
+      uint32_t n = finishReceive(c);
+      if (!c->complete) {
+        failAsync(c, ECONNRESET);
+      }
+      return finishAsync(c, n);
+    }
+  }
+
+  if (c->async == RDT_ASYNC_CLOSING && !connectionOpen(c)) {
+    return finishAsync(c, c->sender && c->result == 0 ? c->source_size : 0);
+  }
+
+  return c->async != RDT_ASYNC_NONE;
+}
+
+/**
+ * Gives the progress callback how much has been acknowledged (sender) or received, if it has changed.
+ * @param c The connection.
+ */
+void reportProgress(RdtState_t* c) {
+  const RdtCallbacks_t* callbacks = c->callbacks;
+  uint64_t bytes;
+  uint64_t total;
+
+  if (c->sender) {
+    bytes = c->seq_no - c->seq_init - (c->state == RDT_STATE_DATA_SENT ? c->prev_size : 0);
+    total = c->buf_size;
+  } else if (c->state != RDT_STATE_LISTEN && c->delta_sigs == NULL) {
+    bytes = c->seq_no - c->seq_init;
+    total = c->length;
+  } else {
+    return;
+  }
+
+  if (bytes != c->reported && callbacks != NULL && callbacks->progress != NULL) {
+    c->reported = bytes;
+    callbacks->progress(c, bytes, total, callbacks->arg);
+  }
+}
+
+/**
+ * Records that an asynchronous transfer failed, tells the error callback, and closes the connection
+ * if it's still open.
+ * @param c The connection.
+ * @param error Why: an errno value.
+ */
+void failAsync(RdtState_t* c, int error) {
+  const RdtCallbacks_t* callbacks = c->callbacks;
+
+  c->result = -1;
+  if (callbacks != NULL && callbacks->error != NULL) {
+    callbacks->error(c, error, callbacks->arg);
+  }
+
+  if (c->state != RDT_STATE_CLOSED) {
+    startClose(c);
+  }
+  c->async = RDT_ASYNC_CLOSING;
+}
+
+/**
+ * Ends an asynchronous transfer, and calls the done callback, which may free the connection.
+ * @param c The connection, closed.
+ * @param n Bytes sent or received.
+ * @return int 0.
+ */
+int finishAsync(RdtState_t* c, uint32_t n) {
+  const RdtCallbacks_t* callbacks = c->callbacks;
+
+  c->async = RDT_ASYNC_NONE;
+  c->callbacks = NULL;
+  if (callbacks != NULL && callbacks->done != NULL) {
+    callbacks->done(c, c->result, n, callbacks->arg);
+  }
+  return 0;
+}
+/* ASYNC END */
+
+
+/* DUPLEX START */
+/*
+  A full-duplex connection is two halves on one socket, each an RdtState_t with a sequence space of
+  its own: the one the API was called with, and c->reverse for the other direction. The sender asks
+  for it in the SYN, and a receiver with a reply to send answers with the reply's initial sequence
+  number and length. Each half runs the usual FSM. duplexFsm() hands it its packets, and lets the
+  ACK of the receiving half ride on the next DATA of the sending half, in the header's ack field,
+  rather than go on its own. The receiving end's sending half starts once the sender shows it has
+  the SYN_ACK, and closes once its data is acknowledged. Both halves are polled.
+*/
+
+/**
+ * Sets up the other direction of a full-duplex connection: on the sending end, a receiving half for
+ * what comes back; on the receiving end, a sending half for the reply, which waits in SYN_RCVD until
+ * the sender shows it has the SYN_ACK.
+ * @param c The connection.
+ * @param seq_init Initial sequence number of the other direction.
+ * @param length Bytes coming back, on the sending end.
+ * @return The other half, or NULL if out of memory.
+ */
+RdtState_t* openReverse(RdtState_t* c, uint32_t seq_init, uint64_t length) {
+  RdtState_t* reverse = rdtCreateState();
+  if (reverse == NULL) {
+    return NULL;
+  }
+
+  reverse->socket = c->socket;
+  reverse->polled = true;
+  reverse->ts_recent = c->ts_recent;
+  reverse->seq_init = seq_init;
+  reverse->seq_no = seq_init;
+  reverse->reverse = c;
+
+  if (c->sender) {
+    reverse->state = RDT_STATE_ESTABLISHED;
+    reverse->length = length;
+    reserveTransfer(reverse, length);
+    if (reverse->buf == NULL) {
+      reverse->buf = (uint8_t*) calloc(1, 1); // An empty reply is still a reply.
+    }
+  } else {
+    reverse->sender = true;
+    reverse->buf = (uint8_t*) c->reply;
+    reverse->buf_size = c->reply_size;
+    reverse->state = RDT_STATE_SYN_RCVD;
+  }
+
+  c->reverse = reverse;
+  return reverse;
+}
+
+/**
+ * Frees the other direction of a connection, if it had one.
+ * @param c The connection.
+ */
+void freeReverse(RdtState_t* c) {
+  if (c->reverse != NULL) {
+    c->reverse->reverse = NULL;
+    rdtFreeState(c->reverse);
+    c->reverse = NULL;
+  }
+}
+
+/**
+ * Gives up on the other direction of a connection that has failed.
+ * @param c The connection.
+ */
+void dropReverse(RdtState_t* c) {
+  if (c->reverse != NULL) {
+    c->reverse->state = RDT_STATE_CLOSED;
+    c->reverse->deadline = 0;
+  }
+}
+
+/**
+ * Whether a connection is still open, in either direction if it's full duplex.
+ * @param c The connection.
+ * @return bool true until both directions have closed.
+ */
+bool connectionOpen(const RdtState_t* c) {
+  return c->state != RDT_STATE_CLOSED || (c->reverse != NULL && c->reverse->state != RDT_STATE_CLOSED);
+}
+
+/**
+ * Runs a packet through the half of a full-duplex connection it's for. A DATA goes to the receiving
+ * half, with its ACK held back, and the ACK riding on it to the sending half. Whatever the sending
+ * half sends next carries the held-back ACK, which only goes on its own if there's nothing to send.
+ * @param c The connection the API was called with.
+ * @param event The packet.
+ */
+void duplexFsm(RdtState_t* c, const RdtEvent_t* event) {
+  RdtState_t* sending = c->sender ? c : c->reverse;
+  RdtState_t* receiving = c->sender ? c->reverse : c;
+  const RdtPacket_t* received = event->packet;
+
+  sending->ts_recent = c->ts_recent;
+  receiving->ts_recent = c->ts_recent;
+
+  switch (event->input) {
+    /* The handshake is the connection's own */
+    case RDT_EVENT_RCV_SYN:
+    case RDT_EVENT_RCV_SYN_ACK:
+      rdtFsm(c, event);
+      return;
+
+    /* Take the ACK riding on it only if it covers the segment we have in flight. One that doesn't
+     * was sent before ours arrived, and isn't asking for anything again. */
+    case RDT_EVENT_RCV_DATA:
+      receiving->ack_deferred = true;
+      rdtFsm(receiving, event);
+      receiving->ack_deferred = false;
+
+      if (event->intact && sending->state == RDT_STATE_DATA_SENT && received->header.ack == sending->seq_no) {
+        RdtPacket_t ack;
+        RdtEvent_t acked = { RDT_EVENT_RCV_ACK, &ack, true };
+        ack.header = received->header;
+        ack.header.type = ACK;
+        ack.header.sequence = received->header.ack;
+        ack.header.size = 0;
+        rdtFsm(sending, &acked);
+      }
+      break;
+
+    /* The peer's direction is done. Answer a repeat, in case our FIN_ACK was lost. */
+    case RDT_EVENT_RCV_FIN:
+      if (receiving->state == RDT_STATE_CLOSED && receiving->complete) {
+        transmitPacket(receiving, createPacket(receiving, FIN_ACK, received->header.sequence, NULL));
+      } else {
+        rdtFsm(receiving, event);
+      }
+      break;
+
+    case RDT_EVENT_RCV_RST:
+      rdtFsm(c, event);
+      dropReverse(c);
+      break;
+
+    /* A stray ACK mustn't reset a half that has finished while the other is still going */
+    case RDT_EVENT_RCV_ACK:
+      if (sending->state == RDT_STATE_DATA_SENT || sending->state == RDT_STATE_PERSIST) {
+        rdtFsm(sending, event);
+      }
+      break;
+
+    default:
+      rdtFsm(sending, event);
+      break;
+  }
+
+  /* The receiving end runs its sending half. Anything from the sender shows it has our SYN_ACK. */
+  if (!c->sender) {
+    if (sending->state == RDT_STATE_SYN_RCVD) {
+      sending->state = RDT_STATE_ESTABLISHED;
+      if (sending->buf_size > 0) {
+        fsmInput(sending, RDT_INPUT_SEND);
+      }
+    }
+    if (sending->state == RDT_STATE_ESTABLISHED && sending->seq_no - sending->seq_init >= sending->buf_size) {
+      fsmInput(sending, RDT_INPUT_CLOSE);
+    }
+  }
+
+  /* Nothing went the other way to carry the ACK */
+  if (receiving->ack_pending) {
+    receiving->ack_pending = false;
+    sendAck(receiving);
+  }
+}
+/* DUPLEX END */
+
+
+/* STREAMS START */
+/*
+  Streams share the connection's one sequence space. Each DATA segment carries chunks, each a header
+  of stream ID (16 bits), length (16 bits) and the chunk's position in its stream (32 bits), then that
+  much of the stream. A stream is a series of framed messages, like a persistent connection's.
+
+  The sender sends one chunk at a time, and picks the next once it's acknowledged. A chunk that's
+  retransmitted is the same chunk, so a stream's data is never skipped. The receiver splits the
+  connection's data back into chunks as it arrives, and each stream's messages are complete as soon
+  as their last chunk is in, whatever is still arriving on the other streams.
+*/
+
+/**
+ * Sets up the streams of a connection, none of them with anything on it.
+ * @param c The connection. Its streams must have been freed.
+ * @return The streams, or NULL if out of memory.
+ */
+RdtStreams_t* openStreams(RdtState_t* c) {
+  RdtStreams_t* set = (RdtStreams_t*) calloc(1, sizeof(RdtStreams_t));
+  if (set == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&set->lock, NULL);
+  set->in_flight = -1;
+  c->stream_set = set;
+  return set;
+}
+
+/**
+ * Frees the streams of a connection, and whatever is queued or received on them.
+ * @param c The connection.
+ */
+void freeStreams(RdtState_t* c) {
+  RdtStreams_t* set = c->stream_set;
+  if (set == NULL) {
+    return;
+  }
+
+  for (uint16_t i = 0; i < RDT_STREAMS; i++) {
+    free(set->stream[i].data);
+  }
+  pthread_mutex_destroy(&set->lock);
+  free(set);
+  c->stream_set = NULL;
+}
+
+/**
+ * Grows a stream's data, doubling it, until it holds 'size' bytes.
+ * @param s The stream.
+ * @param size Bytes it must hold.
+ * @return true if it does, false if out of memory or it's too big.
+ */
+bool growStream(RdtStream_t* s, uint32_t size) {
+  uint32_t capacity = s->capacity;
+
+  if (capacity >= size) {
+    return true;
+  }
+  while (capacity < size) {
+    if (capacity > UINT32_MAX / 2) {
+      return false; // Doubling would wrap around.
+    }
+    capacity = capacity > 0 ? capacity * 2 : RDT_MAX_SIZE;
+  }
+
+  uint8_t* data = (uint8_t*) realloc(s->data, capacity);
+  if (data == NULL) {
+    return false;
+  }
+  s->data = data;
+  s->capacity = capacity;
+  return true;
+}
+
+/**
+ * Sender: puts the next chunk in c->buf, from the most urgent stream with data waiting. Of streams
+ * of equal priority, the first after the last one served goes, so they take turns.
+ * @param c The connection.
+ * @return true if there was a chunk to send, false if every stream has been sent.
+ */
+bool nextChunk(RdtState_t* c) {
+  RdtStreams_t* set = c->stream_set;
+  int best = -1;
+
+  pthread_mutex_lock(&set->lock);
+  for (uint16_t k = 0; k < RDT_STREAMS; k++) {
+    uint16_t i = (uint16_t) ((set->next + k) % RDT_STREAMS);
+    const RdtStream_t* s = &set->stream[i];
+    if (s->sent < s->size && (best < 0 || s->priority < set->stream[best].priority)) {
+      best = i;
+    }
+  }
+
+  if (best >= 0) {
+    RdtStream_t* s = &set->stream[best];
+    uint32_t n = s->size - s->sent;
+    if (n > RDT_MAX_SIZE - RDT_CHUNK_HEADER) {
+      n = RDT_MAX_SIZE - RDT_CHUNK_HEADER;
+    }
+
+    uint16_t id = htons((uint16_t) best);
+    uint16_t length = htons((uint16_t) n);
+    uint32_t offset = htonl(s->offset + s->sent);
+    memcpy(set->chunk, &id, sizeof(id));
+    memcpy(set->chunk + 2, &length, sizeof(length));
+    memcpy(set->chunk + 4, &offset, sizeof(offset));
+    memcpy(set->chunk + RDT_CHUNK_HEADER, s->data + s->sent, n);
+
+    set->in_flight = best;
+    set->chunk_size = n;
+    set->next = (uint16_t) ((best + 1) % RDT_STREAMS);
+
+    /* The chunk is sent like a message of its own, carrying on in the same sequence space */
+    c->buf = set->chunk;
+    c->buf_size = RDT_CHUNK_HEADER + n;
+    c->seq_init = c->seq_no;
+  }
+  pthread_mutex_unlock(&set->lock);
+  return best >= 0;
+}
+
+/**
+ * Receiver: splits what has arrived since the last call into chunks, adds each to its stream, and
+ * gives the message hook each message that's now complete. Chunks arrive in order, so each carries
+ * on where its stream left off; one that doesn't is dropped.
+ * @param c The connection. Its signals must be held, if it's driven by them.
+ */
+void deliverStreams(RdtState_t* c) {
+  RdtStreams_t* set = c->stream_set;
+  uint32_t have = c->seq_no - c->seq_init;
+
+  if (set == NULL || c->buf == NULL) {
+    return;
+  }
+
+  while (have - set->demuxed >= RDT_CHUNK_HEADER) {
+    const uint8_t* chunk = c->buf + set->demuxed;
+    uint16_t id;
+    uint16_t length;
+    uint32_t offset;
+    memcpy(&id, chunk, sizeof(id));
+    memcpy(&length, chunk + 2, sizeof(length));
+    memcpy(&offset, chunk + 4, sizeof(offset));
+    id = ntohs(id);
+    length = ntohs(length);
+    offset = ntohl(offset);
+
+    /* The rest of the chunk is still to come */
+    if (have - set->demuxed - RDT_CHUNK_HEADER < length) {
+      break;
+    }
+    set->demuxed += RDT_CHUNK_HEADER + length;
+
+    RdtStream_t* s = id < RDT_STREAMS ? &set->stream[id] : NULL;
+    if (s == NULL || offset != s->size || !growStream(s, s->size + length)) {
+      printf("Dropped %u bytes for stream %u at %u.\n", length, id, offset);
+      continue;
+    }
+    memcpy(s->data + s->size, chunk + RDT_CHUNK_HEADER, length);
+    s->size += length;
+
+    uint32_t n;
+    uint8_t* message;
+    while ((message = nextFrame(s->data, s->size, &s->sent, &n)) != NULL) {
+      if (c->stream_hooks != NULL && c->stream_hooks->message != NULL) {
+        c->stream_hooks->message(c, id, message, n, c->stream_hooks->arg);
+      }
+    }
+  }
+}
+
+/**
+ * The next complete message in a series of framed messages, skipping any that were abandoned.
+ * @param buf The messages.
+ * @param size Bytes in buf.
+ * @param offset Position of the next message in buf. Updated past it.
+ * @param n Set to the size of the message.
+ * @return Pointer to the message within buf, or NULL if there isn't a complete one.
+ */
+uint8_t* nextFrame(uint8_t* buf, uint32_t size, uint32_t* offset, uint32_t* n) {
+  uint32_t length;
+  bool abandoned;
+
+  do {
+    if (*offset + RDT_FRAME_HEADER > size) {
+      return NULL;
+    }
+
+    memcpy(&length, buf + *offset, RDT_FRAME_HEADER);
+    length = ntohl(length);
+    abandoned = (length & RDT_FRAME_ABANDONED) != 0;
+    length &= ~RDT_FRAME_ABANDONED;
+    if (length > size - *offset - RDT_FRAME_HEADER) {
+      return NULL;
+    }
+
+    *offset += RDT_FRAME_HEADER + length;
+  } while (abandoned);
+
+  *n = length;
+  return buf + *offset - length;
+}
+/* STREAMS END */
+
+
+/* MULTIPATH START */
+/*
+  A sender's socket may have paths: pairs of local and remote addresses, kept with what's measured of
+  each in a PathSet_t (multipath/multipath.c) that sockets on other threads may share. Every SYN,
+  DATA and FIN goes on the path pathChoose() picks for it, and stays in flight there until something
+  intact comes back, or the RTO goes off. A segment that times out is sent again on another path if
+  one is working, with that path's RTO, so a path going down costs one RTO.
+
+  The receiver sends each answer back to wherever the last intact packet came from, so it goes back
+  over the same path, and the sender measures each path on its own.
+*/
+
+/**
+ * Sender: picks the path for the SYN, DATA or FIN about to be sent. Without multipath, that's path 0.
+ * Whatever was in flight before isn't waited for any more.
+ * @param c The connection.
+ */
+void choosePath(RdtState_t* c) {
+  RdtSocket_t* socket = c->socket;
+
+  if (socket == NULL || socket->paths == NULL) {
+    return;
+  }
+
+  if (socket->in_flight) {
+    pathRelease(socket->paths, socket->path);
+  }
+  if (c->multipath) {
+    socket->path = pathChoose(socket->paths, rdtClock());
+    socket->in_flight = true;
+  } else {
+    socket->path = 0;
+    socket->in_flight = false;
+  }
+}
+
+/**
+ * Sender: credits the path of the packet in flight with an intact answer, and its RTT, or blames it
+ * for an RTO. Called before the FSM handles the event.
+ * @param c The connection.
+ * @param event The event.
+ */
+void trackPath(RdtState_t* c, const RdtEvent_t* event) {
+  RdtSocket_t* socket = c->socket;
+
+  if (socket == NULL || socket->paths == NULL || !socket->in_flight) {
+    return;
+  }
+
+  if (event->input == RDT_EVENT_RTO) {
+    pathLost(socket->paths, socket->path, rdtClock());
+    socket->in_flight = false;
+  } else if (event->packet != NULL && event->intact) {
+    uint32_t rtt = event->packet->header.echo != 0 ? calculateRTTEcho(event->packet->header.echo) : 0;
+    bool acked = event->input == RDT_EVENT_RCV_ACK && c->state == RDT_STATE_DATA_SENT && event->packet->header.sequence >= c->seq_no;
+    uint32_t bytes = acked ? c->prev_size : 0;
+    pathAcked(socket->paths, socket->path, rtt, bytes);
+    socket->in_flight = false;
+  }
+}
+
+/**
+ * Receiver: answers go back to where the packet just received came from, if the sender is multipath.
+ * Only from the port the connection started from, so stray packets to it don't redirect it.
+ * @param c The connection.
+ */
+void followPath(RdtState_t* c) {
+  RdtSocket_t* socket = c->socket;
+
+  if (!c->multipath || c->sender || socket->remote == NULL || socket->receive.addr.sin_port != socket->remote->addr.sin_port) {
+    return;
+  }
+  socket->remote->addr.sin_addr = socket->receive.addr.sin_addr;
+}
+
+/**
+ * Sends a datagram on the socket's current path: to its remote address, at the socket's remote port,
+ * and from its local address if it has one, with IP_PKTINFO. The socket is bound to every address, so
+ * answers arrive on it whichever path they take.
+ * @param socket The socket.
+ * @param buffer The datagram.
+ * @return Number of bytes sent, or -1.
+ */
+int sendOnPath(const RdtSocket_t* socket, const UdpBuffer_t* buffer) {
+  const Path_t* path = &socket->paths->path[socket->path];
+  UdpSocket_t remote = *socket->remote;
+  struct sockaddr_in local = socket->local->addr;
+
+  remote.addr.sin_addr = path->remote;
+  local.sin_addr = path->local;
+  pcapPacket(&local, &remote.addr, buffer->bytes, buffer->n);
+
+  /* Routing picks the local address, as it does for an emulated network */
+  if (path->local.s_addr == htonl(INADDR_ANY) || G_udp_transport != NULL) {
+    return sendUdp(socket->local, &remote, buffer);
+  }
+
+  char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+  struct iovec iov = { buffer->bytes, buffer->n };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_name = &remote.addr;
+  msg.msg_namelen = sizeof(remote.addr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = IPPROTO_IP;
+  cmsg->cmsg_type = IP_PKTINFO;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+  struct in_pktinfo info;
+  memset(&info, 0, sizeof(info));
+  info.ipi_spec_dst = path->local;
+  memcpy(CMSG_DATA(cmsg), &info, sizeof(info));
+
+  int r = sendmsg(socket->local->sd, &msg, 0);
+  if (r < 0) {
+    perror("Couldn't send on path");
+  }
+  return r;
+}
+/* MULTIPATH END */
+
+
+/* STATE START */
+/**
+ * Creates the state of a connection that hasn't been opened yet, for use with rdtSwapState().
+ * @return Pointer to the new RdtState_t, or NULL if out of memory.
+ */
+RdtState_t* rdtCreateState() {
+  RdtState_t* state = (RdtState_t*) calloc(1, sizeof(RdtState_t));
+  if (state == NULL) {
+    return NULL;
+  }
+
+  state->state = RDT_STATE_CLOSED;
+  state->codec = RDT_CODEC_NONE;
+  state->out_fd = -1;
+  state->avg_rtt = 1;
+  state->snd_wnd = UINT32_MAX;
+  return state;
+}
+
+/**
+ * Exchanges the current connection, G_conn, with 'state'. Lets several endpoints take turns in one
+ * process, e.g. both ends of a connection over an emulated network. G_debug is shared.
+ * @param state The state to switch to. Receives the current one.
+ */
+void rdtSwapState(RdtState_t* state) {
+  RdtState_t current = *G_conn;
+
+  *G_conn = *state;
+  *state = current;
+}
+
+/**
+ * Frees a connection from rdtCreateState() once it has closed, with what the library allocated for
+ * it: what it received, and its staging ring. The socket, and a sender's buffer, are the caller's.
+ * @param state The connection.
+ */
+void rdtFreeState(RdtState_t* state) {
+  freeReverse(state);
+  freeStreams(state);
+  if (state->delta_sigs != state->buf) free(state->delta_sigs);
+  if (!state->sender) free(state->buf);
+  free(state->stage);
+  free(state);
+}
+/* STATE END */
+
+
+/* SERVER START */
+/*
+  rdtServe() takes connections from many peers on one socket. Datagrams are matched to connections
+  by their source address and port, in G_server_table. Each connection has its own RdtState_t, which
+  is made G_conn while the FSM runs on it. Its timer is a deadline, and the one real timer is set for
+  the earliest. The signal handlers queue connections
+  with data to write out, or that have closed, for the main loop in rdtServe().
+*/
+
+/**
+ * Sets the real timer to go off at a given time.
+ * @param at When, from rdtClock().
+ * @return int 0 if successful, -1 otherwise.
+ */
+int armServerAlarm(uint64_t at) {
+  struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+  uint64_t now = rdtClock();
+  uint64_t delay = at > now ? at - now : 1;
+
+  timer.it_value.tv_sec = (time_t) (delay / 1000000);
+  timer.it_value.tv_usec = (suseconds_t) (delay % 1000000);
+  G_server_alarm = at;
+  return setitimer(ITIMER_REAL, &timer, (struct itimerval *) 0);
+}
+
+/**
+ * G_timer_hook while serving: setITIMER() sets the deadline of the connection the FSM is running on.
+ * The real timer is only moved if it's now due sooner.
+ * @param sec Seconds from now.
+ * @param usec Microseconds on top.
+ * @return int 0 if successful, -1 otherwise.
+ */
+int serverTimer(unsigned int sec, unsigned int usec) {
+  RdtState_t* c = G_conn;
+
+  if (sec == 0 && usec == 0) {
+    c->deadline = 0;
+    return 0;
+  }
+
+  c->deadline = rdtClock() + (uint64_t) sec * 1000000 + usec;
+  if (G_server_alarm == 0 || c->deadline < G_server_alarm) {
+    return armServerAlarm(c->deadline);
+  }
+  return 0;
+}
+
+/**
+ * Makes a connection G_conn, for serverTimer() and the hooks.
+ * @param c The connection.
+ */
+void activateConnection(RdtState_t* c) {
+  G_conn = c;
+}
+
+/**
+ * Queues a connection for the main loop of rdtServe(), if it has staged data to write or has closed,
+ * and isn't queued already. Called with signals blocked.
+ * @param c The connection.
+ */
+void queueConnection(RdtState_t* c) {
+  bool staged = c->stage != NULL && c->seq_no - c->seq_init != c->written;
+
+  if (c->queued || (!staged && c->state != RDT_STATE_CLOSED)) {
+    return;
+  }
+
+  /* Each connection is queued at most once, so the ring can't overflow */
+  G_server_queue[(G_server_queue_head + G_server_queue_count) % RDT_SERVER_CONNECTIONS] = c;
+  G_server_queue_count++;
+  c->queued = true;
+}
+
+/**
+ * Takes the next connection off the queue. Called with signals blocked.
+ * @return RdtState_t* The connection, or NULL if the queue is empty.
+ */
+RdtState_t* dequeueConnection() {
+  if (G_server_queue_count == 0) {
+    return NULL;
+  }
+
+  RdtState_t* c = G_server_queue[G_server_queue_head];
+  G_server_queue_head = (G_server_queue_head + 1) % RDT_SERVER_CONNECTIONS;
+  G_server_queue_count--;
+  c->queued = false;
+  return c;
+}
+
+/**
+ * Starts a connection for a peer that has sent a SYN. It shares the server's local socket.
+ * @param key The peer's connKey().
+ * @return RdtState_t* The connection in LISTEN, or NULL if it's refused or there's no room.
+ */
+RdtState_t* acceptConnection(uint64_t key) {
+  if (G_server_stop || G_server_table.count >= G_server_table.max ||
+      (G_server_limit != 0 && G_server_served + G_server_table.count >= G_server_limit)) {
+    return NULL;
+  }
+
+  RdtState_t* c = rdtCreateState();
+  RdtSocket_t* socket = (RdtSocket_t*) calloc(1, sizeof(RdtSocket_t));
+  if (c == NULL || socket == NULL) {
+    free(c);
+    free(socket);
+    return NULL;
+  }
+
+  socket->local = G_server_socket->local;
+  socket->receive = G_server_socket->receive;
+  c->socket = socket;
+  c->state = RDT_STATE_LISTEN;
+  c->heard = rdtClock();
+
+  /* Anything we send before the SYN is accepted, like an RST, goes to the peer */
+  if (setRemoteSocket(c, inet_ntoa(socket->receive.addr.sin_addr)) < 0 ||
+      (G_server_hooks != NULL && G_server_hooks->accept != NULL && G_server_hooks->accept(c, G_server_hooks->arg) != 0)) {
+    freeConnection(c);
+    return NULL;
+  }
+
+  connTableInsert(&G_server_table, key, c);
+
+  /* Start looking for idle connections */
+  if (G_server_alarm == 0 && armServerAlarm(c->heard + RDT_IDLE_CHECK) != 0) {
+    perror("Couldn't set timer");
+  }
+  return c;
+}
+
+/**
+ * Frees a connection, and what it allocated, streams included, as rdtFreeState() does. The local
+ * socket is the server's, and out_fd, basis and user are the hooks'.
+ * @param c The connection.
+ */
+void freeConnection(RdtState_t* c) {
+  free(c->socket->remote);
+  free(c->socket);
+  rdtFreeState(c);
+}
+
+/**
+ * SIGIO handler of rdtServe(). Runs every datagram waiting on the server's socket through the FSM of
+ * the connection it belongs to. An intact SYN from a new peer starts a connection. Anything else from a
+ * peer without one is corrupt, or left over from a connection that's finished, and is dropped.
+ * @param sig
+ */
+void handleServerSIGIO(int sig) {
+  RdtPacket_t* packet;
+  RdtEvent_t event;
+  int n;
+
+  if (sig != SIGIO) {
+    perror("handleServerSIGIO(): got a bad signal number");
+    exit(1);
+  }
+
+  /* protect the network reads and the connection table from signals */
+  sigprocmask(SIG_BLOCK, &G_sigmask, (sigset_t *) 0);
+
+  while ((packet = readDatagram(G_server_socket, &n)) != NULL) {
+    uint64_t key = connKey(&G_server_socket->receive.addr);
+    RdtState_t* c = (RdtState_t*) connTableFind(&G_server_table, key);
+
+    /* Only an intact SYN starts a connection, so stray or corrupt datagrams don't run the accept hook.
+     * They're counted against the listener. */
+    if (c == NULL) {
+      if (!unpackDatagram(G_server_listener, packet, n) || packet->header.type != SYN ||
+          (c = acceptConnection(key)) == NULL) {
+        free(packet);
+        continue;
+      }
+      c->stats.packets_received++;
+      c->ts_recent = packet->header.timestamp;
+      event.intact = true;
+    } else {
+      event.intact = unpackDatagram(c, packet, n);
+    }
+
+    c->socket->receive = G_server_socket->receive;
+    c->heard = rdtClock();
+    event.input = rdtTypeToRdtEvent(packet->header.type);
+    event.packet = packet;
+
+    activateConnection(c);
+    rdtFsm(c, &event);
+    queueConnection(c);
+
+    free(packet);
+  }
+
+  /* allow the signals to be delivered */
+  sigprocmask(SIG_UNBLOCK, &G_sigmask, (sigset_t *) 0);
+}
+
+/**
+ * SIGALRM handler of rdtServe(). Runs RTO for the connections whose deadlines have passed, and
+ * resets connections that have gone quiet for RDT_IDLE_TIMEOUT. Then sets the real timer for the
+ * next deadline, or the next check for idle connections.
+ * @param sig
+ */
+void handleServerSIGALRM(int sig) {
+  RdtEvent_t event = { RDT_EVENT_RTO, NULL, false };
+
+  if (sig != SIGALRM) {
+    perror("handleServerSIGALRM() got a bad signal");
+    exit(1);
+  }
+
+  /* protect handler actions from signals */
+  sigprocmask(SIG_BLOCK, &G_sigmask, (sigset_t *) 0);
+
+  uint64_t now = rdtClock();
+  uint64_t next = 0;
+  G_server_alarm = 0;
+
+  for (uint32_t i = 0; i < G_server_table.capacity; i++) {
+    RdtState_t* c = (RdtState_t*) connTableAt(&G_server_table, i);
+    if (c == NULL || c->state == RDT_STATE_CLOSED) {
+      continue;
+    }
+
+    if (c->deadline != 0 && c->deadline <= now) {
+      c->deadline = 0;
+      activateConnection(c);
+      rdtFsm(c, &event);
+    } else if (now - c->heard >= RDT_IDLE_TIMEOUT) {
+      printf("Nothing from %s:%d for too long. Resetting!\n",
+             inet_ntoa(c->socket->receive.addr.sin_addr), ntohs(c->socket->receive.addr.sin_port));
+      c->state = RDT_STATE_CLOSED;
+      sendRst(c);
+    }
+    queueConnection(c);
+
+    if (c->deadline != 0 && (next == 0 || c->deadline < next)) {
+      next = c->deadline;
+    }
+  }
+
+  if (G_server_table.count > 0 && (next == 0 || next > now + RDT_IDLE_CHECK)) {
+    next = now + RDT_IDLE_CHECK;
+  }
+  if (next != 0 && armServerAlarm(next) != 0) {
+    perror("Couldn't set timer");
+  }
+
+  /* allow the signals to be delivered */
+  sigprocmask(SIG_UNBLOCK, &G_sigmask, (sigset_t *) 0);
+}
+/* SERVER END */
+
+
+/* FSM START */
+/*
+  The FSM is a table of handlers, by state and input. A handler works only on the connection and the
+  event it's given, sets the new state, and returns the action it took (RDT_ACTION_*), or RDT_INVALID
+  if it sent nothing. A transition that carries straight on into another, like sending the next
+  segment when an ACK arrives, calls that transition's handler and returns its action. Inputs with no
+  handler in a state go to the state's default handler.
+*/
+#define FSM_STATES    (RDT_STATE_PERSIST - RDT_STATE_CLOSED + 1)
+#define FSM_INPUTS    (RDT_EVENT_RCV_FORWARD + 1)
+#define FSM_ROW(s_)   ((s_) - RDT_STATE_CLOSED)
+
+typedef int (*FsmHandler_t)(RdtState_t* c, const RdtEvent_t* event);
+
+/**
+ * Sends a packet made by createPacket(), and frees it.
+ * @param c The connection.
+ * @param packet The packet. Header must be in network byte order.
+ */
+void transmitPacket(RdtState_t* c, RdtPacket_t* packet) {
+  int size = sizeof(RdtHeader_t) + ntohs(packet->header.size);
+
+  if (sendRdtPacket(c, packet, size) != size) {
+    errno = ECOMM;
+    perror("Error sending RDT packet.");
+    if (c->errors++ > RDT_MAX_ERROR) exit(errno);
+  }
+  free(packet);
+}
+
+/**
+ * Acknowledges everything received in order so far.
+ * @param c The connection.
+ * @return int RDT_ACTION_SND_ACK.
+ */
+int sendAck(RdtState_t* c) {
+  /* Full duplex: wait to see if a DATA going the other way can carry it */
+  if (c->ack_deferred) {
+    c->ack_pending = true;
+    return RDT_ACTION_SND_ACK;
+  }
+
+  transmitPacket(c, createPacket(c, ACK, c->seq_no, NULL));
+  return RDT_ACTION_SND_ACK;
+}
+
+/**
+ * Sends an RST.
+ * @param c The connection.
+ * @return int RDT_ACTION_SND_RST.
+ */
+int sendRst(RdtState_t* c) {
+  transmitPacket(c, createPacket(c, RST, 0, NULL));
+  return RDT_ACTION_SND_RST;
+}
+
+/**
+ * Any state, nothing to do.
+ */
+int fsmIgnore(RdtState_t* c, const RdtEvent_t* event) {
+  return RDT_INVALID;
+}
+
+/**
+ * Any state, unexpected input: reset the connection.
+ */
+int fsmAbort(RdtState_t* c, const RdtEvent_t* event) {
+  c->state = RDT_STATE_CLOSED;
+  dropReverse(c);
+  return sendRst(c);
+}
+
+/**
+ * SYN_SENT, unexpected input: reset the peer, but keep waiting for our SYN_ACK.
+ */
+int fsmRefuse(RdtState_t* c, const RdtEvent_t* event) {
+  return sendRst(c);
+}
+
+/**
+ * A state we never enter. Reset and invalidate the connection.
+ */
+int fsmInvalid(RdtState_t* c, const RdtEvent_t* event) {
+  c->state = RDT_INVALID;
+  return sendRst(c);
+}
+
+/**
+ * Any state, RST received: close the connection immediately.
+ */
+int fsmRcvRst(RdtState_t* c, const RdtEvent_t* event) {
+  c->stats.rst_received++;
+  c->state = RDT_STATE_CLOSED;
+  return RDT_INVALID;
+}
+
+/**
+ * CLOSED, active OPEN: send a SYN with our options, and as much data as fits after them.
+ */
+int fsmActiveOpen(RdtState_t* c, const RdtEvent_t* event) {
+  /* Set seq_init and seq_no to a random starter value,
+   * to minimise "old" packet ambiguity/predictability. A retransmitted SYN keeps it, so the SYN_ACK
+   * to any copy is accepted. */
+  if (c->retries == 0) {
+    c->seq_init = initialSequence();
+  }
+  c->seq_no = c->seq_init;
+
+  /* If this is the first attempt, set RTO to 200ms */
+  if (c->rto.T_rto == 0) {
+    c->rto.T_rto = HANDSHAKE_RTO;
+  }
+
+  /* Create and send SYN packet, offering our codecs if compression is enabled */
+  c->codec = RDT_CODEC_NONE;
+  RdtPacket_t* packet = createPacket(c, SYN, c->seq_no, NULL);
+  if (c->compress) {
+    uint8_t codecs = supportedCodecs();
+    addOption(packet, RDT_OPT_CODECS, &codecs, sizeof(codecs));
+  }
+  if (c->offset != 0) {
+    uint64_t offset = htobe64(c->offset);
+    addOption(packet, RDT_OPT_OFFSET, &offset, sizeof(offset));
+  }
+  if (c->transfer_id != 0) {
+    uint64_t id = htobe64(c->transfer_id);
+    addOption(packet, RDT_OPT_TRANSFER_ID, &id, sizeof(id));
+  }
+  if (c->framed) {
+    addOption(packet, RDT_OPT_FRAMED, NULL, 0);
+    addOption(packet, RDT_OPT_PARTIAL, NULL, 0);
+  } else {
+    uint64_t length = htobe64(c->buf_size);
+    addOption(packet, RDT_OPT_LENGTH, &length, sizeof(length));
+  }
+  uint8_t shift = RDT_WINDOW_SHIFT;
+  addOption(packet, RDT_OPT_WINDOW, &shift, sizeof(shift));
+  c->windowed = false;
+  c->snd_wnd = UINT32_MAX;
+  c->delta_block = 0;
+  if (c->delta) {
+    uint32_t block = htonl(deltaBlockSize(c->buf_size));
+    addOption(packet, RDT_OPT_DELTA, &block, sizeof(block));
+  }
+  freeReverse(c);
+  if (c->duplex) {
+    addOption(packet, RDT_OPT_DUPLEX, NULL, 0);
+  }
+  if (c->framed && c->streams) {
+    addOption(packet, RDT_OPT_STREAMS, NULL, 0);
+  }
+  c->multipath = c->socket != NULL && c->socket->paths != NULL;
+  if (c->multipath) {
+    addOption(packet, RDT_OPT_MULTIPATH, NULL, 0);
+  }
+  c->resume_offset = c->offset;
+  c->early = addEarlyData(c, packet);
+  choosePath(c);
+  transmitPacket(c, packet);
+
+  /* Set ITIMER to RTO, starting from 200ms for handshake */
+  if (armTimer(c, c->rto.T_rto) != 0) {
+    perror("Couldn't set timeout");
+  }
+
+  c->state = RDT_STATE_SYN_SENT;
+  return RDT_ACTION_SND_SYN;
+}
+
+/**
+ * CLOSED, passive OPEN: wait for a SYN.
+ */
+int fsmPassiveOpen(RdtState_t* c, const RdtEvent_t* event) {
+  c->state = RDT_STATE_LISTEN;
+  return RDT_INVALID;
+}
+
+/**
+ * ESTABLISHED, SEND: send the next segment of the buffer and wait for its ACK.
+ */
+int fsmSend(RdtState_t* c, const RdtEvent_t* event) {
+  /* A message past its deadline isn't worth sending any more */
+  if (c->expires != 0 && rdtClock() >= c->expires) {
+    return abandonMessage(c);
+  }
+
+  RdtPacket_t* packet = createPacket(c, DATA, c->seq_no, c->buf);
+  uint16_t n = ntohs(packet->header.size);
+
+  /* Calculate RTO based on previous RTT, or use default value of 1s. Multipath: the RTO of the path
+   * the segment goes on, if that's longer; the connection's still backs off as segments time out. */
+  choosePath(c);
+  uint32_t curr_rto = c->multipath ? pathRto(c->socket->paths, c->socket->path) : 0;
+  if (curr_rto < c->rto.T_rto) {
+    curr_rto = c->rto.T_rto;
+  }
+  if (curr_rto == 0) {
+    curr_rto = MIN_RTO;
+  }
+
+  transmitPacket(c, packet);
+
+  /* Set ITIMER for RTO, or the message's deadline if that's sooner. */
+  if (armTimer(c, capToDeadline(c, curr_rto)) != 0) {
+    perror("Couldn't set RTO");
+  }
+
+  c->prev_size = n;
+  c->state = RDT_STATE_DATA_SENT;
+  c->seq_no += (uint32_t) n;
+  return RDT_ACTION_SND_DATA;
+}
+
+/**
+ * LISTEN or ESTABLISHED, SYN received: negotiate the options, take any data in the SYN, and send the
+ * SYN_ACK. A SYN while established is the sender starting over.
+ */
+int fsmRcvSyn(RdtState_t* c, const RdtEvent_t* event) {
+  const RdtPacket_t* received = event->packet;
+
+  /* Options can't be trusted from a corrupt SYN. Wait for the retransmission. */
+  if (!event->intact) {
+    return RDT_INVALID;
+  }
+
+  /* Set sequence number to received sequence number */
+  uint32_t previous = c->seq_init;
+  c->seq_init = received->header.sequence;
+  c->seq_no = c->seq_init;
+
+  /* Negotiate options */
+  c->codec = RDT_CODEC_NONE;
+  c->offset = 0;
+  c->transfer_id = 0;
+  c->complete = false;
+  c->delta_block = 0;
+  c->framed = false;
+  c->partial = false;
+  c->streams = false;
+  c->early = 0;
+  c->length = RDT_LENGTH_UNKNOWN;
+  c->windowed = false;
+  c->duplex = false;
+  c->multipath = false;
+  uint16_t end = parseOptions(c, received);
+  uint64_t start = c->offset;
+  updateWindow(c, received);
+
+  /* rdtServe() finds a connection by the peer's address, so can't follow it to another */
+  if (c->heard != 0) {
+    c->multipath = false;
+  }
+
+  /* Resume a transfer we've seen before from its checkpoint */
+  if (c->transfer_id != 0) {
+    resumeCheckpoint(c);
+  }
+  c->checkpoint_seq = c->seq_init;
+
+  /* Delta mode: our block signatures are sent first, then the sender's delta */
+  if (c->delta_block != 0) {
+    if (c->buf != c->delta_sigs) free(c->buf);
+    free(c->delta_sigs);
+    c->delta_sigs = deltaSignatures(c->basis, c->basis_size, c->delta_block, &c->buf_size);
+    c->buf = c->delta_sigs;
+    if (c->delta_sigs == NULL) {
+      c->delta_block = 0;
+      c->buf_size = 0;
+    }
+  }
+
+  /* Full duplex: the reply goes back on this connection, in a sequence space of its own. A
+   * retransmitted SYN keeps the one already set up, so it matches the SYN_ACK the sender took. */
+  if (c->reverse != NULL && (!c->duplex || c->seq_init != previous)) {
+    freeReverse(c);
+  }
+  if (c->duplex && c->reverse == NULL &&
+      (c->reply == NULL || c->delta_block != 0 || c->framed || openReverse(c, initialSequence(), 0) == NULL)) {
+    c->duplex = false;
+  }
+
+  /* Streams are reassembled from the start again */
+  freeStreams(c);
+  if (c->streams && (!c->framed || openStreams(c) == NULL)) {
+    c->streams = false;
+  }
+
+  /* Reserve room for the whole transfer before any of it arrives */
+  if (c->length != RDT_LENGTH_UNKNOWN) {
+    reserveTransfer(c, start + c->length);
+  }
+
+  /* Data written straight to the output file is staged, and written between signals */
+  c->written = 0;
+  c->stage_epoch++;
+  if (writeThrough(c) && c->stage == NULL) {
+    c->stage = (uint8_t*) malloc(RDT_STAGE_SIZE);
+  }
+
+  /* Take the data that rode in the SYN, after the options' END marker */
+  if (c->early > 0) {
+    if (c->delta_block != 0 || c->framed || end + 1 + c->early > received->header.size ||
+        !storeSegment(c, &received->data[end + 1], c->early)) {
+      c->early = 0;
+    }
+  }
+
+  /* Set remote socket to host that we've received SYN from. Not with inet_ntoa(), whose buffer is shared. */
+  char peer[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &c->socket->receive.addr.sin_addr, peer, sizeof(peer));
+  printf("Receiving bytes from %s...\n", peer);
+  if (setRemoteSocket(c, peer) < 0) {
+    errno = ECONNABORTED;
+    perror("Couldn't set up remote socket. Aborting!");
+    exit(-1);
+  }
+
+  /* Create and send SYN ACK packet, with the chosen codec */
+  RdtPacket_t* packet = createPacket(c, SYN_ACK, c->seq_init, NULL);
+  if (c->codec != RDT_CODEC_NONE) {
+    addOption(packet, RDT_OPT_CODECS, &c->codec, sizeof(c->codec));
+  }
+  if (c->transfer_id != 0) {
+    uint64_t offset = htobe64(c->offset);
+    addOption(packet, RDT_OPT_OFFSET, &offset, sizeof(offset));
+  }
+  if (c->delta_block != 0) {
+    uint32_t block = htonl(c->delta_block);
+    addOption(packet, RDT_OPT_DELTA, &block, sizeof(block));
+  }
+  if (c->framed) {
+    addOption(packet, RDT_OPT_FRAMED, NULL, 0);
+  }
+  if (c->framed && c->partial) {
+    addOption(packet, RDT_OPT_PARTIAL, NULL, 0);
+  }
+  if (c->streams) {
+    addOption(packet, RDT_OPT_STREAMS, NULL, 0);
+  }
+  if (c->multipath) {
+    addOption(packet, RDT_OPT_MULTIPATH, NULL, 0);
+  }
+  if (c->early > 0) {
+    uint16_t early = htons(c->early);
+    addOption(packet, RDT_OPT_EARLY_DATA, &early, sizeof(early));
+  }
+  if (c->windowed) {
+    uint8_t shift = RDT_WINDOW_SHIFT;
+    addOption(packet, RDT_OPT_WINDOW, &shift, sizeof(shift));
+  }
+  if (c->duplex) {
+    uint8_t reply[sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t seq_init = htonl(c->reverse->seq_init);
+    uint64_t length = htobe64(c->reply_size);
+    memcpy(reply, &seq_init, sizeof(seq_init));
+    memcpy(reply + sizeof(seq_init), &length, sizeof(length));
+    addOption(packet, RDT_OPT_DUPLEX, reply, sizeof(reply));
+  }
+  transmitPacket(c, packet);
+  c->state = RDT_STATE_ESTABLISHED;
+
+  /* Start sending block signatures straight away */
+  if (c->delta_block != 0) {
+    return fsmSend(c, event);
+  }
+  return RDT_ACTION_SND_SYN_ACK;
+}
+
+/**
+ * SYN_SENT, SYN_ACK received: adopt the options the receiver accepted, and start the RTT estimate.
+ */
+int fsmRcvSynAck(RdtState_t* c, const RdtEvent_t* event) {
+  const RdtPacket_t* received = event->packet;
+
+  /* Options can't be trusted from a corrupt SYN_ACK. Wait for the retransmission. Nor can a SYN_ACK
+   * for an earlier SYN, which a busy receiver may answer after we've sent it again. */
+  if (!event->intact || received->header.sequence != c->seq_init) {
+    return RDT_INVALID;
+  }
+
+  /* Framing, partial reliability, streams, multipath and windows are only on if the receiver echoes the option */
+  c->framed = false;
+  c->partial = false;
+  c->streams = false;
+  c->multipath = false;
+  c->windowed = false;
+  parseOptions(c, received);
+  updateWindow(c, received);
+  c->state = RDT_STATE_ESTABLISHED;
+
+  /* Delta mode: receive the block signatures before sending */
+  if (c->delta_block != 0) {
+    c->buf = NULL;
+    c->buf_size = 0;
+  }
+
+  /* Warm start from the estimate cached for this peer. The handshake is also an RTT sample,
+   * unless the receiver computed signatures before replying. */
+  uint32_t throughput = 0;
+  if (rtoCacheSeed(&c->rto, c->socket->remote->addr.sin_addr.s_addr, &throughput)) {
+    printf("Warm start: RTO %.1fms, last throughput %u bytes/s.\n", US_TO_MS(c->rto.T_rto), throughput);
+  }
+  if (received->header.echo != 0 && c->delta_block == 0) {
+    c->rtt = calculateRTTEcho(received->header.echo);
+    recordRTT(c, c->rtt);
+    calculateRTO(&c->rto, c->rtt);
+  }
+  c->retries = 0;
+  c->avg_rtt = 0;
+  c->rtt_counter = 0;
+
+  c->seq_start = c->seq_no;
+  if (rtoClock(&c->established) != 0) {
+    perror("Couldn't get connection start time.");
+  }
+  return RDT_INVALID;
+}
+
+/**
+ * SYN_SENT, RTO: send the SYN again with a doubled RTO, or give up.
+ */
+int fsmSynTimeout(RdtState_t* c, const RdtEvent_t* event) {
+  c->state = RDT_STATE_CLOSED;
+
+  if (c->retries < RDT_MAX_RETRIES) {
+    c->retries++;
+    c->stats.retransmits_syn++;
+    rtoBackoff(&c->rto);  // Double RTO
+    return fsmActiveOpen(c, event);
+  }
+
+  return fsmAbort(c, event);
+}
+
+/**
+ * ESTABLISHED, DATA received: store the segment if it's the next one, and ACK what we have.
+ */
+int fsmRcvData(RdtState_t* c, const RdtEvent_t* event) {
+  const RdtPacket_t* received = event->packet;
+
+  /* Re-ACK packets that are corrupt, that we already have, or that are ahead of the one we expect
+   * (so one was likely dropped). Going back to a duplicate's sequence number would undo what's been
+   * received since, if it arrived late. */
+  if (!event->intact || received->header.sequence != c->seq_no) {
+    c->stats.segments_duplicate += event->intact;
+    return sendAck(c);
+  }
+
+  /* Sequence number is expected */
+  if (!storeSegment(c, received->data, received->header.size)) {
+    return RDT_INVALID; // Don't ACK; the sender will retransmit.
+  }
+
+  c->state = RDT_STATE_ESTABLISHED;
+  return sendAck(c);
+}
+
+/**
+ * ESTABLISHED, DATA_SENT or PERSIST, CLOSE: send a FIN, starting from the handshake RTO.
+ */
+int fsmClose(RdtState_t* c, const RdtEvent_t* event) {
+  /* If this is the first attempt, set RTO to 200ms */
+  if (c->rto.T_rto == 0) {
+    c->rto.T_rto = HANDSHAKE_RTO;
+  }
+
+  choosePath(c);
+  transmitPacket(c, createPacket(c, FIN, c->seq_no, NULL));
+
+  /* Set ITIMER for RTO */
+  if (armTimer(c, c->rto.T_rto) != 0) {
+    perror("Couldn't set timeout");
+  }
+
+  c->state = RDT_STATE_FIN_SENT;
+  return RDT_ACTION_SND_FIN;
+}
+
+/**
+ * ESTABLISHED, FIN received: the transfer is complete.
+ */
+int fsmRcvFin(RdtState_t* c, const RdtEvent_t* event) {
+  transmitPacket(c, createPacket(c, FIN_ACK, event->packet->header.sequence, NULL));
+
+  c->state = RDT_STATE_CLOSED;
+  c->complete = true;
+  if (c->reverse == NULL) {
+    setRemoteSocket(c, NULL); // Full duplex: the other direction still needs the peer.
+  }
+  printf("Done!\n");
+  return RDT_ACTION_SND_FIN_ACK;
+}
+
+/**
+ * DATA_SENT, ACK received: take the RTT sample, then send the next segment, or the segment the ACK
+ * asks for, or go back to ESTABLISHED once everything is acknowledged. Wait in PERSIST if the
+ * receiver has no room.
+ */
+int fsmRcvAck(RdtState_t* c, const RdtEvent_t* event) {
+  const RdtPacket_t* received = event->packet;
+
+  /* Calculate the RTT in microseconds from the echoed timestamp. It names the transmission
+   * being acknowledged, so retransmitted segments give valid samples too. */
+  if (received->header.echo != 0) {
+    c->rtt = calculateRTTEcho(received->header.echo);
+    recordRTT(c, c->rtt);
+
+    /* Calculate averate RTT */
+    if (c->rtt_counter > 0) {
+      double temp = c->rtt + (c->avg_rtt * c->rtt_counter);
+      c->rtt_counter++;
+      c->avg_rtt = (double) (temp / c->rtt_counter);
+    } else {
+      c->avg_rtt = (double) c->rtt;
+      c->rtt_counter = 1;
+    }
+
+    /* Calculate next RTO */
+    calculateRTO(&c->rto, c->rtt);
+  }
+
+  /* Once a message is abandoned, only the ACK of the FORWARD past it counts. The rest of the
+   * message isn't sent again, whatever an earlier ACK asks for. */
+  if (c->abandoned && received->header.sequence < c->seq_no) {
+    return RDT_INVALID;
+  }
+
+  /* An ACK for less than we've sent asks for the rest again. This includes a stale or
+   * duplicated ACK arriving after the last segment went out, which mustn't finish the transfer. */
+  if (received->header.sequence < c->seq_no) {
+    c->seq_no = received->header.sequence;
+    c->stats.retransmits_ack++;
+  }
+
+  /* If the whole buffer hasn't been sent, send the next packet, once the receiver has room for it. */
+  updateWindow(c, received);
+  if ((c->seq_no - c->seq_init) < c->buf_size) {
+    c->retries = 0;
+    if (c->snd_wnd == 0) {
+      return enterPersist(c);
+    }
+    return fsmSend(c, event);
+  }
+
+  /* If whole buffer has been sent, return to the established state. The RTO is kept for
+   * the next message on a persistent connection, and reset by rdtClose(). */
+  c->state = RDT_STATE_ESTABLISHED;
+  c->retries = 0;
+
+  /* Receiver in delta mode: signatures are done, the delta comes next */
+  if (c->delta_sigs != NULL) {
+    endSignaturePhase(c);
+  }
+  return RDT_INVALID;
+}
+
+/**
+ * DATA_SENT, ACK with a zero window: wait for the window to open, probing it when the persist timer
+ * goes off in case the update that opens it is lost. The timer starts at the RTO.
+ * @param c The connection.
+ * @return int RDT_INVALID.
+ */
+int enterPersist(RdtState_t* c) {
+  c->persist = c->rto.T_rto > 0 ? c->rto.T_rto : MIN_RTO;
+  if (armTimer(c, capToDeadline(c, c->persist)) != 0) {
+    perror("Couldn't set persist timer");
+  }
+
+  c->state = RDT_STATE_PERSIST;
+  return RDT_INVALID;
+}
+
+/**
+ * PERSIST, ACK received: a window update, or the answer to a probe. Carry on sending if the window
+ * has opened.
+ */
+int fsmPersistAck(RdtState_t* c, const RdtEvent_t* event) {
+  updateWindow(c, event->packet);
+  c->retries = 0;
+
+  if (c->snd_wnd > 0) {
+    return fsmSend(c, event);
+  }
+  return RDT_INVALID;
+}
+
+/**
+ * PERSIST, persist timer: probe the window with an empty segment, and back off. Give up if several
+ * probes in a row go unanswered.
+ */
+int fsmPersistTimeout(RdtState_t* c, const RdtEvent_t* event) {
+  if (c->expires != 0 && rdtClock() >= c->expires) {
+    return abandonMessage(c);
+  }
+  if (c->retries >= RDT_MAX_RETRIES) {
+    c->state = RDT_STATE_CLOSED;
+    dropReverse(c);
+    return RDT_INVALID;
+  }
+  c->retries++;
+
+  transmitPacket(c, createPacket(c, DATA, c->seq_no, c->buf));  // No data fits a zero window.
+
+  c->persist = c->persist * 2 > MAX_RTO ? MAX_RTO : c->persist * 2;
+  if (armTimer(c, capToDeadline(c, c->persist)) != 0) {
+    perror("Couldn't set persist timer");
+  }
+  return RDT_ACTION_SND_DATA;
+}
+
+/**
+ * DATA_SENT, DATA received. In delta mode, the sender only sends once it has all of our signatures,
+ * so this stands in for a lost final ACK.
+ */
+int fsmRcvDataWhileSending(RdtState_t* c, const RdtEvent_t* event) {
+  if (c->delta_sigs != NULL && event->packet->header.sequence >= c->seq_no) {
+    endSignaturePhase(c);
+    c->state = RDT_STATE_ESTABLISHED;
+    return fsmRcvData(c, event);
+  }
+  return RDT_INVALID;
+}
+
+/**
+ * DATA_SENT, RTO: send the segment (or the FORWARD past an abandoned message) again with a doubled
+ * RTO, or give up. At a message's deadline, abandon it instead; the RTO isn't doubled, as the timer
+ * was cut short.
+ */
+int fsmDataTimeout(RdtState_t* c, const RdtEvent_t* event) {
+  if (c->expires != 0 && rdtClock() >= c->expires) {
+    return abandonMessage(c);
+  }
+
+  if (c->retries < RDT_MAX_RETRIES) {
+    c->retries++;
+    c->stats.retransmits_rto++;
+    rtoBackoff(&c->rto);  // Double RTO
+    if (c->abandoned) {
+      return sendForward(c);
+    }
+    c->seq_no -= c->prev_size;  // Reduce sequence number to last ACK'd.
+    return fsmSend(c, event);
+  }
+
+  c->state = RDT_STATE_CLOSED;
+  dropReverse(c);
+  return RDT_INVALID;
+}
+
+/**
+ * DATA_SENT or PERSIST, a message's deadline passed: stop sending it, and move the receiver past it
+ * with a FORWARD. The FORWARD is retransmitted until it's acknowledged, like a segment, as the next
+ * message can't be delivered until the receiver has skipped this one.
+ * @param c The connection.
+ * @return int RDT_ACTION_SND_FORWARD.
+ */
+int abandonMessage(RdtState_t* c) {
+  c->abandoned = true;
+  c->expires = 0;
+  c->retries = 0;
+  c->seq_no = c->seq_init + c->buf_size;
+  c->stats.messages_abandoned++;
+  return sendForward(c);
+}
+
+/**
+ * Sends the FORWARD past the abandoned message: its sequence number is the message's end, and its
+ * payload the sequence number the message started at.
+ * @param c The connection.
+ * @return int RDT_ACTION_SND_FORWARD.
+ */
+int sendForward(RdtState_t* c) {
+  RdtPacket_t* packet = createPacket(c, FORWARD, c->seq_no, NULL);
+  uint32_t start = htonl(c->seq_init);
+
+  memcpy(packet->data, &start, sizeof(start));
+  packet->header.size = htons(sizeof(start));
+  packet->header.checksum = 0;
+  packet->header.checksum = ipv4_header_checksum(packet, sizeof(RdtHeader_t) + sizeof(start));
+  transmitPacket(c, packet);
+
+  if (armTimer(c, c->rto.T_rto > 0 ? c->rto.T_rto : MIN_RTO) != 0) {
+    perror("Couldn't set RTO");
+  }
+
+  c->state = RDT_STATE_DATA_SENT;
+  return RDT_ACTION_SND_FORWARD;
+}
+
+/**
+ * A timer, cut short so it goes off by the deadline of the message being sent, if it has one.
+ * @param c The connection.
+ * @param us The timer (us).
+ * @return The timer (us), or the time left until the deadline if that's less.
+ */
+uint32_t capToDeadline(const RdtState_t* c, uint32_t us) {
+  if (c->expires == 0) {
+    return us;
+  }
+
+  uint64_t now = rdtClock();
+  if (now >= c->expires) {
+    return 1;
+  }
+  return c->expires - now < us ? (uint32_t) (c->expires - now) : us;
+}
+
+/**
+ * ESTABLISHED, FORWARD received: the sender gave up on a message. Skip to its end, and mark its frame
+ * abandoned so rdtNextMessage() passes over what arrived of it. Anything else is answered with an ACK
+ * of what we have, which a repeated FORWARD needs if our last ACK was lost.
+ */
+int fsmRcvForward(RdtState_t* c, const RdtEvent_t* event) {
+  const RdtPacket_t* received = event->packet;
+  uint32_t start;
+  uint32_t length;
+
+  if (!event->intact || !c->framed || !c->partial || received->header.size != sizeof(start)) {
+    return sendAck(c);
+  }
+
+  /* Positions in the buffer. The message must start no later than what we have, end after it, be no
+   * bigger than a message with a lifetime can be, and match its frame's length if that has arrived. */
+  memcpy(&start, received->data, sizeof(start));
+  start = ntohl(start) - c->seq_init;
+  uint32_t have = c->seq_no - c->seq_init;
+  uint32_t end = received->header.sequence - c->seq_init;
+  if (start > have || end <= have || end - start < RDT_FRAME_HEADER ||
+      end - start - RDT_FRAME_HEADER > RDT_MAX_PARTIAL) {
+    return sendAck(c);
+  }
+  if (have - start >= RDT_FRAME_HEADER) {
+    memcpy(&length, c->buf + start, sizeof(length));
+    if (ntohl(length) != end - start - RDT_FRAME_HEADER) {
+      return sendAck(c);
+    }
+  }
+
+  if (!growBuffer(c, end)) {
+    return RDT_INVALID; // Don't ACK; the sender will retransmit.
+  }
+  memset(c->buf + have, 0, end - have);
+  length = htonl((end - start - RDT_FRAME_HEADER) | RDT_FRAME_ABANDONED);
+  memcpy(c->buf + start, &length, sizeof(length));
+
+  c->seq_no = received->header.sequence;
+  c->stats.messages_abandoned++;
+  return sendAck(c);
+}
+
+/**
+ * FIN_SENT, FIN_ACK received: closed.
+ */
+int fsmRcvFinAck(RdtState_t* c, const RdtEvent_t* event) {
+  c->state = RDT_STATE_CLOSED;
+  printf("Connection terminated gracefully!\n");
+  return RDT_INVALID;
+}
+
+/**
+ * FIN_SENT, RTO: send the FIN again with a doubled RTO, or reset the connection.
+ */
+int fsmFinTimeout(RdtState_t* c, const RdtEvent_t* event) {
+  if (c->retries < RDT_MAX_RETRIES) {
+    c->retries++;
+    c->stats.retransmits_fin++;
+    rtoBackoff(&c->rto);  // Double RTO
+    return fsmClose(c, event);
+  }
+
+  int output = fsmAbort(c, event);
+  printf("Unable to terminate gracefully. Terminating abruptly!\n");
+  return output;
+}
+
+/* Handler by state and input. NULL entries go to the state's entry in fsm_defaults. */
+const FsmHandler_t fsm_table[FSM_STATES][FSM_INPUTS] = {
+  [FSM_ROW(RDT_STATE_CLOSED)] = {
+    [RDT_INPUT_ACTIVE_OPEN]   = fsmActiveOpen,
+    [RDT_INPUT_PASSIVE_OPEN]  = fsmPassiveOpen,
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+  },
+  [FSM_ROW(RDT_STATE_LISTEN)] = {
+    [RDT_EVENT_RCV_SYN]       = fsmRcvSyn,
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+  },
+  [FSM_ROW(RDT_STATE_SYN_SENT)] = {
+    [RDT_EVENT_RCV_SYN_ACK]   = fsmRcvSynAck,
+    [RDT_EVENT_RCV_DATA]      = fsmIgnore,      // Block signatures sent after a lost SYN_ACK. The SYN retransmission recovers.
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+    [RDT_EVENT_RTO]           = fsmSynTimeout,
+  },
+  [FSM_ROW(RDT_STATE_SYN_RCVD)] = {
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+  },
+  [FSM_ROW(RDT_STATE_ESTABLISHED)] = {
+    [RDT_INPUT_CLOSE]         = fsmClose,
+    [RDT_INPUT_SEND]          = fsmSend,
+    [RDT_EVENT_RCV_SYN]       = fsmRcvSyn,
+    [RDT_EVENT_RCV_DATA]      = fsmRcvData,
+    [RDT_EVENT_RCV_FORWARD]   = fsmRcvForward,
+    [RDT_EVENT_RCV_FIN]       = fsmRcvFin,
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+  },
+  [FSM_ROW(RDT_STATE_DATA_SENT)] = {
+    [RDT_INPUT_CLOSE]         = fsmClose,
+    [RDT_EVENT_RCV_DATA]      = fsmRcvDataWhileSending,
+    [RDT_EVENT_RCV_ACK]       = fsmRcvAck,
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+    [RDT_EVENT_RTO]           = fsmDataTimeout,
+  },
+  [FSM_ROW(RDT_STATE_FIN_SENT)] = {
+    [RDT_EVENT_RCV_FIN_ACK]   = fsmRcvFinAck,
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+    [RDT_EVENT_RTO]           = fsmFinTimeout,
+  },
+  [FSM_ROW(RDT_STATE_FIN_RCV)] = {
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+  },
+  [FSM_ROW(RDT_STATE_PERSIST)] = {
+    [RDT_INPUT_CLOSE]         = fsmClose,
+    [RDT_EVENT_RCV_ACK]       = fsmPersistAck,
+    [RDT_EVENT_RCV_RST]       = fsmRcvRst,
+    [RDT_EVENT_RTO]           = fsmPersistTimeout,
+  },
+};
+
+/* What a state does with any other input */
+const FsmHandler_t fsm_defaults[FSM_STATES] = {
+  [FSM_ROW(RDT_STATE_CLOSED)]       = fsmIgnore,
+  [FSM_ROW(RDT_STATE_LISTEN)]       = fsmAbort,
+  [FSM_ROW(RDT_STATE_SYN_SENT)]     = fsmRefuse,
+  [FSM_ROW(RDT_STATE_SYN_RCVD)]     = fsmInvalid,
+  [FSM_ROW(RDT_STATE_ESTABLISHED)]  = fsmIgnore,
+  [FSM_ROW(RDT_STATE_DATA_SENT)]    = fsmIgnore,
+  [FSM_ROW(RDT_STATE_FIN_SENT)]     = fsmAbort,
+  [FSM_ROW(RDT_STATE_FIN_RCV)]      = fsmInvalid,
+  [FSM_ROW(RDT_STATE_PERSIST)]      = fsmIgnore,
+};
+
+/**
+ * RDT Finite State Machine. Runs the handler for the connection's state and the event's input.
+ * @param c The connection.
+ * @param event The input, with the packet if one was received.
+ */
+void rdtFsm(RdtState_t* c, const RdtEvent_t* event) {
+  int old_state = c->state;
+  int input = event->input > RDT_INVALID && event->input < FSM_INPUTS ? event->input : RDT_INVALID;
+  FsmHandler_t handler;
+
+  if (c->state >= RDT_STATE_CLOSED && c->state <= RDT_STATE_PERSIST) {
+    handler = fsm_table[FSM_ROW(c->state)][input];
+    if (handler == NULL) {
+      handler = fsm_defaults[FSM_ROW(c->state)];
+    }
+  } else {
+    handler = input == RDT_EVENT_RCV_RST ? fsmRcvRst : fsmInvalid;
+  }
+
+  trackPath(c, event);
+  int output = handler(c, event);
+
+  rdtTrace(old_state, c->state, event->input, output, c->seq_no - c->seq_init, c->buf_size, c->sender);
+  printProgress(c, event->input);
+}
+
+/**
+ * Runs an input that has no packet (RDT_INPUT_*, RDT_EVENT_RTO) through the FSM of G_conn.
+ * @param input
+ */
+void fsm(int input) {
+  fsmInput(G_conn, input);
+}
+
+/**
+ * Runs an input that has no packet through the FSM of a connection.
+ * @param c The connection.
+ * @param input
+ */
+void fsmInput(RdtState_t* c, int input) {
+  RdtEvent_t event = { input, NULL, false };
+
+  rdtFsm(c, &event);
+}
+/* FSM END */
+
+
+/* OTHER*/
 /**
  * Converts the value of the type field in RDT header to an RDT EVENT.
  * These EVENTS are used by the FSM.
@@ -863,16 +4027,19 @@ int rdtTypeToRdtEvent(RDTPacketType_t type) {
     case FIN:         return RDT_EVENT_RCV_FIN;
     case FIN_ACK:     return RDT_EVENT_RCV_FIN_ACK;
     case RST:         return RDT_EVENT_RCV_RST;
+    case FORWARD:     return RDT_EVENT_RCV_FORWARD;
     default:          return RDT_INVALID;
   }
 }
 
 /**
  * Prints progress for sender.
+ * @param c The connection.
+ * @param input The input just handled.
  */
-void printProgress(int input) {
-  if (G_sender && G_state == RDT_STATE_DATA_SENT && input == RDT_EVENT_RCV_ACK && !G_debug) {
-    double progress = (double) (((double) (G_seq_no - G_seq_init) / (double) G_buf_size)) * 100.0;
+void printProgress(RdtState_t* c, int input) {
+  if (c->sender && c->state == RDT_STATE_DATA_SENT && input == RDT_EVENT_RCV_ACK && !G_debug) {
+    double progress = (double) (((double) (c->seq_no - c->seq_init) / (double) c->buf_size)) * 100.0;
     if (progress > 0.0) {
       printf("\b\b\b\b\b\b\b\b");
     }
@@ -6,8 +6,10 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "UdpSocket/UdpSocket.h"
+#include "rto/rto.h"
 
 
 /* MACROS START */
@@ -15,16 +17,56 @@
 #define RDT_MAX_ERROR             ((int) 5)
 #define RDT_MAX_RETRIES           ((int) 5)
 #define RDT_TIMEOUT_200MS         (200000)
+#define RDT_MAX_RESUMES           ((int) 5)
+#define RDT_CHECKPOINT_INTERVAL   ((uint32_t) 1048576)
+#define RDT_FRAME_HEADER          ((uint32_t) 4)
+#define RDT_FRAME_ABANDONED       ((uint32_t) 0x80000000)  // Receiver: flag on a frame's length. The sender gave up on the message.
+#define RDT_MAX_PARTIAL           ((uint32_t) 16777216) // Largest message sent with a lifetime, so a FORWARD skips at most this far.
+#define RDT_STREAMS               ((uint16_t) 16)       // Streams a connection can carry, with IDs 0 to RDT_STREAMS - 1.
+#define RDT_CHUNK_HEADER          ((uint32_t) 8)        // Streams: stream ID, length and stream offset before each chunk.
+#define RDT_RTO_CACHE             ".rdt_rto_cache"
+#define RDT_RTT_BUCKETS           ((int) 27)
+#define RDT_LENGTH_UNKNOWN        UINT64_MAX  // No LENGTH option: a stream, or a sender that doesn't say.
+#define RDT_STAGE_SIZE            ((uint32_t) 1048576)  // Receiver: data waiting to be written to the output file.
+#define RDT_WINDOW_SHIFT          ((uint8_t) 5)         // Scale of the windows we advertise, so they reach 2 MiB.
+#define RDT_WINDOW_MAX            ((uint16_t) 0xFFFF)
+#define RDT_SERVER_CONNECTIONS    ((uint32_t) 8192)     // Most connections rdtServe() has open at once.
+#define RDT_IDLE_TIMEOUT          ((uint64_t) 60000000) // rdtServe(): a connection heard nothing from for this long (us) is dropped.
+#define RDT_SERVER_RCVBUF         ((int) 4194304)       // rdtServe(): socket receive buffer (bytes), if the system allows it.
+#define RDT_IDLE_CHECK            ((uint64_t) 1000000)  // rdtServe(): how often to look for idle connections (us).
 /* MACROS END */
 
 
+/* ASYNC STEPS START */
+#define RDT_ASYNC_NONE            ((int) 0)   // No rdtSendAsync() or rdtListenAsync() under way.
+#define RDT_ASYNC_OPENING         ((int) 1)   // Sender: handshake, and in delta mode the block signatures.
+#define RDT_ASYNC_SENDING         ((int) 2)   // Sender: the data.
+#define RDT_ASYNC_RECEIVING       ((int) 3)   // Receiver: until the connection closes and what it staged is written.
+#define RDT_ASYNC_CLOSING         ((int) 4)   // Either: waiting for the connection to close, to call done.
+/* ASYNC STEPS END */
+
+
+/* SYN OPTIONS START */
+#define RDT_OPT_END               ((uint8_t) 0)
+#define RDT_OPT_CODECS            ((uint8_t) 1)
+#define RDT_OPT_OFFSET            ((uint8_t) 2)
+#define RDT_OPT_TRANSFER_ID       ((uint8_t) 3)
+#define RDT_OPT_DELTA             ((uint8_t) 4)
+#define RDT_OPT_FRAMED            ((uint8_t) 5)
+#define RDT_OPT_EARLY_DATA        ((uint8_t) 6)
+#define RDT_OPT_LENGTH            ((uint8_t) 7)
+#define RDT_OPT_WINDOW            ((uint8_t) 8)
+#define RDT_OPT_DUPLEX            ((uint8_t) 9)
+#define RDT_OPT_PARTIAL           ((uint8_t) 10)
+#define RDT_OPT_STREAMS           ((uint8_t) 11)
+#define RDT_OPT_MULTIPATH         ((uint8_t) 12)
+/* SYN OPTIONS END */
+
+
 /* EXTERNAL GLOBAL VARIABLES START */
-extern uint8_t* G_buf;
-extern uint32_t G_buf_size;
-extern uint32_t G_seq_no;
-extern uint32_t G_seq_init;
-extern double G_avg_rtt;
+extern struct RdtState_s* G_conn;
 extern bool G_debug;
+extern uint32_t (*G_isn_hook)(void);
 /* EXTERNAL GLOBAL VARIABLES END */
 
 
@@ -36,7 +78,8 @@ typedef enum {
   ACK       = ((uint16_t) 3),
   FIN       = ((uint16_t) 4),
   FIN_ACK   = ((uint16_t) 5),
-  RST       = ((uint16_t) 6)
+  RST       = ((uint16_t) 6),
+  FORWARD   = ((uint16_t) 7)    // Partially reliable: sequence is where the receiver skips to, data the start of the abandoned message.
 } RDTPacketType_t;
 
 typedef struct RdtHeader_s {
@@ -44,7 +87,10 @@ typedef struct RdtHeader_s {
   uint16_t            type;
   uint16_t            checksum;
   uint16_t            size;
-  uint16_t            padding;
+  uint16_t            window;     // Bytes the sender of this packet can take, >> its window shift.
+  uint32_t            timestamp;  // Sender's clock when sent (us, CLOCK_MONOTONIC).
+  uint32_t            echo;       // Timestamp of the last intact packet received from the peer, or 0.
+  uint32_t            ack;        // Full duplex, DATA: next sequence number expected of the peer's data.
 } RdtHeader_t;
 
 typedef struct RdtPacket_s {
@@ -57,15 +103,184 @@ typedef struct RdtSocket_s {
   UdpSocket_t* remote;
   UdpSocket_t receive;
   int         state;
+  struct PathSet_s* paths;  // Multipath: addresses to send from and to, with the remote port. NULL for local to remote only.
+  uint16_t    path;         // Multipath: path of the last SYN, DATA or FIN sent.
+  bool        in_flight;    // Multipath: that packet hasn't been answered yet.
 } RdtSocket_t;
+
+typedef struct RdtStats_s {
+  uint64_t bytes_sent;                      // DATA payload sent, including retransmissions.
+  uint64_t bytes_received;                  // DATA payload received in order.
+  uint32_t packets_sent;                    // Datagrams of any type.
+  uint32_t packets_received;                // Datagrams of any type.
+  uint32_t segments_sent;                   // DATA segments, including retransmissions.
+  uint32_t segments_received;               // DATA segments received in order.
+  uint32_t segments_duplicate;              // DATA segments received again or out of order.
+  uint32_t retransmits_rto;                 // DATA retransmitted after an RTO.
+  uint32_t retransmits_ack;                 // DATA resent because an ACK asked for an earlier sequence.
+  uint32_t retransmits_syn;                 // SYN retransmitted after an RTO.
+  uint32_t retransmits_fin;                 // FIN retransmitted after an RTO.
+  uint32_t checksum_failures;               // Datagrams received with a bad checksum.
+  uint32_t rst_sent;
+  uint32_t rst_received;
+  uint32_t acks_sent;                       // ACKs sent on their own.
+  uint32_t acks_piggybacked;                // Full duplex: ACKs that rode on a DATA segment instead.
+  uint32_t messages_abandoned;              // Partially reliable: messages given up on at their deadline.
+  uint32_t rto;                             // Current RTO (us).
+  uint32_t rtt_samples;
+  uint32_t rtt_min;                         // Smallest RTT sample (us).
+  uint32_t rtt_max;                         // Largest RTT sample (us).
+  uint32_t rtt_histogram[RDT_RTT_BUCKETS];  // Bucket i counts RTT samples in [2^i, 2^(i+1)) us.
+} RdtStats_t;
+
+/* Everything about one connection. fsm() and the API work on G_conn, and the _r API on the one it's given. */
+typedef struct RdtState_s {
+  RdtSocket_t*    socket;           // Socket of the connection.
+  uint32_t        ts_recent;        // Timestamp of the last intact packet received, echoed in ours.
+  RdtStats_t      stats;            // Counters for the current (or last) connection.
+  uint32_t        seq_init;         // Initial sequence number.
+  uint32_t        seq_no;           // Current sequence number.
+  uint32_t        rtt;              // RTT for last segment in microseconds (us).
+  uint8_t*        buf;              // Data buffer for sending or receiving.
+  uint32_t        buf_size;         // Size of buf. Sender: bytes to send, which includes the frame prefix if there is one.
+  uint8_t         frame[RDT_FRAME_HEADER]; // Sender: length prefix of the message being sent, sent ahead of buf.
+  uint8_t         frame_size;       // Sender: bytes of 'frame' in use, 0 if the data isn't a message.
+  uint16_t        prev_size;        // Size of previous packet sent.
+  int             errors;           // Error counter. Will cause transmission to stop if too many errors encountered.
+  int             retries;          // Retries of the packet in flight.
+  int             state;            // FSM state.
+  bool            sender;           // Whether in send or receive mode.
+  bool            compress;         // Whether to offer compression in SYN.
+  uint8_t         codec;            // Codec negotiated in the handshake.
+  uint64_t        offset;           // Position of this transfer within the file (striping).
+  uint64_t        length;           // Receiver: bytes in the transfer, from the SYN, or RDT_LENGTH_UNKNOWN.
+  int             out_fd;           // If set, receiver writes data straight to this file.
+  uint64_t        transfer_id;      // Identifies a resumable transfer. 0 if not resumable.
+  uint64_t        resume_offset;    // Sender: file position the receiver asked us to resume from.
+  const char*     checkpoint_path;  // Receiver: where to keep the checkpoint of committed bytes.
+  uint32_t        checkpoint_seq;   // Receiver: sequence number at the last checkpoint.
+  bool            complete;         // Receiver: whether the last connection ended with a FIN.
+  bool            delta;            // Sender: request delta mode. Receiver: allow it against basis.
+  uint32_t        delta_block;      // Block size negotiated for delta mode. 0 if not in delta mode.
+  uint8_t*        delta_sigs;       // Receiver: signature stream being sent to the sender.
+  uint8_t*        basis;            // Receiver: current copy of the output, for delta mode.
+  uint32_t        basis_size;       // Receiver: size of basis.
+  bool            framed;           // Persistent connection carrying length-prefixed messages.
+  uint16_t        early;            // Bytes of data carried in the SYN (0-RTT data).
+  uint32_t        seq_start;        // Sender: sequence number the connection was established at.
+  struct timespec established;      // Sender: when the connection was established.
+  double          avg_rtt;          // Average RTT.
+  uint32_t        rtt_counter;      // Number of times RTT average has been calculated.
+  bool            windowed;         // Both ends advertise receive windows (negotiated in the handshake).
+  uint8_t         snd_shift;        // Scale of the peer's window advertisements.
+  uint32_t        snd_wnd;          // Bytes the peer can take past what it has acknowledged. UINT32_MAX if not windowed.
+  uint32_t        persist;          // Sender: persist timer (us), doubled after each zero window probe.
+  bool            wnd_closed;       // Receiver: the last window advertised was zero.
+  uint8_t*        stage;            // Receiver: ring of RDT_STAGE_SIZE bytes received but not yet written to out_fd.
+  uint32_t        written;          // Receiver: bytes of the transfer written to out_fd.
+  uint32_t        stage_epoch;      // Receiver: changes when a SYN restarts the transfer.
+  uint64_t        deadline;         // When the connection's timer goes off (us, rdtClock()), or 0 if it isn't set.
+  uint64_t        heard;            // rdtServe(): when the last packet from the peer arrived (us).
+  bool            queued;           // rdtServe(): waiting for the main loop to write its staged data, or finish it.
+  void*           user;             // For the program, e.g. what the rdtServe() accept hook set up for the connection.
+  RtoState_t      rto;              // RTO estimator.
+  bool            polled;           // Driven by the thread waiting in the _r API, with poll(), rather than by signals.
+  int             async;            // Step of an rdtSendAsync() or rdtListenAsync() transfer. RDT_ASYNC_*.
+  const struct RdtCallbacks_s* callbacks;  // Of the asynchronous transfer, or NULL.
+  int             result;           // Asynchronous transfer: 0 so far, -1 once it has failed.
+  uint64_t        reported;         // Asynchronous transfer: bytes last given to the progress callback.
+  const uint8_t*  source;           // Sender: the data given to rdtSendAsync(), until it's prepared for sending.
+  uint32_t        source_size;      // Sender: size of source.
+  uint8_t*        encoded;          // Sender: compressed copy of the data, if compressing.
+  uint8_t*        delta_data;       // Sender: delta encoding of the data, in delta mode.
+  bool            duplex;           // Sender: ask for a full-duplex connection. Receiver: the sender asked for one.
+  const uint8_t*  reply;            // Receiver: data to send back to a sender that asks for full duplex, or NULL.
+  uint32_t        reply_size;       // Receiver: size of reply.
+  struct RdtState_s* reverse;       // Full duplex: the other direction, with its own sequence space, on the same socket.
+  bool            ack_deferred;     // Full duplex, receiving: ACKs wait to ride on the next DATA going the other way.
+  bool            ack_pending;      // Full duplex, receiving: an ACK is waiting to be sent.
+  bool            partial;          // Framed: messages may be abandoned at their deadline (negotiated in the handshake).
+  uint64_t        expires;          // Sender: when the message being sent is abandoned (us, rdtClock()), or 0 if never.
+  bool            abandoned;        // Sender: the message was abandoned, and a FORWARD moves the receiver past it.
+  bool            streams;          // Framed: messages go on streams (negotiated in the handshake). Set to ask for them.
+  struct RdtStreams_s* stream_set;  // Streams: queues of the sender, or reassembly of the receiver.
+  const struct RdtStreamHooks_s* stream_hooks;  // Receiver: told of each message as it completes, or NULL.
+  bool            multipath;        // Sender: packets go on the socket's paths. Receiver: answers go back the way each packet came. Negotiated in the handshake.
+} RdtState_t;
+
+/* Callbacks of rdtServe(). Each gets the connection it's about, with arg. */
+typedef struct RdtServerHooks_s {
+  int   (*accept)(RdtState_t* c, void* arg);              // New peer. Set up c (e.g. out_fd). Non-zero refuses it.
+  void  (*done)(RdtState_t* c, uint32_t n, void* arg);    // Connection closed after receiving n bytes. c->complete if it ended with a FIN.
+  void* arg;
+} RdtServerHooks_t;
+
+/* Callbacks of rdtSendAsync() and rdtListenAsync(), called from rdtProcess(). Each gets the connection, with arg. */
+typedef struct RdtCallbacks_s {
+  void  (*progress)(RdtState_t* c, uint64_t bytes, uint64_t total, void* arg);  // More acknowledged (sender) or received. total may be RDT_LENGTH_UNKNOWN.
+  void  (*error)(RdtState_t* c, int error, void* arg);  // The transfer failed: ETIMEDOUT, ECONNREFUSED, ECONNRESET, ENOMEM or EIO. done follows.
+  void  (*done)(RdtState_t* c, int result, uint32_t n, void* arg);  // Closed. result 0, or -1 if it failed. n bytes sent or received. c may be freed here.
+  void* arg;
+} RdtCallbacks_t;
+
+/* Callback of a receiver with streams, from rdtListen() as each message on a stream completes. */
+typedef struct RdtStreamHooks_s {
+  void  (*message)(RdtState_t* c, uint16_t stream, const uint8_t* data, uint32_t n, void* arg);  // data is only valid during the call.
+  void* arg;
+} RdtStreamHooks_t;
+
+/* One input to fsm() */
+typedef struct RdtEvent_s {
+  int                 input;        // RDT_INPUT_* or RDT_EVENT_*.
+  const RdtPacket_t*  packet;       // For RDT_EVENT_RCV_*, the packet, header in host byte order. Else NULL.
+  bool                intact;       // Whether the packet's checksum matched.
+} RdtEvent_t;
 /* STRUCTS END */
 
 
 /* FUNCTIONS START */
 RdtSocket_t* setupRdtSocket_t(const char* hostname, const uint16_t port);
+RdtSocket_t* setupRdtSocketFrom_t(const char* hostname, const uint16_t port, const uint16_t local_port);
+RdtSocket_t* setupRdtSocketReusePort_t(const uint16_t port);
 void closeRdtSocket_t(RdtSocket_t* socket);
-void rdtSend(RdtSocket_t* socket, const void* buf, uint32_t n);
-void rdtListen(RdtSocket_t* socket);
+int rdtSend(RdtSocket_t* socket, const void* buf, uint32_t n);
+int rdtSend_r(RdtState_t* c, RdtSocket_t* socket, const void* buf, uint32_t n);
+uint32_t rdtListen(RdtSocket_t* socket);
+uint32_t rdtListen_r(RdtState_t* c, RdtSocket_t* socket);
+uint32_t rdtServe(RdtSocket_t* socket, const RdtServerHooks_t* hooks, uint32_t connections);
+void rdtServeStop();
+int rdtConnect(RdtSocket_t* socket);
+int rdtConnect_r(RdtState_t* c, RdtSocket_t* socket);
+int rdtSendMessage(const void* buf, uint32_t n);
+int rdtSendMessage_r(RdtState_t* c, const void* buf, uint32_t n);
+int rdtSendMessageWithin(const void* buf, uint32_t n, uint32_t lifetime);
+int rdtSendMessageWithin_r(RdtState_t* c, const void* buf, uint32_t n, uint32_t lifetime);
+void rdtDisconnect();
+void rdtDisconnect_r(RdtState_t* c);
+uint8_t* rdtNextMessage(uint32_t* offset, uint32_t* n);
+uint8_t* rdtNextMessage_r(const RdtState_t* c, uint32_t* offset, uint32_t* n);
+int rdtSendAsync(RdtState_t* c, RdtSocket_t* socket, const void* buf, uint32_t n, const RdtCallbacks_t* callbacks);
+int rdtListenAsync(RdtState_t* c, RdtSocket_t* socket, const RdtCallbacks_t* callbacks);
+int rdtProcess(RdtState_t* c);
+int rdtFd(const RdtState_t* c);
+int rdtTimeout(const RdtState_t* c);
+int rdtStreamSend(uint16_t stream, const void* buf, uint32_t n, uint8_t priority);
+int rdtStreamSend_r(RdtState_t* c, uint16_t stream, const void* buf, uint32_t n, uint8_t priority);
+int rdtStreamFlush();
+int rdtStreamFlush_r(RdtState_t* c);
+uint8_t* rdtNextStreamMessage(uint16_t stream, uint32_t* offset, uint32_t* n);
+uint8_t* rdtNextStreamMessage_r(const RdtState_t* c, uint16_t stream, uint32_t* offset, uint32_t* n);
+uint8_t* rdtReply(uint32_t* n);
+uint8_t* rdtReply_r(const RdtState_t* c, uint32_t* n);
+void rdtGetStats(RdtStats_t* stats);
+void rdtGetStats_r(RdtState_t* c, RdtStats_t* stats);
+void rdtPrintStats(FILE* out, const RdtStats_t* stats);
+void fsm(int input);
+void rdtFsm(RdtState_t* c, const RdtEvent_t* event);
+void rdtPoll();
+RdtState_t* rdtCreateState();
+void rdtSwapState(RdtState_t* state);
+void rdtFreeState(RdtState_t* state);
 /* FUNCTIONS END */
 
 /* FSM MACRO VARIABLES START */
@@ -97,6 +312,9 @@ void rdtListen(RdtSocket_t* socket);
 #define RDT_STATE_DATA_SENT       ((int) 25)
 #define RDT_STATE_FIN_SENT        ((int) 26)
 #define RDT_STATE_FIN_RCV         ((int) 27)
+#define RDT_STATE_PERSIST         ((int) 28)
+#define RDT_ACTION_SND_FORWARD    ((int) 29)  // After the states, so traces already recorded decode the same.
+#define RDT_EVENT_RCV_FORWARD     ((int) 30)
 /* FSM MACRO VARIABLES END */
 
 
@@ -129,8 +347,12 @@ static const char* fsm_strings[] = {
     "ESTABLISHED",
     "DATA_SENT",
     "FIN_SENT",
-    "FIN_RCV"
+    "FIN_RCV",
+    "PERSIST",
+    "snd FORWARD",
+    "rcv FORWARD"
 };
+#define RDT_FSM_STRINGS ((int) (sizeof(fsm_strings) / sizeof(fsm_strings[0])))
 /* DEBUG STRINGS END */
 
 #endif  // SRC_RDTSOCKET_H_
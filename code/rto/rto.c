@@ -1,18 +1,29 @@
 //
 // 190010906, March 2022.
 //
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "rto.h"
 
-/* GLOBAL VARIABLES (using lecture notation) START */
-uint32_t T_rto, t_n, r_n, s_n, v_n;
-uint32_t T_rto = 0;
+/* GLOBAL VARIABLES START */
+int (*G_clock_hook)(struct timespec* now) = NULL; // If set, replaces CLOCK_MONOTONIC (e.g. a virtual clock).
 /* GLOBAL VARIABLES END */
 
 
+/* RTO CACHE START */
+RtoCacheEntry_t rto_cache[RTO_CACHE_SIZE];
+uint32_t        rto_cache_clock = 0;
+pthread_mutex_t rto_cache_lock = PTHREAD_MUTEX_INITIALIZER;   // Connections on several threads share the cache.
+/* RTO CACHE END */
+
+
 /**
  * Calculates current RTO from last measured RTT.
  *
@@ -20,17 +31,20 @@ uint32_t T_rto = 0;
  *
  * Values are in microseconds (us)
  *
- * @param r Measured rtt.
- * @return uint32_t current RTT.
+ * @param rto The connection's estimator, in lecture notation.
+ * @param r_n Measured rtt.
+ * @return uint32_t current RTO.
  */
-uint32_t calculateRTO(uint32_t r_n) {
-  if (T_rto == 0) {
+uint32_t calculateRTO(RtoState_t* rto, uint32_t r_n) {
+  uint32_t t_n;
+
+  if (rto->T_rto == 0) {
     /*
       The first measurement of RTT
       RFC6298(PS) Section 2.2
     */
-    s_n = r_n;
-    v_n = r_n >> 1; // r divide by 2
+    rto->s_n = r_n;
+    rto->v_n = r_n >> 1; // r divide by 2
   }
 
   else {
@@ -43,32 +57,40 @@ uint32_t calculateRTO(uint32_t r_n) {
     */
 
     // v <- (1 - beta) * v   +  beta * |s - r|
-    v_n = (v_n >> 1) + (v_n >> 2) + ((s_n > r_n ? s_n - r_n : r_n - s_n) >> 2);
+    rto->v_n = (rto->v_n >> 1) + (rto->v_n >> 2) + ((rto->s_n > r_n ? rto->s_n - r_n : r_n - rto->s_n) >> 2);
 
     // s <- (1 - alpha) * s                    +  alpha * r
-    s_n = (s_n >> 1) + (s_n >> 2) + (s_n >> 3) + (r_n >> 3);
+    rto->s_n = (rto->s_n >> 1) + (rto->s_n >> 2) + (rto->s_n >> 3) + (r_n >> 3);
   }
 
   /*
     RFC6298(PS) Sections 2.3 and 2.4
     t_n = s_n + Kv_n,   K = 4 = 10_2
   */
-  t_n = s_n + (v_n << 2);
+  t_n = rto->s_n + (rto->v_n << 2);
 
-  T_rto = t_n   < MIN_RTO ? MIN_RTO : t_n;   // RFC6298(PS) Section 2.4
-  T_rto = T_rto > MAX_RTO ? MAX_RTO : T_rto; // RFC6298(PS) Section 2.5
+  rto->T_rto = t_n        < MIN_RTO ? MIN_RTO : t_n;        // RFC6298(PS) Section 2.4
+  rto->T_rto = rto->T_rto > MAX_RTO ? MAX_RTO : rto->T_rto; // RFC6298(PS) Section 2.5
 
-  return T_rto;
+  return rto->T_rto;
+}
+
+/**
+ * Doubles the RTO after a timeout, up to MAX_RTO.
+ * @param rto The connection's estimator.
+ */
+void rtoBackoff(RtoState_t* rto) {
+  rto->T_rto = rto->T_rto * 2 > MAX_RTO ? MAX_RTO : rto->T_rto * 2;
 }
 
 /**
  * Calculate RTT from previous timestamp in microseconds
- * @param timestamp from packet send.
+ * @param timestamp from packet send, taken with CLOCK_MONOTONIC.
  * @return uint32_t RTT in microseconds
  */
 uint32_t calculateRTT(struct timespec* timestamp) {
   struct timespec current;
-  if (clock_gettime(CLOCK_REALTIME, &current)) {
+  if (rtoClock(&current)) {
     perror("Couldn't get current timestamp for RTT calculation");
   }
 
@@ -77,4 +99,239 @@ uint32_t calculateRTT(struct timespec* timestamp) {
   rtt += sec * 1e6;
 
   return rtt;
-}
\ No newline at end of file
+}
+
+/**
+ * Reads the clock used for RTT measurement: CLOCK_MONOTONIC, or G_clock_hook if set.
+ * @param now Set to the current time.
+ * @return 0 if successful, -1 otherwise.
+ */
+int rtoClock(struct timespec* now) {
+  if (G_clock_hook != NULL) {
+    return G_clock_hook(now);
+  }
+  return clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+/**
+ * Current time for the packet timestamp field. Uses CLOCK_MONOTONIC, so clock adjustments don't
+ * skew RTT samples.
+ * @return uint32_t time in microseconds, wrapping every ~71 minutes. Never 0, which means "none".
+ */
+uint32_t rtoTimestamp() {
+  struct timespec current;
+  if (rtoClock(&current)) {
+    perror("Couldn't get current timestamp");
+  }
+
+  uint32_t us = (uint32_t) current.tv_sec * 1000000 + (uint32_t) (current.tv_nsec / 1000);
+  return us != 0 ? us : 1;
+}
+
+/**
+ * Calculate RTT from a timestamp the peer echoed back to us.
+ * @param echo Our rtoTimestamp() when the acknowledged packet was sent.
+ * @return uint32_t RTT in microseconds. Unsigned subtraction handles the wrap.
+ */
+uint32_t calculateRTTEcho(uint32_t echo) {
+  return rtoTimestamp() - echo;
+}
+
+/**
+ * Empties the cache.
+ */
+void rtoCacheClear() {
+  pthread_mutex_lock(&rto_cache_lock);
+  memset(rto_cache, 0, sizeof(rto_cache));
+  rto_cache_clock = 0;
+  pthread_mutex_unlock(&rto_cache_lock);
+}
+
+/**
+ * Finds the cache entry for a peer. Called with rto_cache_lock held.
+ * @param addr Peer IPv4 address, network byte order.
+ * @return Pointer to the entry, or NULL if the peer isn't cached.
+ */
+RtoCacheEntry_t* rtoCacheFind(uint32_t addr) {
+  for (int i = 0; i < RTO_CACHE_SIZE; i++) {
+    if (rto_cache[i].addr == addr && addr != 0) {
+      return &rto_cache[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Seeds the RTT estimate and RTO of a new connection from what was last measured to the peer, so it
+ * doesn't start cold from the first RTT sample.
+ * @param rto The connection's estimator.
+ * @param addr Peer IPv4 address, network byte order.
+ * @param throughput Set to the throughput last achieved to the peer, if cached. May be NULL.
+ * @return true if seeded from the cache, false if the peer isn't cached (T_rto is reset to 0).
+ */
+bool rtoCacheSeed(RtoState_t* rto, uint32_t addr, uint32_t* throughput) {
+  pthread_mutex_lock(&rto_cache_lock);
+  RtoCacheEntry_t* entry = rtoCacheFind(addr);
+
+  if (entry == NULL) {
+    pthread_mutex_unlock(&rto_cache_lock);
+    rto->T_rto = 0;
+    return false;
+  }
+
+  rto->s_n = entry->srtt;
+  rto->v_n = entry->rttvar;
+  uint32_t t_n = rto->s_n + (rto->v_n << 2);
+
+  rto->T_rto = t_n        < MIN_RTO ? MIN_RTO : t_n;        // RFC6298(PS) Section 2.4
+  rto->T_rto = rto->T_rto > MAX_RTO ? MAX_RTO : rto->T_rto; // RFC6298(PS) Section 2.5
+
+  entry->used = ++rto_cache_clock;
+  if (throughput != NULL) {
+    *throughput = entry->throughput;
+  }
+  pthread_mutex_unlock(&rto_cache_lock);
+  return true;
+}
+
+/**
+ * Stores a connection's RTT estimate for its peer, replacing the least recently used entry if the
+ * cache is full. Does nothing if no RTT has been measured.
+ * @param rto The connection's estimator.
+ * @param addr Peer IPv4 address, network byte order.
+ * @param throughput Throughput achieved to the peer (bytes/s), or 0 to keep the cached value.
+ */
+void rtoCacheStore(const RtoState_t* rto, uint32_t addr, uint32_t throughput) {
+  if (rto->T_rto == 0 || addr == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&rto_cache_lock);
+  RtoCacheEntry_t* entry = rtoCacheFind(addr);
+
+  if (entry == NULL) {
+    entry = &rto_cache[0];
+    for (int i = 1; i < RTO_CACHE_SIZE; i++) {
+      if (rto_cache[i].used < entry->used) {
+        entry = &rto_cache[i];
+      }
+    }
+    memset(entry, 0, sizeof(RtoCacheEntry_t));
+    entry->addr = addr;
+  }
+
+  entry->srtt = rto->s_n;
+  entry->rttvar = rto->v_n;
+  if (throughput != 0) {
+    entry->throughput = throughput;
+  }
+  entry->used = ++rto_cache_clock;
+  pthread_mutex_unlock(&rto_cache_lock);
+}
+
+/**
+ * Loads the cache saved by rtoCacheSave(), so estimates carry over between runs.
+ * @param path Path of the cache file.
+ * @return 0 if loaded, -1 otherwise (the cache is left empty).
+ */
+int rtoCacheLoad(const char* path) {
+  uint8_t bytes[8 + sizeof(rto_cache)];
+  uint32_t value;
+
+  rtoCacheClear();
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  ssize_t r = read(fd, bytes, sizeof(bytes));
+  close(fd);
+
+  if (r != (ssize_t) sizeof(bytes) || memcmp(bytes, RTO_CACHE_MAGIC, 8) != 0) {
+    return -1;
+  }
+
+  /* Addresses stay in network byte order, the rest are stored big-endian */
+  uint8_t* p = bytes + 8;
+  pthread_mutex_lock(&rto_cache_lock);
+  for (int i = 0; i < RTO_CACHE_SIZE; i++) {
+    memcpy(&rto_cache[i].addr, p, sizeof(value));
+    memcpy(&value, p + 4, sizeof(value));
+    rto_cache[i].srtt = ntohl(value);
+    memcpy(&value, p + 8, sizeof(value));
+    rto_cache[i].rttvar = ntohl(value);
+    memcpy(&value, p + 12, sizeof(value));
+    rto_cache[i].throughput = ntohl(value);
+    memcpy(&value, p + 16, sizeof(value));
+    rto_cache[i].used = ntohl(value);
+    rto_cache_clock = rto_cache[i].used > rto_cache_clock ? rto_cache[i].used : rto_cache_clock;
+    p += sizeof(RtoCacheEntry_t);
+  }
+  pthread_mutex_unlock(&rto_cache_lock);
+
+  return 0;
+}
+
+/**
+ * Saves the cache. Written to a temporary file and renamed over the old one, so concurrent runs
+ * never see a torn file. It's only a hint, so it isn't synced.
+ * @param path Path of the cache file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int rtoCacheSave(const char* path) {
+  /* Held throughout, so threads saving at once don't share the temporary file */
+  pthread_mutex_lock(&rto_cache_lock);
+  int r = rtoCacheWrite(path);
+  pthread_mutex_unlock(&rto_cache_lock);
+  return r;
+}
+
+/**
+ * Writes the cache out for rtoCacheSave(). Called with rto_cache_lock held.
+ * @param path Path of the cache file.
+ * @return 0 if successful, -1 otherwise.
+ */
+int rtoCacheWrite(const char* path) {
+  uint8_t bytes[8 + sizeof(rto_cache)];
+  char tmp[FILENAME_MAX];
+  uint32_t value;
+
+  memcpy(bytes, RTO_CACHE_MAGIC, 8);
+  uint8_t* p = bytes + 8;
+  for (int i = 0; i < RTO_CACHE_SIZE; i++) {
+    memcpy(p, &rto_cache[i].addr, sizeof(value));
+    value = htonl(rto_cache[i].srtt);
+    memcpy(p + 4, &value, sizeof(value));
+    value = htonl(rto_cache[i].rttvar);
+    memcpy(p + 8, &value, sizeof(value));
+    value = htonl(rto_cache[i].throughput);
+    memcpy(p + 12, &value, sizeof(value));
+    value = htonl(rto_cache[i].used);
+    memcpy(p + 16, &value, sizeof(value));
+    p += sizeof(RtoCacheEntry_t);
+  }
+
+  if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid()) >= (int) sizeof(tmp)) {
+    return -1;
+  }
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (write(fd, bytes, sizeof(bytes)) != (ssize_t) sizeof(bytes)) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  close(fd);
+
+  if (rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
@@ -6,6 +6,7 @@
 #define CS3102_P2_RTO_H
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <time.h>
 
 #define HANDSHAKE_RTO ((uint32_t)  200000) // 200ms in microseconds
@@ -14,10 +15,37 @@
 #define RTO_TO_SEC(v_) ((uint32_t) v_ / 1000000)
 #define RTO_TO_USEC(v_) ((uint32_t) v_ % 1000000)
 #define US_TO_MS(v_) ((float) v_ / (float) 1000.0) // us to ms
+#define RTO_CACHE_SIZE 16
+#define RTO_CACHE_MAGIC "RDTRTO01"
 
-extern uint32_t T_rto;
+typedef struct RtoCacheEntry_s {
+  uint32_t addr;        // Peer IPv4 address, network byte order. 0 if the entry is unused.
+  uint32_t srtt;        // Smoothed RTT (us).
+  uint32_t rttvar;      // RTT variance (us).
+  uint32_t throughput;  // Throughput last achieved to the peer (bytes/s).
+  uint32_t used;        // When last stored or seeded from, for replacing the least recently used entry.
+} RtoCacheEntry_t;
 
-uint32_t calculateRTO(uint32_t r);
+/* RTO estimator of one connection (lecture notation) */
+typedef struct RtoState_s {
+  uint32_t T_rto;   // Current RTO (us), or 0 before the first RTT sample.
+  uint32_t s_n;     // Smoothed RTT (us).
+  uint32_t v_n;     // RTT variance (us).
+} RtoState_t;
+
+extern int (*G_clock_hook)(struct timespec* now);
+
+uint32_t calculateRTO(RtoState_t* rto, uint32_t r_n);
+void rtoBackoff(RtoState_t* rto);
 uint32_t calculateRTT(struct timespec* timestamp);
+uint32_t rtoTimestamp();
+uint32_t calculateRTTEcho(uint32_t echo);
+int rtoClock(struct timespec* now);
+void rtoCacheClear();
+bool rtoCacheSeed(RtoState_t* rto, uint32_t addr, uint32_t* throughput);
+void rtoCacheStore(const RtoState_t* rto, uint32_t addr, uint32_t throughput);
+int rtoCacheLoad(const char* path);
+int rtoCacheSave(const char* path);
+int rtoCacheWrite(const char* path);
 
 #endif //CS3102_P2_RTO_H
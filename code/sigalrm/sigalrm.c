@@ -15,6 +15,9 @@ struct sigaction G_sigalrm;
 /* timer value */
 struct itimerval G_timer;
 
+/* if set, setITIMER() arms this instead of ITIMER_REAL (e.g. a virtual clock) */
+int (*G_timer_hook)(unsigned int sec, unsigned int usec) = NULL;
+
 
 /*
  * Function: setITIMER
@@ -27,6 +30,10 @@ struct itimerval G_timer;
  * saleem, Nov2002
  */
 int setITIMER(uint32_t sec, uint32_t usec) {
+  if (G_timer_hook != NULL) {
+    return G_timer_hook(sec, usec);
+  }
+
   G_timer.it_interval.tv_sec = 0;
   G_timer.it_interval.tv_usec = 0;
   G_timer.it_value.tv_sec = sec;
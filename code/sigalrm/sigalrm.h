@@ -5,6 +5,7 @@
 #define G_ITIMER_US  ((unsigned int) 0) // microseconds
 
 extern sigset_t G_sigmask;
+extern int (*G_timer_hook)(unsigned int sec, unsigned int usec);
 
 int setITIMER(unsigned int sec, unsigned int usec);
 void setupSIGALRM();
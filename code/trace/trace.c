@@ -0,0 +1,215 @@
+//
+// 190010906, October 2026.
+//
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "../rto/rto.h"
+
+/*
+  Binary trace of fsm() transitions, cheap enough to leave on. Each transition claims a slot in a
+  fixed-size ring with one atomic add and fills it in; nothing locks, allocates or formats. A writer
+  interrupted by a signal handler that also traces just ends up with the next slot. A record's 'id' is
+  written last, with release ordering, so a reader can tell finished records from torn ones.
+
+  The ring lives in memory, or in a file mapped with rdtTraceOpen(), which survives a crash and is
+  decoded offline by RdtTrace. Records are in host byte order.
+*/
+
+/* GLOBAL VARIABLES START */
+union {
+  RdtTrace_t  header;
+  uint8_t     bytes[sizeof(RdtTrace_t) + RDT_TRACE_RECORDS * sizeof(RdtTraceRecord_t)];
+} G_trace_memory = { .header = { RDT_TRACE_MAGIC, RDT_TRACE_RECORDS, sizeof(RdtTraceRecord_t), 0 } };
+
+RdtTrace_t* G_trace = &G_trace_memory.header;
+size_t      G_trace_mapped = 0;   // Size of the mapping, if G_trace is a mapped file.
+/* GLOBAL VARIABLES END */
+
+
+/**
+ * Records one fsm() transition.
+ * @param old_state State before.
+ * @param new_state State after.
+ * @param input The input or event.
+ * @param output The action taken, or RDT_INVALID for none.
+ * @param seq Bytes sent or received so far.
+ * @param size Size of the buffer being sent or received.
+ * @param sender Non-zero on the sending side.
+ */
+void rdtTrace(int old_state, int new_state, int input, int output, uint32_t seq, uint32_t size, int sender) {
+  struct timespec now;
+  RdtTrace_t* trace = G_trace;
+  uint64_t i = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+  RdtTraceRecord_t* record = &trace->ring[i & (trace->records - 1)];
+
+  rtoClock(&now);
+
+  __atomic_store_n(&record->id, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record->timestamp = (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+  record->seq = seq;
+  record->size = size;
+  record->old_state = (uint8_t) old_state;
+  record->new_state = (uint8_t) new_state;
+  record->input = (uint8_t) input;
+  record->output = (uint8_t) output;
+  record->sender = sender != 0;
+  __atomic_store_n(&record->id, (uint32_t) (i + 1), __ATOMIC_RELEASE);
+}
+
+/**
+ * Moves tracing to a ring mapped from a file, so records reach the file without further calls and
+ * survive the process crashing. The file is truncated first.
+ * @param path Trace file to create.
+ * @param records Size of the ring, rounded up to a power of two.
+ * @return int 0 on success, -1 on error (tracing stays in memory).
+ */
+int rdtTraceOpen(const char* path, uint32_t records) {
+  uint32_t n = 1;
+  while (n < records) n <<= 1;
+  size_t size = sizeof(RdtTrace_t) + (size_t) n * sizeof(RdtTraceRecord_t);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("Couldn't create trace file");
+    return -1;
+  }
+  if (ftruncate(fd, (off_t) size) != 0) {
+    perror("Couldn't size trace file");
+    close(fd);
+    return -1;
+  }
+
+  RdtTrace_t* trace = (RdtTrace_t*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (trace == MAP_FAILED) {
+    perror("Couldn't map trace file");
+    return -1;
+  }
+
+  memcpy(trace->magic, RDT_TRACE_MAGIC, sizeof(trace->magic));
+  trace->records = n;
+  trace->record_size = sizeof(RdtTraceRecord_t);
+  trace->head = 0;
+
+  rdtTraceClose();
+  G_trace = trace;
+  G_trace_mapped = size;
+  return 0;
+}
+
+/**
+ * Unmaps the trace file, if there is one, and goes back to the in-memory ring.
+ */
+void rdtTraceClose() {
+  if (G_trace_mapped != 0) {
+    RdtTrace_t* trace = G_trace;
+    G_trace = &G_trace_memory.header;
+    munmap(trace, G_trace_mapped);
+    G_trace_mapped = 0;
+  }
+}
+
+/**
+ * Empties the current ring.
+ */
+void rdtTraceReset() {
+  memset(G_trace->ring, 0, (size_t) G_trace->records * sizeof(RdtTraceRecord_t));
+  G_trace->head = 0;
+}
+
+/**
+ * @return const RdtTrace_t* The current ring, for rdtTracePrint().
+ */
+const RdtTrace_t* rdtTraceGet() {
+  return G_trace;
+}
+
+/**
+ * Reads a trace file written through rdtTraceOpen().
+ * @param path Trace file.
+ * @return RdtTrace_t* The trace, to free(), or NULL if it can't be read or isn't a trace.
+ */
+RdtTrace_t* rdtTraceRead(const char* path) {
+  struct stat st;
+  RdtTrace_t header;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror("Couldn't open trace file");
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, RDT_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.record_size != sizeof(RdtTraceRecord_t) || header.records == 0 ||
+      (header.records & (header.records - 1)) != 0 ||
+      (uint64_t) st.st_size < sizeof(RdtTrace_t) + (uint64_t) header.records * sizeof(RdtTraceRecord_t)) {
+    printf("%s is not a trace file.\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = sizeof(RdtTrace_t) + (size_t) header.records * sizeof(RdtTraceRecord_t);
+  RdtTrace_t* trace = (RdtTrace_t*) malloc(size);
+  if (trace == NULL || pread(fd, trace, size, 0) != (ssize_t) size) {
+    perror("Couldn't read trace file");
+    free(trace);
+    close(fd);
+    return NULL;
+  }
+
+  close(fd);
+  return trace;
+}
+
+/**
+ * Prints the records still in a ring, oldest first, skipping torn or overwritten ones.
+ * @param out Where to print.
+ * @param trace The ring.
+ * @param names Names of states, inputs and outputs, by value (fsm_strings).
+ * @param count Number of names.
+ * @param csv Non-zero for CSV instead of aligned text.
+ */
+void rdtTracePrint(FILE* out, const RdtTrace_t* trace, const char* const names[], int count, int csv) {
+  uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > trace->records ? head - trace->records : 0;
+  uint64_t start = 0;
+
+#define NAME(v_) ((v_) < count ? names[(v_)] : "?")
+
+  if (csv) {
+    fprintf(out, "record,time_ns,side,old_state,input,new_state,output,seq,size\n");
+  } else if (first > 0) {
+    fprintf(out, "(%" PRIu64 " older records overwritten)\n", first);
+  }
+
+  for (uint64_t i = first; i < head; i++) {
+    const RdtTraceRecord_t* record = &trace->ring[i & (trace->records - 1)];
+    if (__atomic_load_n(&record->id, __ATOMIC_ACQUIRE) != (uint32_t) (i + 1)) {
+      continue;
+    }
+    if (start == 0) start = record->timestamp;
+
+    if (csv) {
+      fprintf(out, "%" PRIu64 ",%" PRIu64 ",%s,%s,%s,%s,%s,%u,%u\n", i, record->timestamp,
+              record->sender ? "sender" : "receiver", NAME(record->old_state), NAME(record->input),
+              NAME(record->new_state), NAME(record->output), record->seq, record->size);
+    } else {
+      fprintf(out, "%+12.6f %-8s old_state=%-12s input=%-12s new_state=%-12s output=%-12s seq=%u/%u\n",
+              (double) (record->timestamp - start) / 1e9, record->sender ? "sender" : "receiver",
+              NAME(record->old_state), NAME(record->input), NAME(record->new_state), NAME(record->output),
+              record->seq, record->size);
+    }
+  }
+
+#undef NAME
+}
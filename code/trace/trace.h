@@ -0,0 +1,44 @@
+//
+// 190010906, October 2026.
+//
+
+#ifndef CS3102_P2_TRACE_H
+#define CS3102_P2_TRACE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#define RDT_TRACE_MAGIC         "RDTTRC01"
+#define RDT_TRACE_RECORDS       ((uint32_t) 4096)    // In-memory ring. Power of two.
+#define RDT_TRACE_FILE_RECORDS  ((uint32_t) 262144)  // Ring mapped from a trace file. Power of two.
+
+typedef struct RdtTraceRecord_s {
+  uint64_t timestamp;   // ns, from the RTT clock.
+  uint32_t id;          // Record number + 1, written last. Anything else means torn or overwritten.
+  uint32_t seq;         // Bytes sent or received so far in this transfer, after the transition.
+  uint32_t size;        // Size of the connection's buffer (c->buf_size).
+  uint8_t  old_state;
+  uint8_t  new_state;
+  uint8_t  input;
+  uint8_t  output;
+  uint8_t  sender;      // 1 on the sending side.
+  uint8_t  unused[7];
+} RdtTraceRecord_t;
+
+typedef struct RdtTrace_s {
+  char              magic[8];
+  uint32_t          records;      // Size of the ring.
+  uint32_t          record_size;  // sizeof(RdtTraceRecord_t), to catch a decoder built differently.
+  uint64_t          head;         // Records ever written. The newest is ring[(head - 1) % records].
+  RdtTraceRecord_t  ring[];
+} RdtTrace_t;
+
+void rdtTrace(int old_state, int new_state, int input, int output, uint32_t seq, uint32_t size, int sender);
+int rdtTraceOpen(const char* path, uint32_t records);
+void rdtTraceClose();
+void rdtTraceReset();
+const RdtTrace_t* rdtTraceGet();
+RdtTrace_t* rdtTraceRead(const char* path);
+void rdtTracePrint(FILE* out, const RdtTrace_t* trace, const char* const names[], int count, int csv);
+
+#endif //CS3102_P2_TRACE_H